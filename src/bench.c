@@ -0,0 +1,585 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * hide-bench: times each phase of hiding (and then finding) a range of
+ * payloads in each carrier, with each number of threads asked for; the
+ * carriers are those given (or the sample images) along with synthetic
+ * BMP and JPEG images of the sizes asked for
+ */
+
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/* project includes */
+
+#include "hide.h"
+#include "job.h"
+#include "jpeg.h"
+
+#define LIST_MAX 32
+#define STRIPED_WIDTH  4096
+#define STRIPED_HEIGHT 2048
+#define STRIPED_BAND   4    /* MCU rows of noise, then as many of grey */
+
+typedef enum
+{
+	PAYLOAD_BYTE,   /* a single byte */
+	PAYLOAD_TEXT,   /* plain text, to half the capacity */
+	PAYLOAD_RANDOM, /* random bytes, to half the capacity */
+	PAYLOAD_FULL,   /* random bytes, to capacity */
+	PAYLOADS
+}
+payload_e;
+
+static const char *PAYLOAD_NAMES[] = { "byte", "text", "random", "full" };
+
+static const char *SAMPLES[] = { "original.bmp", "original.jpeg", "original.png", "original.tiff", "original.webp" };
+
+typedef struct
+{
+	int error;
+	bool found;        /* whether what was found is what was hidden */
+	job_stats_t hide;
+	job_stats_t find;
+}
+result_t;
+
+typedef struct
+{
+	char *carrier;
+	const char *format;
+	uint64_t pixels;
+	uint64_t capacity;
+	payload_e payload;
+	uint64_t size;
+	uint32_t threads;
+}
+bench_case_t;
+
+static plugins_t plugins;
+static bool json = false;
+static uint64_t rows = 0;
+static int failures = 0;
+
+static int parse_list(char *list, uint32_t *values)
+{
+	int n = 0;
+	char *save = NULL;
+	for (char *v = strtok_r(list, ",", &save); v && n < LIST_MAX; v = strtok_r(NULL, ",", &save))
+		values[n++] = strtoul(v, NULL, 0);
+	return n;
+}
+
+static void put_le(uint8_t *p, uint32_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		p[i] = v >> (8 * i);
+	return;
+}
+
+static void encode(const char *path, uint8_t *rgb, uint32_t width, uint32_t height, uint32_t threads)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return;
+	/* only the (empty) length is ever hidden in these */
+	uint8_t nothing[sizeof (uint64_t)] = { 0 };
+	jpeg_message_t msg = { 0, nothing };
+	jpeg_image_t image;
+	memset(&image, 0x00, sizeof image);
+	image.rgb = rgb;
+	image.width = width;
+	image.height = height;
+	image.quality = 85;
+	image.h_factor = 2;
+	image.v_factor = 2;
+	image.threads = threads;
+	jpeg_encode_data(f, &msg, &image);
+	fclose(f);
+	return;
+}
+
+/*
+ * a synthetic carrier: smooth gradients with some noise over them, so
+ * that it compresses roughly as a photograph would
+ */
+static int synthesise(const char *dir, uint32_t megapixels, char **bmp, char **jpeg)
+{
+	uint32_t side = ((uint32_t)sqrt(megapixels * 1000000.0)) & ~15u;
+	if (side < 16)
+		side = 16;
+	uint64_t length = (uint64_t)side * side * 3;
+	uint8_t *rgb = malloc(length);
+	if (!rgb)
+		return errno;
+	uint32_t noise = 0x2545F491;
+	for (uint32_t y = 0; y < side; y++)
+		for (uint32_t x = 0; x < side; x++)
+		{
+			noise ^= noise << 13, noise ^= noise >> 17, noise ^= noise << 5;
+			uint8_t *p = rgb + ((uint64_t)y * side + x) * 3;
+			p[0] = byte_limit((int)(x * 255ull / side) + (int)(noise & 0x0F) - 8, 0);
+			p[1] = byte_limit((int)(y * 255ull / side) + (int)((noise >> 8) & 0x0F) - 8, 0);
+			p[2] = byte_limit((int)((x + y) * 127ull / side) + (int)((noise >> 16) & 0x0F) - 8, 0);
+		}
+
+	asprintf(bmp, "%s/synthetic-%" PRIu32 "mp.bmp", dir, megapixels);
+	asprintf(jpeg, "%s/synthetic-%" PRIu32 "mp.jpeg", dir, megapixels);
+
+	FILE *f = fopen(*bmp, "wb");
+	if (f)
+	{
+		uint8_t header[54] = { 'B', 'M' };
+		put_le(header + 0x02, sizeof header + length, 4);
+		put_le(header + 0x0A, sizeof header, 4);
+		put_le(header + 0x0E, 40, 4);
+		put_le(header + 0x12, side, 4);
+		put_le(header + 0x16, side, 4);
+		put_le(header + 0x1A, 1, 2);
+		put_le(header + 0x1C, 24, 2);
+		put_le(header + 0x22, length, 4);
+		fwrite(header, sizeof header, 1, f);
+		uint8_t *row = malloc(side * 3);
+		for (uint32_t y = side; row && y > 0; y--)
+		{
+			for (uint32_t x = 0; x < side; x++)
+			{
+				const uint8_t *p = rgb + ((uint64_t)(y - 1) * side + x) * 3;
+				row[x * 3] = p[2], row[x * 3 + 1] = p[1], row[x * 3 + 2] = p[0];
+			}
+			fwrite(row, side * 3, 1, f);
+		}
+		free(row);
+		fclose(f);
+	}
+
+	encode(*jpeg, rgb, side, side, 0);
+
+	free(rgb);
+	return errno;
+}
+
+/*
+ * a JPEG whose content repeats down the image: bands of noise between
+ * flat grey, with a restart interval for each MCU row; its estimated
+ * capacity is sampled from evenly spaced strata, so sampling the same
+ * place in each would only ever see the noise, or only the grey
+ */
+static int synthesise_striped(const char *dir, char **jpeg)
+{
+	uint64_t length = (uint64_t)STRIPED_WIDTH * STRIPED_HEIGHT * 3;
+	uint8_t *rgb = malloc(length);
+	if (!rgb)
+		return errno;
+	uint32_t noise = 0x2545F491;
+	for (uint32_t y = 0; y < STRIPED_HEIGHT; y++)
+		for (uint32_t x = 0; x < STRIPED_WIDTH * 3; x++)
+		{
+			noise ^= noise << 13, noise ^= noise >> 17, noise ^= noise << 5;
+			rgb[(uint64_t)y * STRIPED_WIDTH * 3 + x] = (y / 16) % (2 * STRIPED_BAND) < STRIPED_BAND ? noise : 0x80;
+		}
+
+	asprintf(jpeg, "%s/striped.jpeg", dir);
+	/* enough threads for each to be given a single MCU row */
+	encode(*jpeg, rgb, STRIPED_WIDTH, STRIPED_HEIGHT, (STRIPED_HEIGHT / 16 + 3) / 4);
+
+	free(rgb);
+	return errno;
+}
+
+static int write_payload(const char *file, payload_e payload, uint64_t size)
+{
+	static const char TEXT[] = "hide is a steganographic tool for hiding data in, and retrieving data from, images; this is all it does. ";
+
+	FILE *f = fopen(file, "wb");
+	if (!f)
+		return errno;
+	uint8_t buffer[0x10000];
+	for (uint64_t done = 0; done < size; )
+	{
+		size_t n = size - done < sizeof buffer ? size - done : sizeof buffer;
+		for (size_t i = 0; i < n; i++)
+			buffer[i] = payload == PAYLOAD_TEXT ? TEXT[(done + i) % (sizeof TEXT - 1)] : (uint8_t)lrand48();
+		fwrite(buffer, n, 1, f);
+		done += n;
+	}
+	fclose(f);
+	return EXIT_SUCCESS;
+}
+
+static bool same_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+	if (stat(a, &sa) < 0 || stat(b, &sb) < 0 || sa.st_size != sb.st_size)
+		return false;
+	if (!sa.st_size)
+		return true;
+	int fa = open(a, O_RDONLY), fb = open(b, O_RDONLY);
+	void *ma = fa < 0 ? MAP_FAILED : mmap(NULL, sa.st_size, PROT_READ, MAP_SHARED, fa, 0);
+	void *mb = fb < 0 ? MAP_FAILED : mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fb, 0);
+	bool same = ma != MAP_FAILED && mb != MAP_FAILED && !memcmp(ma, mb, sa.st_size);
+	if (ma != MAP_FAILED)
+		munmap(ma, sa.st_size);
+	if (mb != MAP_FAILED)
+		munmap(mb, sb.st_size);
+	close(fa);
+	close(fb);
+	return same;
+}
+
+static double total(const job_stats_t *stats)
+{
+	double t = 0;
+	for (int i = JOB_READ; i < JOB_PHASES; i++)
+		t += stats->wall[i];
+	return t;
+}
+
+static void report(const bench_case_t *c, const result_t *r, long rss, double ratio)
+{
+	double hide = total(&r->hide);
+	double find = total(&r->find);
+	double mp = c->pixels / 1000000.0;
+	double mb = c->size / 1000000.0;
+	const char *status = r->error ? strerror(r->error) : r->found ? "ok" : "mismatch";
+
+	if (json)
+		printf("%s\n  { \"carrier\": \"%s\", \"format\": \"%s\", \"megapixels\": %.3f, \"capacity\": %" PRIu64 ", "
+				"\"payload\": \"%s\", \"payload_bytes\": %" PRIu64 ", \"threads\": %" PRIu32 ", "
+				"\"read_s\": %.6f, \"fit_s\": %.6f, \"embed_s\": %.6f, \"write_s\": %.6f, \"find_read_s\": %.6f, \"extract_s\": %.6f, "
+				"\"hide_mp_s\": %.3f, \"hide_mb_s\": %.3f, \"find_mp_s\": %.3f, \"find_mb_s\": %.3f, "
+				"\"peak_rss_kb\": %ld, \"size_ratio\": %.4f, \"status\": \"%s\" }",
+				rows ? "," : "", c->carrier, c->format, mp, c->capacity,
+				PAYLOAD_NAMES[c->payload], c->size, c->threads,
+				r->hide.wall[JOB_READ], r->hide.wall[JOB_FIT], r->hide.wall[JOB_PROCESS], r->hide.wall[JOB_WRITE], r->find.wall[JOB_READ], r->find.wall[JOB_PROCESS],
+				hide > 0 ? mp / hide : 0, hide > 0 ? mb / hide : 0, find > 0 ? mp / find : 0, find > 0 ? mb / find : 0,
+				rss, ratio, status);
+	else
+		printf("%s,%s,%.3f,%" PRIu64 ",%s,%" PRIu64 ",%" PRIu32 ",%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,%.3f,%.3f,%.3f,%ld,%.4f,%s\n",
+				c->carrier, c->format, mp, c->capacity,
+				PAYLOAD_NAMES[c->payload], c->size, c->threads,
+				r->hide.wall[JOB_READ], r->hide.wall[JOB_FIT], r->hide.wall[JOB_PROCESS], r->hide.wall[JOB_WRITE], r->find.wall[JOB_READ], r->find.wall[JOB_PROCESS],
+				hide > 0 ? mp / hide : 0, hide > 0 ? mb / hide : 0, find > 0 ? mp / find : 0, find > 0 ? mb / find : 0,
+				rss, ratio, status);
+	fflush(stdout);
+	rows++;
+	return;
+}
+
+/*
+ * each case runs in a child of its own, so that its peak memory use is
+ * its own, though the plugins (loaded beforehand) are shared by all
+ */
+static void run_case(const char *dir, const bench_case_t *c)
+{
+	char *payload = NULL, *output = NULL, *found = NULL;
+	asprintf(&payload, "%s/payload", dir);
+	asprintf(&found, "%s/found", dir);
+	const char *ext = strrchr(c->carrier, '.');
+	asprintf(&output, "%s/output%s", dir, ext ? ext : "");
+
+	result_t r;
+	memset(&r, 0x00, sizeof r);
+	long rss = 0;
+	int fds[2];
+	if (write_payload(payload, c->payload, c->size) || pipe(fds) < 0)
+	{
+		r.error = errno;
+		goto done;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		image_options_t options = { .threads = c->threads };
+		job_t hide, find;
+		memset(&hide, 0x00, sizeof hide);
+		memset(&find, 0x00, sizeof find);
+		hide.files = (hide_files_t){ c->carrier, payload, output };
+		find.files = (hide_files_t){ output, found, NULL };
+		job_run_loaded(&plugins, &hide, false, options);
+		if (!(r.error = hide.error))
+		{
+			job_run_loaded(&plugins, &find, false, options);
+			r.error = find.error;
+		}
+		r.found = !r.error && same_file(payload, found);
+		r.hide = hide.stats;
+		r.find = find.stats;
+		write(fds[1], &r, sizeof r);
+		_exit(EXIT_SUCCESS);
+	}
+	close(fds[1]);
+	if (pid < 0 || read(fds[0], &r, sizeof r) != sizeof r)
+		r.error = pid < 0 ? errno : ECHILD;
+	close(fds[0]);
+	if (pid > 0)
+	{
+		int status;
+		struct rusage usage;
+		if (wait4(pid, &status, 0, &usage) == pid)
+			rss = usage.ru_maxrss;
+	}
+
+done:
+	{
+		struct stat in, out;
+		double ratio = 0;
+		if (!r.error && !stat(c->carrier, &in) && !stat(output, &out) && in.st_size)
+			ratio = (double)out.st_size / in.st_size;
+		report(c, &r, rss, ratio);
+	}
+	unlink(payload);
+	unlink(output);
+	unlink(found);
+	free(payload);
+	free(output);
+	free(found);
+	return;
+}
+
+/*
+ * the exact capacity should be within the margin given with an estimate
+ * of it (at 95% confidence); for images which can't be sampled the
+ * estimate is exact anyway
+ */
+static void check_estimate(image_info_t image_info, uint64_t capacity)
+{
+	data_info_t data_info = { .options.estimate = true };
+	image_info.data = &data_info;
+	image_info.width = image_info.height = image_info.margin = 0;
+	image_info.buffer = NULL;
+	image_info.extra = NULL;
+	uint64_t estimate = image_info.info(&image_info);
+	image_info.free(image_info);
+	if (estimate <= capacity + image_info.margin && capacity <= estimate + image_info.margin)
+		return;
+	fprintf(stderr, "Estimated capacity of %s is %" PRIu64 " ± %" PRIu64 " bytes, but it's %" PRIu64 "\n", image_info.file, estimate, image_info.margin, capacity);
+	failures++;
+	return;
+}
+
+static void bench_carrier(const char *dir, char *carrier, uint32_t *threads, int thread_count, bool *payloads)
+{
+	image_info_t image_info = { .file = carrier };
+	const char *format = NULL;
+	for (int i = 0; i < plugins.count; i++)
+		if (plugins.formats[i]->is_type(carrier))
+		{
+			plugins_use(&image_info, plugins.formats[i]);
+			format = plugins.formats[i]->type;
+			break;
+		}
+	if (!format)
+	{
+		fprintf(stderr, "Unsupported image format %s\n", carrier);
+		return;
+	}
+
+	bench_case_t c = { carrier, format, 0, 0, PAYLOAD_BYTE, 0, 0 };
+	data_info_t data_info = { .hide = false };
+	image_info.data = &data_info;
+	/*
+	 * the pixels in the image (at full size), which isn't what the
+	 * plugins with a direct payload interface give for width and height
+	 */
+	if (image_info.preview && !image_info.preview(&image_info, 1))
+	{
+		c.pixels = image_info.width * image_info.height;
+		image_info.free(image_info);
+	}
+	image_info.width = image_info.height = 0;
+	image_info.buffer = NULL;
+	image_info.extra = NULL;
+	c.capacity = image_info.info(&image_info);
+	image_info.free(image_info);
+	check_estimate(image_info, c.capacity);
+
+	for (c.payload = PAYLOAD_BYTE; c.payload < PAYLOADS; c.payload++)
+	{
+		if (!payloads[c.payload])
+			continue;
+		c.size = c.payload == PAYLOAD_BYTE ? 1 : c.payload == PAYLOAD_FULL ? c.capacity : c.capacity / 2;
+		if (!c.size || c.size > c.capacity)
+			continue;
+		for (int i = 0; i < thread_count; i++)
+		{
+			c.threads = threads[i];
+			run_case(dir, &c);
+		}
+	}
+	return;
+}
+
+static int usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-j] [-t n,...] [-m n,...] [-p payload,...] [-d directory] [image...]\n", name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -j, --json             Give the results as JSON, rather than CSV\n");
+	fprintf(stderr, "  -t, --threads n,...    Thread counts to try (default: 1 and one per CPU)\n");
+	fprintf(stderr, "  -m, --megapixels n,... Sizes of synthetic images to try, or 0 for none (default: 1,4,16)\n");
+	fprintf(stderr, "  -p, --payloads p,...   Payloads to hide: byte, text, random, full (default: all)\n");
+	fprintf(stderr, "  -d, --directory d      Where to put synthetic images and outputs (default: $TMPDIR or /tmp)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Without any images, the sample images in the current directory are used.\n");
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t threads[LIST_MAX] = { 1, sysconf(_SC_NPROCESSORS_ONLN) };
+	int thread_count = threads[1] > 1 ? 2 : 1;
+	uint32_t megapixels[LIST_MAX] = { 1, 4, 16 };
+	int megapixel_count = 3;
+	bool payloads[PAYLOADS] = { true, true, true, true };
+	char *scratch = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+	struct option long_options[] =
+	{
+		{ "json",       no_argument,       NULL, 'j' },
+		{ "threads",    required_argument, NULL, 't' },
+		{ "megapixels", required_argument, NULL, 'm' },
+		{ "payloads",   required_argument, NULL, 'p' },
+		{ "directory",  required_argument, NULL, 'd' },
+		{ NULL,         0,                 NULL, 0   }
+	};
+	for (int c; (c = getopt_long(argc, argv, "jt:m:p:d:", long_options, NULL)) != -1; )
+		switch (c)
+		{
+			case 'j':
+				json = true;
+				break;
+			case 't':
+				if (!(thread_count = parse_list(optarg, threads)))
+					return usage(argv[0]);
+				break;
+			case 'm':
+				megapixel_count = parse_list(optarg, megapixels);
+				if (megapixel_count == 1 && !megapixels[0])
+					megapixel_count = 0;
+				break;
+			case 'p':
+			{
+				memset(payloads, 0x00, sizeof payloads);
+				char *save = NULL;
+				for (char *p = strtok_r(optarg, ",", &save); p; p = strtok_r(NULL, ",", &save))
+				{
+					int i = 0;
+					for (; i < PAYLOADS && strcmp(p, PAYLOAD_NAMES[i]); i++)
+						;
+					if (i == PAYLOADS)
+						return usage(argv[0]);
+					payloads[i] = true;
+				}
+				break;
+			}
+			case 'd':
+				scratch = optarg;
+				break;
+			default:
+				return usage(argv[0]);
+		}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!plugins_load(DIR_LIBRARY, &plugins))
+	{
+		fprintf(stderr, "Could not find any hide image libraries!\n");
+		return ENOENT;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stderr, "Loaded %d plugins in %.3f ms\n", plugins.count, ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9) * 1000);
+
+	char *dir = NULL;
+	asprintf(&dir, "%s/hide-bench-XXXXXX", scratch);
+	if (!mkdtemp(dir))
+	{
+		fprintf(stderr, "Could not create a directory in %s\n", scratch);
+		return errno;
+	}
+
+	if (json)
+		printf("[");
+	else
+		printf("carrier,format,megapixels,capacity,payload,payload_bytes,threads,read_s,fit_s,embed_s,write_s,find_read_s,extract_s,"
+				"hide_mp_s,hide_mb_s,find_mp_s,find_mb_s,peak_rss_kb,size_ratio,status\n");
+
+	if (optind < argc)
+		for (int i = optind; i < argc; i++)
+			bench_carrier(dir, argv[i], threads, thread_count, payloads);
+	else
+		for (size_t i = 0; i < sizeof SAMPLES / sizeof SAMPLES[0]; i++)
+			if (!access(SAMPLES[i], R_OK))
+				bench_carrier(dir, (char *)SAMPLES[i], threads, thread_count, payloads);
+
+	for (int i = 0; i < megapixel_count; i++)
+	{
+		char *bmp = NULL, *jpeg = NULL;
+		fprintf(stderr, "Creating %" PRIu32 " MP synthetic images\n", megapixels[i]);
+		if (synthesise(dir, megapixels[i], &bmp, &jpeg))
+			fprintf(stderr, "Could not create %" PRIu32 " MP synthetic images\n", megapixels[i]);
+		else
+		{
+			bench_carrier(dir, bmp, threads, thread_count, payloads);
+			bench_carrier(dir, jpeg, threads, thread_count, payloads);
+		}
+		unlink(bmp);
+		unlink(jpeg);
+		free(bmp);
+		free(jpeg);
+	}
+
+	if (megapixel_count)
+	{
+		char *striped = NULL;
+		fprintf(stderr, "Creating striped image\n");
+		if (synthesise_striped(dir, &striped))
+			fprintf(stderr, "Could not create striped image\n");
+		else
+			bench_carrier(dir, striped, threads, thread_count, payloads);
+		unlink(striped);
+		free(striped);
+	}
+
+	if (json)
+		printf("\n]\n");
+
+	rmdir(dir);
+	free(dir);
+	plugins_unload(&plugins);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
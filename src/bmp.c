@@ -30,6 +30,8 @@
 #include <netinet/in.h>
 
 #include "hide.h"
+#include "preview.h"
+#include "scratch.h"
 
 #define BI_RGB 0
 
@@ -66,14 +68,8 @@ static bool is_bmp(char *file_name)
 	return !memcmp(HEADER, header, sizeof header);
 }
 
-static int read_bmp(image_info_t *image_info, void (*progress_update)(uint64_t, uint64_t))
+static int read_header(FILE *bmp, image_info_t *image_info)
 {
-	errno = EXIT_SUCCESS;
-
-	FILE *bmp = fopen(image_info->file, "rb");
-	if (!bmp)
-		return errno;
-
 	fseek(bmp, 0x12, SEEK_SET);
 	uint32_t dword;
 	fread(&dword, sizeof dword, 1, bmp);
@@ -93,15 +89,24 @@ static int read_bmp(image_info_t *image_info, void (*progress_update)(uint64_t,
 			image_info->bpp = 3;
 			break;
 		default:
-			errno = ENOTSUP;
-			goto done;
+			return errno = ENOTSUP;
 	}
 	fread(&dword, sizeof dword, 1, bmp);
 	if (dword != BI_RGB)
-	{
-		errno = ENOTSUP;
+		return errno = ENOTSUP;
+	return errno;
+}
+
+static int read_bmp(image_info_t *image_info, void (*progress_update)(uint64_t, uint64_t))
+{
+	errno = EXIT_SUCCESS;
+
+	FILE *bmp = fopen(image_info->file, "rb");
+	if (!bmp)
+		return errno;
+
+	if (read_header(bmp, image_info))
 		goto done;
-	}
 
 	bmp_extra_t *extra = malloc(sizeof (bmp_extra_t));
 	fseek(bmp, 0x0A, SEEK_SET);
@@ -116,12 +121,13 @@ static int read_bmp(image_info_t *image_info, void (*progress_update)(uint64_t,
 	if (padding == 4)
 		padding = 0;
 
-	image_info->buffer = malloc(sizeof (uint8_t *) * image_info->height);
+	if (!(image_info->buffer = scratch_rows(image_info->height, image_info->width * image_info->bpp, SCRATCH_BUDGET(image_info))))
+		goto done;
 	fseek(bmp, extra->size, SEEK_SET);
 	for (uint64_t y = 0; y < image_info->height; y++)
 	{
-		image_info->buffer[y] = malloc(image_info->width * image_info->bpp);
 		fread(image_info->buffer[y], image_info->width, image_info->bpp, bmp);
+		scratch_rows_done(image_info->buffer, y);
 		uint32_t ignored = 0x00;
 		if (padding)
 			fread(&ignored, padding, 1, bmp);
@@ -154,14 +160,14 @@ static int write_bmp(image_info_t image_info, void (*progress_update)(uint64_t,
 	for (uint64_t y = 0; y < image_info.height; y++)
 	{
 		fwrite(image_info.buffer[y], image_info.width, image_info.bpp, bmp);
-		free(image_info.buffer[y]);
+		scratch_rows_done(image_info.buffer, y);
 		uint32_t ignored = 0;
 		if (padding)
 			fwrite(&ignored, padding, 1, bmp);
 		if (progress_update)
 			progress_update(y, image_info.height);
 	}
-	free(image_info.buffer);
+	scratch_rows_free(image_info.buffer);
 
 	free(extra->data);
 	free(extra);
@@ -171,18 +177,63 @@ static int write_bmp(image_info_t image_info, void (*progress_update)(uint64_t,
 	return errno;
 }
 
+/*
+ * the capacity only depends on the width and height, so there's no need
+ * to read any further than the header
+ */
 static uint64_t info_bmp(image_info_t *image_info)
 {
-	read_bmp(image_info, NULL);
+	FILE *bmp = fopen(image_info->file, "rb");
+	if (!bmp)
+		return 0;
+	read_header(bmp, image_info);
+	fclose(bmp);
 	return HIDE_CAPACITY;
 }
 
+static int preview_bmp(image_info_t *image_info, uint8_t scale)
+{
+	errno = EXIT_SUCCESS;
+
+	FILE *bmp = fopen(image_info->file, "rb");
+	if (!bmp)
+		return errno;
+
+	if (read_header(bmp, image_info))
+		goto done;
+	uint64_t width = image_info->width;
+	uint64_t height = image_info->height;
+	uint16_t bpp = image_info->bpp;
+
+	uint32_t offset;
+	fseek(bmp, 0x0A, SEEK_SET);
+	fread(&offset, sizeof offset, 1, bmp);
+	fseek(bmp, from_little_endian_32(offset), SEEK_SET);
+
+	/* rows are padded to a multiple of 4 bytes */
+	uint64_t length = (width * bpp + 3) & ~3ULL;
+	uint8_t *row = malloc(length);
+	preview_t preview = { NULL, 0, 0, 0, 0, NULL };
+	if (row && preview_start(&preview, image_info, width, height, scale))
+		/* from the bottom of the image up, with the pixels as BGR */
+		for (uint64_t y = 0; y < height && fread(row, length, 1, bmp); y++)
+			preview_row(&preview, height - 1 - y, row, bpp, true);
+	preview_finish(&preview);
+	free(row);
+
+done:
+	fclose(bmp);
+
+	return errno;
+}
+
 static void free_bmp(image_info_t image_info)
 {
-	for (uint64_t y = 0; y < image_info.height; y++)
-		free(image_info.buffer[y]);
-	free(image_info.buffer);
+	scratch_rows_free(image_info.buffer);
 	bmp_extra_t *extra = image_info.extra;
+	/* previews don't have anything else */
+	if (!extra)
+		return;
 	free(extra->data);
 	free(extra);
 }
@@ -196,5 +247,6 @@ extern image_type_t *init(void)
 	bmp.write = write_bmp;
 	bmp.info = info_bmp;
 	bmp.free = free_bmp;
+	bmp.preview = preview_bmp;
 	return &bmp;
 }
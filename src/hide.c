@@ -28,13 +28,19 @@
 #include <locale.h>
 
 #include <dlfcn.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <getopt.h>
+#include <signal.h>
 #include <pthread.h>
 
-#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __GLIBC__
+	#include <malloc.h>
+#endif
 
 /* submodule includes */
 
@@ -45,125 +51,32 @@
 /* project includes */
 
 #include "hide.h"
+#include "job.h"
+#include "serve.h"
+#include "shard.h"
+#include "scan.h"
 
 #ifdef BUILD_GUI
 	#include "gui-gtk.h"
 #endif
 
-#define DIR_LIBRARY "/usr/lib/"
-#define DIR_LOCAL "./"
-
-#undef HIDE_CAPACITY /* here image_info isn't a pointer but a local variable */
-#define HIDE_CAPACITY (image_info.width * image_info.height - sizeof (uint64_t))
-
 #ifndef __DEBUG__
 static cli_s ui;
 #endif
 
-static int process_file(data_info_t data_info, image_info_t image_info, void (*progress_update)(uint64_t, uint64_t))
-{
-	errno = EXIT_SUCCESS;
-
-	int64_t f = 0;
-	uint8_t *map = NULL;
-
-	if ((f = open(data_info.file, data_info.hide ? O_RDONLY : (O_RDWR | O_CREAT), S_IRUSR | S_IWUSR)) < 0)
-		die("Could not open %s", data_info.file);
-	if (data_info.hide && (map = mmap(NULL, ntohll(data_info.size), PROT_READ, MAP_SHARED, f, 0)) == MAP_FAILED)
-		die("Could not map file %s into memory", data_info.file);
-
-	uint8_t *z = (uint8_t *)&data_info.size;
-	for (uint64_t i = 0, y = 0; y < image_info.height; y++)
-	{
-		uint8_t *row = image_info.buffer[y];
-		for (uint64_t x = 0; x < image_info.width; x++)
-		{
-			uint8_t *ptr = &(row[x * image_info.bpp]);
-
-			if (data_info.hide)
-			{
-				unsigned char c;
-				if (y == 0 && x < sizeof data_info.size && !data_info.fill)
-					c = z[x];
-				else if (i < ntohll(data_info.size))
-					c = map[i];
-				else /* TODO use something more secure */
-					c = (uint8_t)lrand48();
-				ptr[0] = (ptr[0] & 0xF8) | ((c & 0xE0) >> 5); // r 3 lsb
-				ptr[1] = (ptr[1] & 0xFC) | ((c & 0x18) >> 3); // g 2 lsb
-				ptr[2] = (ptr[2] & 0xF8) |  (c & 0x07);       // b 3 lsb
-			}
-			else
-			{
-				unsigned char c = (ptr[0] & 0x07) << 5;
-				c |= (ptr[1] & 0x03) << 3;
-				c |= (ptr[2] & 0x07);
-				if (y == 0 && x < sizeof data_info.size && !data_info.fill)
-				{
-					z[x] = c;
-					if (x == sizeof data_info.size - 1)
-					{
-						ftruncate(f, ntohll(data_info.size));
-						if ((map = mmap(NULL, ntohll(data_info.size), PROT_READ | PROT_WRITE, MAP_SHARED, f, 0)) == MAP_FAILED)
-							die("Could not map file %s into memory", data_info.file);
-					}
-				}
-				else if (data_info.fill && map == NULL)
-				{
-					data_info.size = htonll(image_info.height * image_info.width * image_info.bpp);
-					ftruncate(f, ntohll(data_info.size));
-					if ((map = mmap(NULL, ntohll(data_info.size), PROT_READ | PROT_WRITE, MAP_SHARED, f, 0)) == MAP_FAILED)
-						die("Could not map file %s into memory", data_info.file);
-					map[i] = c;
-					errno = EXIT_SUCCESS;
-				}
-				else
-					map[i] = c;
-			}
-			if (y > 0 || x >= sizeof data_info.size)
-			{
-				i++;
-				if (progress_update)
-					progress_update(i, ntohll(data_info.size));
-			}
-			if (map && i >= ntohll(data_info.size) && !data_info.fill)
-				goto done;
-		}
-	}
-
-done:
-	munmap(map, ntohll(data_info.size));
-	close(f);
-	return errno;
-}
-
-static bool will_fit(data_info_t *data_info, image_info_t image_info)
+typedef enum
 {
-	/*
-	 * figure out how much data we can hide
-	 */
-	struct stat s;
-	stat(data_info->file, &s);
-	if ((uint64_t)s.st_size > HIDE_CAPACITY)
-	{
-		errno = ENOSPC;
-		return false;
-	}
-	data_info->size = htonll(s.st_size);
-	data_info->hide = true;
-	return true;
-}
-
-static int selector(const struct dirent *d)
-{
-	return !strncmp("hide-", d->d_name, 5);
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON
 }
+stats_e;
 
 static void *find_supported_formats(char *path, image_info_t *image_info)
 {
 	void *so = NULL;
 	struct dirent **eps;
-	int n = scandir(path, &eps, selector, NULL);
+	int n = scandir(path, &eps, plugins_selector, NULL);
 	char buffer[80] = "Supported image formats: ";
 	if (n == 0)
 	{
@@ -207,10 +120,7 @@ static void *find_supported_formats(char *path, image_info_t *image_info)
 		}
 		else if (format->is_type(image_info->file))
 		{
-			image_info->read = format->read;
-			image_info->write = format->write;
-			image_info->info = format->info;
-			image_info->free = format->free;
+			plugins_use(image_info, format);
 			break;
 		}
 		dlclose(so);
@@ -244,14 +154,17 @@ extern void *process(void *args)
 {
 	process_options_t *options = args;
 	hide_files_t files = options->files;
-	image_info_t image_info = { files.image_in, NULL, NULL, NULL, NULL, 0, 0, 0, NULL, NULL };
-	data_info_t data_info = { files.data_file, 0, false, options->fill };
+	image_info_t image_info = { .file = files.image_in };
+	char *why = NULL;
 
+	job_watch_t watch;
+	job_watch_start(&watch, options->image.threads);
 	void *so = find_supported_formats(DIR_LIBRARY, &image_info);
 	if (!so)
 		pthread_exit(&errno);
+	job_watch_lap(&watch, options->stats, JOB_LOAD);
 
-	if (!(image_info.read && image_info.write))
+	if (!(image_info.read && (image_info.write || image_info.embed)))
 	{
 		fprintf(stderr, "Unsupported image format\n");
 		find_supported_formats(DIR_LIBRARY, NULL);
@@ -259,97 +172,661 @@ extern void *process(void *args)
 		goto done;
 	}
 
-	/*
-	 * current hack for JPEG images: use ->extra to indicate whether
-	 * hiding or finding
-	 */
-	data_info.hide = (bool)files.image_out;
-	image_info.extra = &data_info;
-
 #ifndef __DEBUG__
 	*ui.status = CLI_RUN;
-	ui.total->offset = 0;
-	ui.total->size = files.image_out ? 3 : 2;
+	if (job_run(image_info, files, options->fill, options->image, ui.total, progress_current_update, options->stats, &why))
+#else
+	if (job_run(image_info, files, options->fill, options->image, NULL, progress_current_update, options->stats, &why))
 #endif
+		die("%s", why ? why : "Failed during data processing");
+
+done:
+	dlclose(so);
+#ifndef __DEBUG__
+	*ui.status = CLI_DONE;
+	pthread_exit(&errno);
+#else
+	return &errno;
+#endif
+}
+
+typedef struct
+{
+	plugins_t plugins;
+	job_t *jobs;
+	size_t total;
+	size_t next;              /* next job to be claimed by a worker */
+	bool fill;
+	image_options_t options;
+}
+batch_t;
+
+/*
+ * workers claim jobs in turn until there are none left
+ */
+static void *batch_worker(void *arg)
+{
+	batch_t *batch = arg;
+
+	for (size_t i; (i = __sync_fetch_and_add(&batch->next, 1)) < batch->total; )
+		job_run_loaded(&batch->plugins, &batch->jobs[i], batch->fill, batch->options);
+	return NULL;
+}
+
+static int not_hidden(const struct dirent *d)
+{
+	return d->d_name[0] != '.';
+}
+
+/*
+ * jobs are given by a manifest, one per line, with the same arguments as
+ * a single run (separated by whitespace; blank lines and those starting
+ * with # are skipped), or a directory, whose images are all sized up
+ */
+static int read_jobs(char *manifest, batch_t *batch)
+{
+	struct stat s;
+	if (stat(manifest, &s) < 0)
+	{
+		fprintf(stderr, "Could not read batch %s\n", manifest);
+		return errno;
+	}
+
+	if (S_ISDIR(s.st_mode))
+	{
+		struct dirent **eps;
+		int n = scandir(manifest, &eps, not_hidden, alphasort);
+		if (n < 0)
+		{
+			fprintf(stderr, "Could not read batch %s\n", manifest);
+			return errno;
+		}
+		if (!(batch->jobs = calloc(n ? n : 1, sizeof (job_t))))
+			return errno;
+		for (int i = 0; i < n; i++)
+		{
+			asprintf(&batch->jobs[batch->total++].files.image_in, "%s/%s", manifest, eps[i]->d_name);
+			free(eps[i]);
+		}
+		free(eps);
+		return EXIT_SUCCESS;
+	}
+
+	FILE *f = fopen(manifest, "r");
+	if (!f)
+	{
+		fprintf(stderr, "Could not read batch %s\n", manifest);
+		return errno;
+	}
+	size_t space = 0;
+	errno = EXIT_SUCCESS;
+	char *line = NULL;
+	size_t length = 0;
+	for (int l = 1; getline(&line, &length, f) >= 0; l++)
+	{
+		char *args[4] = { NULL, NULL, NULL, NULL };
+		int n = 0;
+		char *save = NULL;
+		for (char *a = strtok_r(line, " \t\r\n", &save); a && n < 4; a = strtok_r(NULL, " \t\r\n", &save))
+			args[n++] = a;
+		if (!n || args[0][0] == '#')
+			continue;
+		if (n > 3)
+		{
+			fprintf(stderr, "Too many arguments for a job at %s:%d\n", manifest, l);
+			errno = EINVAL;
+			break;
+		}
+		if (batch->total == space)
+		{
+			job_t *jobs = realloc(batch->jobs, (space = space ? space * 2 : 64) * sizeof (job_t));
+			if (!jobs)
+				break;
+			batch->jobs = jobs;
+		}
+		job_t *job = &batch->jobs[batch->total++];
+		memset(job, 0x00, sizeof (job_t));
+		job->files.image_in = strdup(args[0]);
+		job->files.data_file = args[1] ? strdup(args[1]) : NULL;
+		job->files.image_out = args[2] ? strdup(args[2]) : NULL;
+	}
+	free(line);
+	fclose(f);
+	return errno;
+}
+
+static int batch(char *manifest, bool fill, image_options_t options, uint32_t workers, stats_e stats)
+{
+	batch_t batch = { { NULL, NULL, 0 }, NULL, 0, 0, fill, options };
+
+	if (read_jobs(manifest, &batch))
+		goto done;
+	if (!plugins_load(DIR_LIBRARY, &batch.plugins))
+	{
+		fprintf(stderr, "Could not find any hide image libraries!\n");
+		errno = ENOENT;
+		goto done;
+	}
 
 	/*
-	 * read the source image
+	 * the pool of workers provides the parallelism, so unless told
+	 * otherwise each job gets just the one thread
+	 */
+	if (!batch.options.threads)
+		batch.options.threads = 1;
+	if (!workers)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > batch.total)
+		workers = batch.total;
+#ifdef __GLIBC__
+	/*
+	 * keep the (large) image buffers of one job in the heap for the next
+	 * rather than handing them back to the kernel and faulting them in
+	 * all over again
 	 */
-	if (image_info.read(&image_info, progress_current_update))
-		die("Failed to read source image");
+	mallopt(M_MMAP_THRESHOLD, 32 * 1024 * 1024);
+	mallopt(M_TRIM_THRESHOLD, 256 * 1024 * 1024);
+#endif
 
-	if (files.image_out)
+	pthread_t *t = calloc(workers ? workers : 1, sizeof (pthread_t));
+	if (!t)
+		goto done;
+	uint32_t started = 0;
+	for (; started < workers; started++)
+		if (pthread_create(&t[started], NULL, batch_worker, &batch))
+			break;
+	if (!started)
+		batch_worker(&batch);
+	for (uint32_t i = 0; i < started; i++)
+		pthread_join(t[i], NULL);
+	free(t);
+
+	/*
+	 * report on every job, in the order they were given
+	 */
+	setlocale(LC_NUMERIC, "");
+	size_t failed = 0;
+	for (size_t i = 0; i < batch.total; i++)
 	{
-		if (!will_fit(&data_info, image_info))
-			die("Too much data to hide; find a larger image\nAvailable capacity: %" PRIu64 " bytes\n", HIDE_CAPACITY);
-		/*
-		 * overlay the data on the image
-		 */
-#ifndef __DEBUG__
-		ui.total->offset++;
-#endif
-		if (process_file(data_info, image_info, progress_current_update))
-			die("Failed during data processing");
-		/*
-		 * write the image with the hidden data
-		 */
-#ifndef __DEBUG__
-		ui.total->offset++;
-#endif
-		image_info.file = files.image_out;
-		if (image_info.write(image_info, progress_current_update))
-			die("Failed to write output image");
+		job_t *job = &batch.jobs[i];
+		if (job->error)
+		{
+			failed++;
+			if (job->error == EFTYPE)
+				printf("failed\t%s\t%s\n", job->files.image_in, job->why);
+			else
+				printf("failed\t%s\t%s: %s\n", job->files.image_in, job->why ? job->why : "Failed", strerror(job->error));
+		}
+		else if (!job->files.data_file && job->margin)
+			printf("ok\t%s\t%'" PRIu64 " bytes (estimated, ± %'" PRIu64 ")\n", job->files.image_in, job->capacity, job->margin);
+		else if (!job->files.data_file)
+			printf("ok\t%s\t%'" PRIu64 " bytes\n", job->files.image_in, job->capacity);
+		else
+			printf("ok\t%s\n", job->files.image_in);
+		if (stats)
+			job_stats_print(stderr, job->files.image_in, &job->stats, stats == STATS_JSON);
 	}
+	if (failed)
+		fprintf(stderr, "%zu of %zu jobs failed\n", failed, batch.total);
+	errno = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+done:
+	plugins_unload(&batch.plugins);
+	for (size_t i = 0; i < batch.total; i++)
+	{
+		free(batch.jobs[i].files.image_in);
+		free(batch.jobs[i].files.data_file);
+		free(batch.jobs[i].files.image_out);
+		free(batch.jobs[i].why);
+	}
+	free(batch.jobs);
+	return errno;
+}
+
+typedef struct
+{
+	plugins_t plugins;
+	int socket;
+	image_options_t options;
+}
+server_t;
+
+/*
+ * turn a request (see serve.h) into a job, with any files given as
+ * descriptors found by way of /dev/fd
+ */
+static int parse_request(char *request, ssize_t length, int *fds, int count, job_t *job, uint8_t *flags)
+{
+	char **files[HIDE_SERVE_FILES] = { &job->files.image_in, &job->files.data_file, &job->files.image_out };
+	int needed = 0;
+
+	errno = EINVAL;
+	if (length < 3 || request[length - 1])
+		return job_fail(&job->why, "Malformed request");
+	switch (request[0])
+	{
+		case HIDE_SERVE_HIDE:
+			needed = 3;
+			break;
+		case HIDE_SERVE_FIND:
+			needed = 2;
+			break;
+		case HIDE_SERVE_CAPACITY:
+			needed = 1;
+			break;
+		default:
+			return job_fail(&job->why, "Unknown request %c", request[0]);
+	}
+	*flags = request[1];
+
+	int given = 0;
+	int used = 0;
+	for (char *p = request + 2; p < request + length; p += strlen(p) + 1, given++)
+	{
+		if (given == needed)
+			return job_fail(&job->why, "Too many files for request %c", request[0]);
+		if (*p)
+			*files[given] = strdup(p);
+		else if (used < count)
+			asprintf(files[given], "/dev/fd/%d", fds[used++]);
+		else
+			return job_fail(&job->why, "Missing file descriptor");
+	}
+	if (given < needed)
+		return job_fail(&job->why, "Too few files for request %c", request[0]);
+	return errno = EXIT_SUCCESS;
+}
+
+static void serve_client(const server_t *server, int c)
+{
+	for (;;)
+	{
+		char request[HIDE_SERVE_MAX];
+		union
+		{
+			struct cmsghdr align;
+			char buffer[CMSG_SPACE(HIDE_SERVE_FILES * sizeof (int))];
+		}
+		control;
+		struct iovec iov = { request, sizeof request };
+		struct msghdr m;
+		memset(&m, 0x00, sizeof m);
+		m.msg_iov = &iov;
+		m.msg_iovlen = 1;
+		m.msg_control = control.buffer;
+		m.msg_controllen = sizeof control.buffer;
+
+		ssize_t length = recvmsg(c, &m, 0);
+		if (length <= 0)
+			return;
+
+		int fds[HIDE_SERVE_FILES];
+		int count = 0;
+		for (struct cmsghdr *h = CMSG_FIRSTHDR(&m); h; h = CMSG_NXTHDR(&m, h))
+			if (h->cmsg_level == SOL_SOCKET && h->cmsg_type == SCM_RIGHTS)
+				for (size_t i = 0; i < (h->cmsg_len - CMSG_LEN(0)) / sizeof (int); i++)
+				{
+					int fd;
+					memcpy(&fd, CMSG_DATA(h) + i * sizeof fd, sizeof fd);
+					if (count < HIDE_SERVE_FILES)
+						fds[count++] = fd;
+					else
+						close(fd);
+				}
+
+		job_t job;
+		memset(&job, 0x00, sizeof job);
+		uint8_t flags = 0;
+		if (m.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		{
+			errno = EMSGSIZE;
+			job.error = job_fail(&job.why, "Request too long");
+		}
+		else if (!(job.error = parse_request(request, length, fds, count, &job, &flags)))
+		{
+			image_options_t options = server->options;
+			options.estimate = flags & HIDE_SERVE_ESTIMATE;
+			job_run_loaded(&server->plugins, &job, flags & HIDE_SERVE_FILL, options);
+		}
+
+		uint8_t response[HIDE_SERVE_MAX];
+		uint32_t error = htonl(job.error);
+		uint64_t capacity = htonll(job.capacity);
+		uint64_t margin = htonll(job.margin);
+		memcpy(response, &error, sizeof error);
+		memcpy(response + sizeof error, &capacity, sizeof capacity);
+		memcpy(response + sizeof error + sizeof capacity, &margin, sizeof margin);
+		size_t size = HIDE_SERVE_HEADER;
+		if (job.error)
+			size += snprintf((char *)response + size, sizeof response - size, "%s", job.why ? job.why : "Failed") + 1;
+		if (size > sizeof response)
+			size = sizeof response;
+		send(c, response, size, MSG_NOSIGNAL);
+
+		for (int i = 0; i < count; i++)
+			close(fds[i]);
+		free(job.files.image_in);
+		free(job.files.data_file);
+		free(job.files.image_out);
+		free(job.why);
+	}
+}
+
+/*
+ * each worker serves one client at a time, for as long as it stays
+ * connected; any more wait to be accepted
+ */
+static void *serve_worker(void *arg)
+{
+	const server_t *server = arg;
+
+	for (;;)
+	{
+		int c = accept(server->socket, NULL, NULL);
+		if (c < 0)
+		{
+			if (errno == EBADF || errno == EINVAL)
+				break;
+			continue;
+		}
+		serve_client(server, c);
+		close(c);
+	}
+	return NULL;
+}
+
+/*
+ * a socket left behind by a server which didn't get to tidy up (one that
+ * was killed, say) refuses connections, and can be replaced; one which
+ * is still in use (or isn't a socket at all) is left alone
+ */
+static bool stale_socket(const struct sockaddr_un *address)
+{
+	struct stat st;
+	if (errno != EADDRINUSE || lstat(address->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode))
+		return false;
+	int s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (s < 0)
+		return false;
+	bool stale = connect(s, (const struct sockaddr *)address, sizeof *address) < 0 && errno == ECONNREFUSED;
+	close(s);
+	if (stale && unlink(address->sun_path) < 0)
+		stale = false;
+	errno = EADDRINUSE;
+	return stale;
+}
+
+static int serve(char *path, image_options_t options, uint32_t workers)
+{
+	server_t server = { { NULL, NULL, 0 }, -1, options };
+	struct sockaddr_un address;
+
+	memset(&address, 0x00, sizeof address);
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof address.sun_path)
+	{
+		fprintf(stderr, "Socket path too long %s\n", path);
+		return errno = ENAMETOOLONG;
+	}
+	strcpy(address.sun_path, path);
+
+	if (!plugins_load(DIR_LIBRARY, &server.plugins))
+	{
+		fprintf(stderr, "Could not find any hide image libraries!\n");
+		return errno = ENOENT;
+	}
+	if ((server.socket = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0
+			|| (bind(server.socket, (struct sockaddr *)&address, sizeof address) < 0
+				&& (!stale_socket(&address) || bind(server.socket, (struct sockaddr *)&address, sizeof address) < 0))
+			|| listen(server.socket, SOMAXCONN) < 0)
+	{
+		int e = errno;
+		fprintf(stderr, "Could not listen on %s\n", path);
+		if (server.socket >= 0)
+			close(server.socket);
+		plugins_unload(&server.plugins);
+		return errno = e;
+	}
+
+	if (!server.options.threads)
+		server.options.threads = 1;
+	if (!workers)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/*
+	 * signals are left to this thread alone, which only has to tidy up
+	 * the socket; requests still being worked on are abandoned
+	 */
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	pthread_attr_t a;
+	pthread_attr_init(&a);
+	pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED);
+	uint32_t started = 0;
+	for (pthread_t t; started < workers; started++)
+		if (pthread_create(&t, &a, serve_worker, &server))
+			break;
+	pthread_attr_destroy(&a);
+
+	int s = 0;
+	if (started)
+		sigwait(&signals, &s);
 	else
+		fprintf(stderr, "Could not start any workers\n");
+	unlink(path);
+	return errno = started ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * a number of bytes, optionally with a (binary) K, M, G or T suffix
+ */
+static uint64_t parse_size(const char *s)
+{
+	char *end = NULL;
+	uint64_t n = strtoull(s, &end, 0);
+	switch (*end)
 	{
-		/*
-		 * extract the hidden data
-		 */
-#ifndef __DEBUG__
-		ui.total->offset++;
-#endif
-		if (process_file(data_info, image_info, progress_current_update))
-			die("Failed during data processing");
-		image_info.free(image_info);
+		case 'T': case 't':
+			n <<= 10;
+			/* fall through */
+		case 'G': case 'g':
+			n <<= 10;
+			/* fall through */
+		case 'M': case 'm':
+			n <<= 10;
+			/* fall through */
+		case 'K': case 'k':
+			n <<= 10;
+			end++;
+			break;
 	}
+	return *end || end == s ? 0 : n;
+}
 
-#ifndef __DEBUG__
-	ui.total->offset = ui.total->size;
-#endif
-	errno = EXIT_SUCCESS;
-done:
-	dlclose(so);
-#ifndef __DEBUG__
-	*ui.status = CLI_DONE;
-	pthread_exit(&errno);
-#else
-	return &errno;
-#endif
+static int usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-f] [-r] [-o] [-q n] [-s n] [-t n] [-m n] <source image> <file to hide> <output image>\n", name);
+	fprintf(stderr, "       %s [-f] [-t n] [-m n] <image> <recovered file>\n", name);
+	fprintf(stderr, "       %s [-e] [-t n] [-m n] <image>\n", name);
+	fprintf(stderr, "       %s [-f] [-r] [-o] [-q n] [-s n] [-t n] [-m n] [-e] [-j n] -b <manifest | directory>\n", name);
+	fprintf(stderr, "       %s [-r] [-o] [-q n] [-s n] [-t n] [-m n] [-j n] -l <socket>\n", name);
+	fprintf(stderr, "       %s [-f] [-t n] [-m n] [-j n] --split <directory> <file to hide> <image>...\n", name);
+	fprintf(stderr, "       %s [-f] [-t n] [-m n] [-j n] --join <recovered file> <image>...\n", name);
+	fprintf(stderr, "       %s [-e] [-t n] [-m n] [-j n] [--index f] --scan[=json] <directory | image>...\n", name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -f, --fill        Fill the image to capacity (no length is stored)\n");
+	fprintf(stderr, "  -r, --recompress  Decode and re-encode lossy images (JPEG)\n");
+	fprintf(stderr, "  -o, --optimise    Optimise Huffman tables when re-encoding (JPEG)\n");
+	fprintf(stderr, "  -q, --quality n   Re-encode at quality n (1-100), not the original's (JPEG)\n");
+	fprintf(stderr, "  -s, --subsample n Re-encode with chroma subsampling n (444, 422, 420) (JPEG)\n");
+	fprintf(stderr, "  -t, --threads n   Decode and encode with n threads (default: one per CPU)\n");
+	fprintf(stderr, "  -e, --estimate    Estimate the capacity from a sample of the image (JPEG)\n");
+	fprintf(stderr, "  -m, --max-memory n Keep each image within n bytes (K, M, G) of memory, spilling the rest to $TMPDIR\n");
+	fprintf(stderr, "  -b, --batch b     Run each job in the manifest (or size up each image in the directory) b\n");
+	fprintf(stderr, "  -l, --listen s    Serve requests on the Unix domain socket s\n");
+	fprintf(stderr, "  -j, --jobs n      Run n batch jobs, pieces, images, or clients at once (default: one per CPU)\n");
+	fprintf(stderr, "      --split d     Hide the file in as few of the images as it takes, written to directory d\n");
+	fprintf(stderr, "      --join f      Find the pieces of a split file in the images, putting them back together in f\n");
+	fprintf(stderr, "      --scan[=json] Show the capacity, format and size of every image in the directories, as CSV (or JSON)\n");
+	fprintf(stderr, "      --index f     Keep what was scanned in f, rather than $XDG_CACHE_HOME/%s\n", HIDE_SCAN_INDEX);
+	fprintf(stderr, "      --stats[=json] Report the time and resources each phase of each job took (on stderr)\n");
+	fprintf(stderr, "\n");
+	find_supported_formats(DIR_LIBRARY, NULL);
+	return EXIT_FAILURE;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc < 2 || argc > 5)
+	process_options_t options = { .fill = false, .stats = NULL };
+	char *manifest = NULL;
+	char *listen_on = NULL;
+	char *split = NULL;
+	char *join = NULL;
+	stats_e scan_as = STATS_NONE;
+	char *index = NULL;
+	uint32_t workers = 0;
+	stats_e stats = STATS_NONE;
+	job_stats_t job_stats;
+	memset(&job_stats, 0x00, sizeof job_stats);
+
+	struct option long_options[] =
 	{
-		fprintf(stderr, "Usage: %s [-f] <source image> <file to hide> <output image>\n", argv[0]);
-		fprintf(stderr, "       %s [-f] <image> <recovered file>\n", argv[0]);
-		fprintf(stderr, "       %s <image>\n", argv[0]);
-		find_supported_formats(DIR_LIBRARY, NULL);
-		return EXIT_FAILURE;
-	}
-	else if (argc == 2)
+		{ "fill",       no_argument,       NULL, 'f' },
+		{ "recompress", no_argument,       NULL, 'r' },
+		{ "optimise",   no_argument,       NULL, 'o' },
+		{ "quality",    required_argument, NULL, 'q' },
+		{ "subsample",  required_argument, NULL, 's' },
+		{ "threads",    required_argument, NULL, 't' },
+		{ "estimate",   no_argument,       NULL, 'e' },
+		{ "max-memory", required_argument, NULL, 'm' },
+		{ "batch",      required_argument, NULL, 'b' },
+		{ "jobs",       required_argument, NULL, 'j' },
+		{ "listen",     required_argument, NULL, 'l' },
+		{ "stats",      optional_argument, NULL, 'S' },
+		{ "split",      required_argument, NULL, 'P' },
+		{ "join",       required_argument, NULL, 'J' },
+		{ "scan",       optional_argument, NULL, 'C' },
+		{ "index",      required_argument, NULL, 'I' },
+		{ NULL,         0,                 NULL, 0   }
+	};
+	for (int c; (c = getopt_long(argc, argv, "froq:s:t:em:b:j:l:", long_options, NULL)) != -1; )
+		switch (c)
+		{
+			case 'f':
+				options.fill = true;
+				break;
+			case 'r':
+				options.image.recompress = true;
+				break;
+			case 'o':
+				options.image.optimise = true;
+				break;
+			case 'q':
+			{
+				unsigned long q = strtoul(optarg, NULL, 0);
+				if (q < 1 || q > 100)
+					return usage(argv[0]);
+				options.image.quality = q;
+				break;
+			}
+			case 's':
+			{
+				unsigned long s = strtoul(optarg, NULL, 0);
+				if (s != 444 && s != 422 && s != 420)
+					return usage(argv[0]);
+				options.image.subsample = s;
+				break;
+			}
+			case 't':
+				options.image.threads = strtoul(optarg, NULL, 0);
+				break;
+			case 'e':
+				options.image.estimate = true;
+				break;
+			case 'm':
+				if (!(options.image.max_memory = parse_size(optarg)))
+					return usage(argv[0]);
+				break;
+			case 'b':
+				manifest = optarg;
+				break;
+			case 'j':
+				workers = strtoul(optarg, NULL, 0);
+				break;
+			case 'l':
+				listen_on = optarg;
+				break;
+			case 'S':
+				if (optarg && strcmp(optarg, "json"))
+					return usage(argv[0]);
+				stats = optarg ? STATS_JSON : STATS_TEXT;
+				break;
+			case 'P':
+				split = optarg;
+				break;
+			case 'J':
+				join = optarg;
+				break;
+			case 'C':
+				if (optarg && strcmp(optarg, "json") && strcmp(optarg, "csv"))
+					return usage(argv[0]);
+				scan_as = optarg && !strcmp(optarg, "json") ? STATS_JSON : STATS_TEXT;
+				break;
+			case 'I':
+				index = optarg;
+				break;
+			default:
+				return usage(argv[0]);
+		}
+	char **args = argv + optind;
+	int n = argc - optind;
+
+	/*
+	 * a scan only sizes up images, and what it finds is kept regardless
+	 * of how the images would be re-encoded
+	 */
+	if (scan_as || index)
+		return !scan_as || !n || split || join || listen_on || manifest || stats || options.fill || options.image.recompress
+			? usage(argv[0])
+			: scan(args, n, index, scan_as == STATS_JSON, options.image, workers);
+	/*
+	 * the pieces of a split file must fit their images exactly, so
+	 * neither an estimate nor a re-encoded image will do
+	 */
+	if (split || join)
+		return (split && join) || listen_on || manifest || stats || options.image.estimate || options.image.recompress || n < (split ? 2 : 1)
+			? usage(argv[0])
+			: split ? shard_split(args[0], split, args + 1, n - 1, options.fill, options.image, workers) : shard_join(join, args, n, options.fill, options.image, workers);
+	if (listen_on)
+		return n || manifest || options.fill || options.image.estimate || stats ? usage(argv[0]) : serve(listen_on, options.image, workers);
+	if (manifest)
+		return n ? usage(argv[0]) : batch(manifest, options.fill, options.image, workers, stats);
+	if (stats)
+		options.stats = &job_stats;
+	if (n < 1 || n > 3 || (options.image.estimate && n > 1))
+		return usage(argv[0]);
+	else if (n == 1)
 	{
 		struct stat s;
-		if (stat(argv[1], &s) < 0 && errno == ENOENT)
+		if (stat(args[0], &s) < 0 && errno == ENOENT)
 		{
-			fprintf(stderr, "Could not read file %s\n", argv[1]);
+			fprintf(stderr, "Could not read file %s\n", args[0]);
 			return errno;
 		}
-		image_info_t image_info = { argv[1], NULL, NULL, NULL, NULL, 0, 0, 0, NULL, NULL };
+		data_info_t data_info = { .options = options.image };
+		image_info_t image_info = { .file = args[0], .data = &data_info };
+		job_watch_t watch;
+		job_watch_start(&watch, options.image.threads);
 #ifndef __DEBUG_JPEG__
 		void *so = find_supported_formats(DIR_LIBRARY, &image_info);
 		if (!so)
 			return errno;
+		job_watch_lap(&watch, options.stats, JOB_LOAD);
 #else
 		extern uint64_t info_jpeg(image_info_t *image_info);
 		extern void free_jpeg(image_info_t image_info);
@@ -365,8 +842,34 @@ int main(int argc, char **argv)
 		else
 		{
 			setlocale(LC_NUMERIC, "");
-			printf("File capacity: %'" PRIu64 " bytes\n", image_info.info(&image_info));
+			errno = EXIT_SUCCESS;
+			uint64_t capacity = image_info.info(&image_info);
+			/* as in a batch, an image which couldn't be read says why */
+			if (!capacity && errno)
+			{
+				int e = errno;
+				if (e == EFTYPE)
+					fprintf(stderr, "Unsupported image format\n");
+				else
+					fprintf(stderr, "Could not read image %s: %s\n", args[0], strerror(e));
+				image_info.free(image_info);
+#ifndef __DEBUG_JPEG__
+				dlclose(so);
+#endif
+				return e;
+			}
+			job_watch_lap(&watch, options.stats, JOB_READ);
+			job_stats.read = s.st_size;
+			job_stats.pixels = image_info.columns ? image_info.columns * image_info.rows : image_info.width * image_info.height;
+			job_stats.threads = options.image.threads ? options.image.threads : (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+			job_stats_finish(&job_stats);
+			if (image_info.margin)
+				printf("File capacity: %'" PRIu64 " bytes (estimated, ± %'" PRIu64 ")\n", capacity, image_info.margin);
+			else
+				printf("File capacity: %'" PRIu64 " bytes\n", capacity);
 			image_info.free(image_info);
+			if (stats)
+				job_stats_print(stderr, args[0], &job_stats, stats == STATS_JSON);
 			errno = EXIT_SUCCESS;
 		}
 #ifndef __DEBUG_JPEG__
@@ -375,20 +878,18 @@ int main(int argc, char **argv)
 		return errno;
 	}
 
-	int o = strcmp(argv[1], "-f") ? 0 : 1;
-
-	hide_files_t files = { argv[o + 1], argv[o + 2], argv[o + 3] };
-	process_options_t options = { files, o };
+	options.files.image_in = args[0];
+	options.files.data_file = args[1];
+	options.files.image_out = n == 3 ? args[2] : NULL;
 
 #ifndef __DEBUG__
-	{
-		cli_status_e ui_status = CLI_INIT;
-		cli_progress_s ui_current = { 0, 1, NULL }; /* updated after reading image */
-		cli_progress_s ui_total   = { 0, 3, NULL }; /* maximum of 3 steps (read, update, write) */
-		ui.status = &ui_status;
-		ui.current = &ui_current;
-		ui.total = &ui_total;
-	}
+	/* these need to outlive the processing thread */
+	cli_status_e ui_status = CLI_INIT;
+	cli_progress_s ui_current = { 0, 1, NULL }; /* updated after reading image */
+	cli_progress_s ui_total   = { 0, 3, NULL }; /* maximum of 3 steps (read, update, write) */
+	ui.status = &ui_status;
+	ui.current = &ui_current;
+	ui.total = &ui_total;
 	/*
 	 * TODO start process() in own thread, then call cli_display()
 	 *
@@ -401,12 +902,20 @@ int main(int argc, char **argv)
 	pthread_create(&t, &a, process, &options);
 	pthread_attr_destroy(&a);
 
-	cli_display(&ui);
+	/*
+	 * the progress display would get in the way of a recovered file
+	 * being written to stdout
+	 */
+	if (options.files.image_out || strcmp(options.files.data_file, HIDE_STREAM))
+		cli_display(&ui);
 
 	pthread_join(t, NULL);
 #else
 	process(&options);
 #endif
+	int e = errno;
+	if (stats)
+		job_stats_print(stderr, options.files.image_in, &job_stats, stats == STATS_JSON);
 
-	return errno;
+	return e;
 }
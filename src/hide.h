@@ -28,7 +28,30 @@
 	#define EFTYPE 79 /*!< Unsupported file/image type */
 #endif
 
-#define HIDE_CAPACITY (image_info->width * image_info->height - sizeof (uint64_t))
+/* what's left for the data once its length is stored (if there's room) */
+#define HIDE_CAPACITY (image_info->width * image_info->height > sizeof (uint64_t) ? image_info->width * image_info->height - sizeof (uint64_t) : 0)
+
+typedef struct
+{
+	bool recompress; /* re-encode lossy images rather than editing them in place */
+	uint32_t threads; /* workers to decode and encode with, or 0 for one per CPU */
+	bool optimise;    /* optimal (per-image) Huffman tables when re-encoding */
+	uint8_t quality;  /* re-encoding quality (1-100), or 0 to keep the original's */
+	uint16_t subsample; /* re-encoding chroma subsampling (444, 422, 420), or 0 to keep the original's */
+	bool estimate;    /* sample the capacity rather than count it exactly */
+	uint64_t max_memory; /* bytes the image may take before it's spilled to a scratch file (see scratch.h), or 0 for no limit */
+}
+image_options_t;
+
+typedef struct _data_info_t
+{
+	char *file;
+	uint64_t size;
+	bool hide;
+	bool fill;
+	image_options_t options;
+}
+data_info_t;
 
 typedef struct _image_info_t
 {
@@ -40,20 +63,31 @@ typedef struct _image_info_t
 	uint64_t height;
 	uint64_t width;
 	uint16_t bpp;
-	uint8_t **buffer;
-	void *extra;
+	uint8_t **buffer;           /* rows (from scratch_rows, unless only a JPEG preview) */
+	void *extra;                /* private to the image's plugin */
+	/*
+	 * optional direct payload interface, for formats which hide data in
+	 * something other than pixels (such as JPEG coefficients): buffer is
+	 * not used, the capacity is width * height bytes, and the payload
+	 * goes straight to embed (length and all) or comes from extract
+	 * (once the plugin has used the length)
+	 */
+	int (*embed)(struct _image_info_t, const uint8_t *, uint64_t, void (*progress_update)(uint64_t, uint64_t));
+	int (*extract)(struct _image_info_t, int (*sink)(void *, const uint8_t *, uint64_t), void *);
+	const data_info_t *data;    /* whether hiding or finding, and how */
+	uint64_t margin;            /* when the capacity was only estimated, how far out it may be (bytes) */
+	/*
+	 * optional reduced size decode, for previews: buffer is filled with
+	 * RGB rows (bpp is 3) at 1/scale the size of the image (scale being
+	 * 1, 2, 4 or 8; rounding up), and width and height are those of the
+	 * preview; free releases it as usual
+	 */
+	int (*preview)(struct _image_info_t *, uint8_t);
+	uint64_t columns;           /* the image's own width and height, set by read (and */
+	uint64_t rows;              /* info) when width and height aren't those (as with JPEG) */
 }
 image_info_t;
 
-typedef struct
-{
-	char *file;
-	uint64_t size;
-	bool hide;
-	bool fill;
-}
-data_info_t;
-
 typedef struct
 {
 	char *type;
@@ -62,6 +96,9 @@ typedef struct
 	int (*write)(image_info_t, void (*progress_update)(uint64_t, uint64_t));
 	uint64_t (*info)(image_info_t *);
 	void (*free)(image_info_t);
+	int (*embed)(image_info_t, const uint8_t *, uint64_t, void (*progress_update)(uint64_t, uint64_t));
+	int (*extract)(image_info_t, int (*sink)(void *, const uint8_t *, uint64_t), void *);
+	int (*preview)(image_info_t *, uint8_t);
 }
 image_type_t;
 
@@ -73,10 +110,35 @@ typedef struct
 }
 hide_files_t;
 
+typedef enum
+{
+	JOB_LOAD,    /* finding (and loading) the image's plugin */
+	JOB_READ,    /* reading (decoding) the image */
+	JOB_FIT,     /* reading the document, and seeing that it fits */
+	JOB_PROCESS, /* hiding it in, or finding it from, the image */
+	JOB_WRITE,   /* writing (encoding) the image */
+	JOB_PHASES
+}
+job_phase_e;
+
+typedef struct
+{
+	double wall[JOB_PHASES]; /* seconds spent in each phase */
+	double cpu[JOB_PHASES];  /* CPU seconds: the job's own if it has one thread, else the process's */
+	uint64_t read;           /* bytes read: the image and the document */
+	uint64_t written;        /* bytes written: the output image or the recovered file */
+	uint64_t pixels;         /* in the image */
+	uint32_t threads;        /* most the job could use */
+	uint64_t peak_rss;       /* the process's largest resident set so far (kB) */
+}
+job_stats_t;
+
 typedef struct
 {
 	hide_files_t files;
 	bool fill;
+	image_options_t image;
+	job_stats_t *stats;    /* filled in as the job runs, if not NULL */
 }
 process_options_t;
 
@@ -0,0 +1,772 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+
+/* submodule includes */
+
+#include "common.h"
+#include "cli.h"
+
+/* project includes */
+
+#include "hide.h"
+#include "job.h"
+#include "scratch.h"
+
+#undef HIDE_CAPACITY /* here image_info isn't a pointer but a local variable */
+#define HIDE_CAPACITY (image_info.width * image_info.height > sizeof (uint64_t) ? image_info.width * image_info.height - sizeof (uint64_t) : 0)
+
+/*
+ * note why a job failed (the first reason given is kept, as that's the
+ * most specific) and return its error, so that a batch can carry on
+ * with the next job where a single run would die
+ */
+extern int job_fail(char **why, const char * const restrict format, ...)
+{
+	int e = errno ? errno : EXIT_FAILURE;
+	if (why && !*why)
+	{
+		va_list ap;
+		va_start(ap, format);
+		if (vasprintf(why, format, ap) < 0)
+			*why = NULL;
+		va_end(ap);
+	}
+	return errno = e;
+}
+
+/*
+ * the document to hide: mapped from a file, or read in full from a pipe
+ * (or stdin), as its length is needed before any of it can be hidden
+ */
+extern int load_payload(char *file, payload_t *payload, char **why)
+{
+	errno = EXIT_SUCCESS;
+
+	int e = EXIT_SUCCESS;
+	int f = strcmp(file, HIDE_STREAM) ? open(file, O_RDONLY) : STDIN_FILENO;
+	if (f < 0)
+		return job_fail(why, "Could not open %s", file);
+
+	struct stat s;
+	if (fstat(f, &s) < 0)
+		e = job_fail(why, "Could not read %s", file);
+	else if (S_ISREG(s.st_mode))
+	{
+		payload->size = s.st_size;
+		if (payload->size && (payload->data = mmap(NULL, payload->size, PROT_READ, MAP_SHARED, f, 0)) == MAP_FAILED)
+		{
+			payload->data = NULL;
+			e = job_fail(why, "Could not map file %s into memory", file);
+		}
+		else
+			payload->mapped = true;
+	}
+	else
+		for (uint64_t space = 0; ; )
+		{
+			if (payload->size == space)
+			{
+				uint8_t *data = realloc(payload->data, space = space ? space * 2 : 0x10000);
+				if (!data)
+				{
+					e = job_fail(why, "Out of memory");
+					break;
+				}
+				payload->data = data;
+			}
+			ssize_t r = read(f, payload->data + payload->size, space - payload->size);
+			if (r == 0)
+				break;
+			if (r < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				e = job_fail(why, "Could not read %s", file);
+				break;
+			}
+			payload->size += r;
+		}
+
+	if (f != STDIN_FILENO)
+		close(f);
+	return errno = e;
+}
+
+extern void unload_payload(payload_t *payload)
+{
+	if (payload->mapped)
+		munmap(payload->data, payload->size);
+	else
+		free(payload->data);
+	return;
+}
+
+/*
+ * the plugins only deal in files, so bytes held in memory are given to
+ * them (and taken from them) as anonymous memory with a descriptor, and a
+ * path to it by way of /dev/fd
+ */
+extern int memory_open(const uint8_t *data, size_t length, char **path)
+{
+#ifdef MFD_CLOEXEC
+	int fd = memfd_create("hide", MFD_CLOEXEC);
+#else
+	char name[64];
+	snprintf(name, sizeof name, "/hide-%ld-%p", (long)getpid(), (void *)path);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd >= 0)
+		shm_unlink(name);
+#endif
+	if (fd < 0)
+		return -1;
+	for (size_t done = 0; done < length; )
+	{
+		ssize_t w = write(fd, data + done, length - done);
+		if (w < 0)
+		{
+			int e = errno;
+			close(fd);
+			errno = e;
+			return -1;
+		}
+		done += w;
+	}
+	lseek(fd, 0, SEEK_SET);
+	if (asprintf(path, "/dev/fd/%d", fd) < 0)
+	{
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	return fd;
+}
+
+extern int memory_read(int fd, uint8_t **out, size_t *length)
+{
+	struct stat s;
+	if (fstat(fd, &s) < 0)
+		return errno;
+	if (!(*out = malloc(s.st_size ? s.st_size : 1)))
+		return errno = ENOMEM;
+	for (size_t done = 0; done < (size_t)s.st_size; )
+	{
+		ssize_t r = pread(fd, *out + done, s.st_size - done, done);
+		if (r <= 0)
+		{
+			free(*out);
+			*out = NULL;
+			return errno = r ? errno : EIO;
+		}
+		done += r;
+	}
+	*length = s.st_size;
+	return EXIT_SUCCESS;
+}
+
+/*
+ * whatever's left of the image once the document is hidden is filled
+ * with noise, from the kernel's random source, so that it can't be told
+ * apart from the (presumably encrypted) document
+ */
+static int fill_random(uint8_t *buffer, uint64_t length)
+{
+	for (uint64_t done = 0; done < length; )
+	{
+		ssize_t r = getrandom(buffer + done, length - done, 0);
+		if (r < 0 && errno != EINTR)
+			return errno;
+		if (r > 0)
+			done += r;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int process_file(data_info_t data_info, image_info_t image_info, const payload_t *payload, void (*progress_update)(uint64_t, uint64_t), uint64_t *written, char **why)
+{
+	errno = EXIT_SUCCESS;
+
+	/*
+	 * recovered data is written as it's found, so it can go straight
+	 * down a pipe (or to stdout)
+	 */
+	FILE *out = NULL;
+	if (!data_info.hide && !(out = strcmp(data_info.file, HIDE_STREAM) ? fopen(data_info.file, "wb") : stdout))
+		return job_fail(why, "Could not open %s", data_info.file);
+
+	uint64_t size = data_info.fill ? image_info.height * image_info.width : ntohll(data_info.size);
+	uint8_t *z = (uint8_t *)&data_info.size;
+	uint64_t released = 0;
+	uint8_t noise[0x1000];
+	size_t used = sizeof noise;
+	for (uint64_t i = 0, y = 0; y < image_info.height; y++)
+	{
+		uint8_t *row = image_info.buffer[y];
+		for (uint64_t x = 0; x < image_info.width; x++)
+		{
+			uint8_t *ptr = &(row[x * image_info.bpp]);
+
+			if (data_info.hide)
+			{
+				unsigned char c;
+				if (y == 0 && x < sizeof data_info.size && !data_info.fill)
+					c = z[x];
+				else if (i < payload->size)
+					c = payload->data[i];
+				else
+				{
+					if (used == sizeof noise)
+					{
+						if (fill_random(noise, sizeof noise))
+						{
+							job_fail(why, "Could not get random data");
+							goto done;
+						}
+						used = 0;
+					}
+					c = noise[used++];
+				}
+				ptr[0] = (ptr[0] & 0xF8) | ((c & 0xE0) >> 5); // r 3 lsb
+				ptr[1] = (ptr[1] & 0xFC) | ((c & 0x18) >> 3); // g 2 lsb
+				ptr[2] = (ptr[2] & 0xF8) |  (c & 0x07);       // b 3 lsb
+			}
+			else
+			{
+				unsigned char c = (ptr[0] & 0x07) << 5;
+				c |= (ptr[1] & 0x03) << 3;
+				c |= (ptr[2] & 0x07);
+				if (y == 0 && x < sizeof data_info.size && !data_info.fill)
+				{
+					z[x] = c;
+					if (x == sizeof data_info.size - 1)
+						size = ntohll(data_info.size);
+				}
+				else if ((y > 0 || x >= sizeof data_info.size) && putc_unlocked(c, out) == EOF)
+				{
+					job_fail(why, "Could not write %s", data_info.file);
+					goto done;
+				}
+				else if (y > 0 || x >= sizeof data_info.size)
+					(*written)++;
+			}
+			if (y > 0 || x >= sizeof data_info.size)
+			{
+				i++;
+				if (progress_update)
+					progress_update(i, size);
+			}
+			if (!data_info.fill && (y > 0 || x >= sizeof data_info.size - 1) && i >= size)
+				goto done;
+		}
+		scratch_rows_done(image_info.buffer, y);
+		/* as with the rows, the (mapped) document needn't stay once it's hidden */
+		if (payload && payload->mapped && data_info.options.max_memory && i > released + data_info.options.max_memory / 4)
+		{
+			uint64_t upto = (i < payload->size ? i : payload->size) & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+			if (upto > released)
+				madvise(payload->data + released, upto - released, MADV_DONTNEED);
+			released = upto;
+		}
+	}
+
+done:
+	if (out)
+	{
+		if (fflush(out) == EOF)
+			job_fail(why, "Could not write %s", data_info.file);
+		if (out != stdout)
+			fclose(out);
+	}
+	return errno;
+}
+
+/*
+ * for formats with a direct payload interface: the payload is the length
+ * (unless filling the image) followed by the file, as process_file would
+ * have put it in the pixels
+ */
+static uint8_t *embed_file(data_info_t data_info, image_info_t image_info, const payload_t *file, uint64_t *length, char **why)
+{
+	errno = EXIT_SUCCESS;
+
+	*length = sizeof data_info.size + (data_info.fill ? HIDE_CAPACITY : file->size);
+	uint8_t *payload = malloc(*length);
+	if (!payload)
+	{
+		job_fail(why, "Out of memory");
+		return NULL;
+	}
+	memcpy(payload, &data_info.size, sizeof data_info.size);
+	if (file->size)
+		memcpy(payload + sizeof data_info.size, file->data, file->size);
+	uint64_t filled = sizeof data_info.size + file->size;
+	if (fill_random(payload + filled, *length - filled))
+	{
+		job_fail(why, "Could not get random data");
+		free(payload);
+		return NULL;
+	}
+	return payload;
+}
+
+typedef struct
+{
+	int fd;
+	uint64_t written;
+}
+sink_t;
+
+static int write_data(void *sink, const uint8_t *data, uint64_t size)
+{
+	sink_t *s = sink;
+	for (uint64_t done = 0; done < size; )
+	{
+		ssize_t w = write(s->fd, data + done, size - done);
+		if (w < 0)
+			return errno;
+		done += w;
+		s->written += w;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int extract_file(data_info_t data_info, image_info_t image_info, uint64_t *written, char **why)
+{
+	errno = EXIT_SUCCESS;
+
+	sink_t sink = { STDOUT_FILENO, 0 };
+	if (strcmp(data_info.file, HIDE_STREAM) && (sink.fd = open(data_info.file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+		return job_fail(why, "Could not open %s", data_info.file);
+	int r = image_info.extract(image_info, write_data, &sink);
+	if (sink.fd != STDOUT_FILENO)
+		close(sink.fd);
+	*written = sink.written;
+	return r;
+}
+
+static bool will_fit(data_info_t *data_info, image_info_t image_info, const payload_t *payload)
+{
+	/*
+	 * figure out how much data we can hide
+	 */
+	if (payload->size > HIDE_CAPACITY)
+	{
+		errno = ENOSPC;
+		return false;
+	}
+	data_info->size = htonll(payload->size);
+	data_info->hide = true;
+	return true;
+}
+
+extern int plugins_selector(const struct dirent *d)
+{
+	size_t l = strlen(d->d_name);
+	return !strncmp("hide-", d->d_name, 5) && l > 8 && !strcmp(".so", d->d_name + l - 3);
+}
+
+extern void plugins_use(image_info_t *image_info, const image_type_t *format)
+{
+	image_info->read = format->read;
+	image_info->write = format->write;
+	image_info->info = format->info;
+	image_info->free = format->free;
+	image_info->embed = format->embed;
+	image_info->extract = format->extract;
+	image_info->preview = format->preview;
+	return;
+}
+
+/*
+ * a job held to one thread can be timed on its own, otherwise the CPU
+ * time of the plugins' workers can only be had from the whole process
+ */
+extern void job_watch_start(job_watch_t *watch, uint32_t threads)
+{
+	watch->cpu_clock = threads == 1 ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID;
+	clock_gettime(CLOCK_MONOTONIC, &watch->wall);
+	clock_gettime(watch->cpu_clock, &watch->cpu);
+	return;
+}
+
+static double since(struct timespec *then, struct timespec now)
+{
+	double s = (now.tv_sec - then->tv_sec) + (now.tv_nsec - then->tv_nsec) / 1e9;
+	*then = now;
+	return s;
+}
+
+/*
+ * add the time since the last phase ended to this one
+ */
+extern void job_watch_lap(job_watch_t *watch, job_stats_t *stats, job_phase_e phase)
+{
+	if (!stats)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->wall[phase] += since(&watch->wall, now);
+	clock_gettime(watch->cpu_clock, &now);
+	stats->cpu[phase] += since(&watch->cpu, now);
+	return;
+}
+
+static uint64_t file_size(const char *file)
+{
+	struct stat s;
+	return stat(file, &s) < 0 ? 0 : (uint64_t)s.st_size;
+}
+
+/*
+ * the peak resident set is the process's, so it's taken once the job is
+ * done (and includes any other jobs running alongside)
+ */
+extern void job_stats_finish(job_stats_t *stats)
+{
+	if (!stats)
+		return;
+	struct rusage r;
+	if (!getrusage(RUSAGE_SELF, &r))
+		stats->peak_rss = r.ru_maxrss;
+	return;
+}
+
+/*
+ * hide, find, or (given no data file) do neither, with an image whose
+ * format is already known; total is the overall progress, if shown, and
+ * stats how long each phase took, if wanted
+ */
+extern int job_run(image_info_t image_info, hide_files_t files, bool fill, image_options_t options, cli_progress_s *total, void (*progress_update)(uint64_t, uint64_t), job_stats_t *stats, char **why)
+{
+	data_info_t data_info = { .file = files.data_file, .fill = fill, .options = options };
+	job_watch_t watch;
+	job_watch_start(&watch, options.threads);
+	if (stats)
+		stats->threads = options.threads ? options.threads : (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+	errno = EXIT_SUCCESS;
+	if (!(image_info.read && (image_info.write || image_info.embed)))
+	{
+		errno = EFTYPE;
+		return job_fail(why, "Unsupported image format");
+	}
+
+	/*
+	 * some formats need to know before reading whether data will be
+	 * hidden or found
+	 */
+	data_info.hide = (bool)files.image_out;
+	image_info.data = &data_info;
+
+	if (total)
+	{
+		total->offset = 0;
+		total->size = files.image_out ? 3 : 2;
+	}
+
+	/*
+	 * read the source image
+	 */
+	int r = image_info.read(&image_info, progress_update);
+	job_watch_lap(&watch, stats, JOB_READ);
+	if (r)
+		return job_fail(why, "Failed to read source image");
+	if (stats)
+	{
+		stats->read += file_size(files.image_in);
+		stats->pixels = image_info.columns ? image_info.columns * image_info.rows : image_info.width * image_info.height;
+	}
+
+	if (files.image_out)
+	{
+		payload_t payload = { NULL, 0, false };
+		r = load_payload(files.data_file, &payload, why) || !will_fit(&data_info, image_info, &payload);
+		job_watch_lap(&watch, stats, JOB_FIT);
+		if (stats)
+			stats->read += payload.size;
+		if (r)
+		{
+			job_fail(why, "Too much data to hide; find a larger image (capacity: %" PRIu64 " bytes)", HIDE_CAPACITY);
+			unload_payload(&payload);
+			image_info.free(image_info);
+			return errno;
+		}
+		if (image_info.embed)
+		{
+			/*
+			 * write the image with the data hidden directly in it
+			 */
+			if (total)
+				total->offset += 2;
+			image_info.file = files.image_out;
+			uint64_t length = 0;
+			uint8_t *buffer = embed_file(data_info, image_info, &payload, &length, why);
+			unload_payload(&payload);
+			job_watch_lap(&watch, stats, JOB_PROCESS);
+			if (!buffer)
+			{
+				image_info.free(image_info);
+				return errno;
+			}
+			r = image_info.embed(image_info, buffer, length, progress_update);
+			free(buffer);
+			job_watch_lap(&watch, stats, JOB_WRITE);
+			if (r)
+				return job_fail(why, "Failed to write output image");
+		}
+		else
+		{
+			/*
+			 * overlay the data on the image
+			 */
+			if (total)
+				total->offset++;
+			r = process_file(data_info, image_info, &payload, progress_update, NULL, why);
+			unload_payload(&payload);
+			job_watch_lap(&watch, stats, JOB_PROCESS);
+			if (r)
+			{
+				job_fail(why, "Failed during data processing");
+				image_info.free(image_info);
+				return errno;
+			}
+			/*
+			 * write the image with the hidden data
+			 */
+			if (total)
+				total->offset++;
+			image_info.file = files.image_out;
+			r = image_info.write(image_info, progress_update);
+			job_watch_lap(&watch, stats, JOB_WRITE);
+			if (r)
+				return job_fail(why, "Failed to write output image");
+		}
+		if (stats)
+			stats->written = file_size(files.image_out);
+	}
+	else
+	{
+		/*
+		 * extract the hidden data
+		 */
+		if (total)
+			total->offset++;
+		uint64_t written = 0;
+		r = image_info.extract ? extract_file(data_info, image_info, &written, why) : process_file(data_info, image_info, NULL, progress_update, &written, why);
+		job_watch_lap(&watch, stats, JOB_PROCESS);
+		if (stats)
+			stats->written = written;
+		if (r)
+		{
+			job_fail(why, "Failed during data processing");
+			image_info.free(image_info);
+			return errno;
+		}
+		image_info.free(image_info);
+	}
+
+	if (total)
+		total->offset = total->size;
+	job_stats_finish(stats);
+	return errno = EXIT_SUCCESS;
+}
+
+static const char *PHASES[JOB_PHASES] = { "load", "read", "fit", "process", "write" };
+
+/*
+ * a string (such as a file name) as JSON, quoted and escaped
+ */
+extern void job_print_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (const char *c = s; *c; c++)
+		if (*c == '"' || *c == '\\')
+			fprintf(f, "\\%c", *c);
+		else if ((unsigned char)*c < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else
+			fputc(*c, f);
+	fputc('"', f);
+	return;
+}
+
+/*
+ * report how a job went, as a table or as a single line of JSON; name is
+ * the image the job was run on
+ */
+extern void job_stats_print(FILE *f, const char *name, const job_stats_t *stats, bool json)
+{
+	double wall = 0, cpu = 0;
+	for (int i = 0; i < JOB_PHASES; i++)
+		wall += stats->wall[i], cpu += stats->cpu[i];
+
+	if (json)
+	{
+		fprintf(f, "{ \"image\": ");
+		job_print_json_string(f, name);
+		fprintf(f, ", \"phases\": { ");
+		for (int i = 0; i < JOB_PHASES; i++)
+			fprintf(f, "\"%s\": { \"wall_s\": %.6f, \"cpu_s\": %.6f }, ", PHASES[i], stats->wall[i], stats->cpu[i]);
+		fprintf(f, "\"total\": { \"wall_s\": %.6f, \"cpu_s\": %.6f } }, ", wall, cpu);
+		fprintf(f, "\"bytes_read\": %" PRIu64 ", \"bytes_written\": %" PRIu64 ", \"pixels\": %" PRIu64 ", \"threads\": %" PRIu32 ", \"peak_rss_kb\": %" PRIu64 " }\n",
+				stats->read, stats->written, stats->pixels, stats->threads, stats->peak_rss);
+		return;
+	}
+
+	fprintf(f, "%s\n", name);
+	fprintf(f, "  %-8s %12s %12s\n", "phase", "wall (s)", "cpu (s)");
+	for (int i = 0; i < JOB_PHASES; i++)
+		fprintf(f, "  %-8s %12.6f %12.6f\n", PHASES[i], stats->wall[i], stats->cpu[i]);
+	fprintf(f, "  %-8s %12.6f %12.6f\n", "total", wall, cpu);
+	fprintf(f, "  read %" PRIu64 " bytes, wrote %" PRIu64 " bytes, %" PRIu64 " pixels, %" PRIu32 " threads, peak RSS %" PRIu64 " kB\n",
+			stats->read, stats->written, stats->pixels, stats->threads, stats->peak_rss);
+	return;
+}
+
+extern int plugins_load(char *path, plugins_t *plugins)
+{
+	struct dirent **eps;
+	int n = scandir(path, &eps, plugins_selector, alphasort);
+	if (n <= 0)
+	{
+		if (strcmp(path, DIR_LOCAL))
+			return plugins_load(DIR_LOCAL, plugins);
+		return 0;
+	}
+	plugins->so = calloc(n, sizeof (void *));
+	plugins->formats = calloc(n, sizeof (image_type_t *));
+	for (int i = 0; i < n && plugins->so && plugins->formats; ++i)
+	{
+		char *l = NULL;
+		if (strcmp(path, DIR_LOCAL))
+			l = eps[i]->d_name;
+		else
+			asprintf(&l, "%s%s", path, eps[i]->d_name);
+		void *so = dlopen(l, RTLD_LAZY);
+		if (!strcmp(path, DIR_LOCAL))
+			free(l);
+		if (so == NULL)
+			continue;
+		image_type_t *(*init)();
+		if (!(init = dlsym(so, "init")))
+		{
+			dlclose(so);
+			continue;
+		}
+		plugins->so[plugins->count] = so;
+		plugins->formats[plugins->count++] = init();
+	}
+	for (int i = 0; i < n; ++i)
+		free(eps[i]);
+	free(eps);
+
+	return plugins->count;
+}
+
+extern void plugins_unload(plugins_t *plugins)
+{
+	for (int i = 0; i < plugins->count; i++)
+		dlclose(plugins->so[i]);
+	free(plugins->so);
+	free(plugins->formats);
+	return;
+}
+
+/*
+ * run a job with plugins which are already loaded (and whatever tables
+ * they have already built), recording how it went in the job
+ */
+extern void job_run_loaded(const plugins_t *plugins, job_t *job, bool fill, image_options_t options)
+{
+	image_info_t image_info = { .file = job->files.image_in };
+	job_watch_t watch;
+	job_watch_start(&watch, options.threads);
+
+	struct stat s;
+	if (stat(image_info.file, &s) < 0)
+	{
+		job->error = job_fail(&job->why, "Could not read file %s", image_info.file);
+		return;
+	}
+	errno = EXIT_SUCCESS;
+	for (int i = 0; i < plugins->count; i++)
+		if (plugins->formats[i]->is_type(image_info.file))
+		{
+			plugins_use(&image_info, plugins->formats[i]);
+			job->format = plugins->formats[i]->type;
+			break;
+		}
+	job_watch_lap(&watch, &job->stats, JOB_LOAD);
+
+	if (job->files.data_file)
+		job->error = job_run(image_info, job->files, fill, options, NULL, NULL, &job->stats, &job->why);
+	else if (!image_info.info)
+	{
+		errno = EFTYPE;
+		job->error = job_fail(&job->why, "Unsupported image format");
+	}
+	else
+	{
+		data_info_t data_info = { .options = options };
+		image_info.data = &data_info;
+		errno = EXIT_SUCCESS;
+		job->capacity = image_info.info(&image_info);
+		/* an image which couldn't be read has no capacity, and says why */
+		if (!job->capacity && errno)
+		{
+			if (errno == EFTYPE)
+				job->error = job_fail(&job->why, "Unsupported image format");
+			else
+				job->error = job_fail(&job->why, "Could not read image %s", image_info.file);
+			image_info.free(image_info);
+			return;
+		}
+		job->margin = image_info.margin;
+		job->width = image_info.columns ? image_info.columns : image_info.width;
+		job->height = image_info.columns ? image_info.rows : image_info.height;
+		job_watch_lap(&watch, &job->stats, JOB_READ);
+		job->stats.read = s.st_size;
+		job->stats.pixels = image_info.columns ? image_info.columns * image_info.rows : image_info.width * image_info.height;
+		job->stats.threads = options.threads ? options.threads : (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+		job_stats_finish(&job->stats);
+		image_info.free(image_info);
+		job->error = EXIT_SUCCESS;
+	}
+	return;
+}
@@ -0,0 +1,95 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _JOB_H_
+#define _JOB_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "cli.h"
+
+#include "hide.h"
+
+#define DIR_LIBRARY "/usr/lib/"
+#define DIR_LOCAL "./"
+
+#define HIDE_STREAM "-" /* stdin or stdout, in place of a file */
+
+typedef struct
+{
+	hide_files_t files;
+	int error;         /* how the job went */
+	char *why;         /* and what went wrong, if anything */
+	uint64_t capacity; /* for jobs without a data file */
+	uint64_t margin;
+	const char *format; /* and the image's format and size */
+	uint64_t width;
+	uint64_t height;
+	job_stats_t stats;
+}
+job_t;
+
+typedef struct
+{
+	uint8_t *data;
+	uint64_t size;
+	bool mapped;
+}
+payload_t;
+
+typedef struct
+{
+	clockid_t cpu_clock;
+	struct timespec wall;
+	struct timespec cpu;
+}
+job_watch_t;
+
+typedef struct
+{
+	void **so;                /* every plugin, loaded once for all jobs */
+	image_type_t **formats;
+	int count;
+}
+plugins_t;
+
+extern int job_fail(char **why, const char * const restrict format, ...) __attribute__((format(printf, 2, 3)));
+extern int job_run(image_info_t image_info, hide_files_t files, bool fill, image_options_t options, cli_progress_s *total, void (*progress_update)(uint64_t, uint64_t), job_stats_t *stats, char **why);
+extern void job_run_loaded(const plugins_t *plugins, job_t *job, bool fill, image_options_t options);
+extern int load_payload(char *file, payload_t *payload, char **why);
+extern void unload_payload(payload_t *payload);
+extern int memory_open(const uint8_t *data, size_t length, char **path);
+extern int memory_read(int fd, uint8_t **out, size_t *length);
+extern void job_watch_start(job_watch_t *watch, uint32_t threads);
+extern void job_watch_lap(job_watch_t *watch, job_stats_t *stats, job_phase_e phase);
+extern void job_stats_finish(job_stats_t *stats);
+extern void job_stats_print(FILE *f, const char *name, const job_stats_t *stats, bool json);
+extern void job_print_json_string(FILE *f, const char *s);
+
+extern int plugins_selector(const struct dirent *d);
+extern void plugins_use(image_info_t *image_info, const image_type_t *format);
+extern int plugins_load(char *path, plugins_t *plugins);
+extern void plugins_unload(plugins_t *plugins);
+
+#endif
@@ -13,12 +13,17 @@
  *                                                                    *
  **********************************************************************/
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <math.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /* submodule includes */
 
@@ -27,6 +32,7 @@
 /* project includes */
 
 #include "jpeg.h"
+#include "scratch.h"
 
 /**********************************************************************/
 
@@ -44,9 +50,6 @@
 #define COMPONENTS      4
 
 
-static jpeg_message_t *message;
-static jpeg_load_e action;
-static uint64_t fill_size = 0;
 
 
 static const int cY = 1;
@@ -67,14 +70,7 @@ static int ZigZagArray[64] =
 
 /**********************************************************************/
 
-typedef struct
-{
-	int value;      // Decodes to.
-	int length;     // Length in bits.
-	uint16_t code;  // 2 byte code (variable length)
-} stBlock;
-
-/**********************************************************************/
+#define HUFFMAN_LOOKAHEAD 8 // Bits of a code looked up at once
 
 typedef struct
 {
@@ -82,8 +78,14 @@ typedef struct
 	// k =1-16 ; L[k] indicates the number of Huffman codes of length k
 	uint8_t m_hufVal[257];      // 256 codes read in from the jpeg file
 
-	int m_numBlocks;
-	stBlock m_blocks[1024];
+	// Codes no longer than the lookahead are found straight from their
+	// first bits: the length of the code (0 if it's longer) and its value
+	uint8_t m_lookLength[1 << HUFFMAN_LOOKAHEAD];
+	uint8_t m_lookValue[1 << HUFFMAN_LOOKAHEAD];
+	// Longer ones a length at a time: the largest code of each length
+	// (-1 if there are none) and what to add to it to index m_hufVal
+	int32_t m_maxCode[17];
+	int32_t m_valOffset[17];
 } stHuffmanTable;
 
 typedef struct
@@ -93,8 +95,6 @@ typedef struct
 	double *m_qTable;            // Pointer to the quantisation table to use
 	stHuffmanTable *m_acTable;
 	stHuffmanTable *m_dcTable;
-	int16_t m_DCT[65];          // DCT coef
-	int m_previousDC;
 } stComponent;
 
 typedef struct
@@ -102,9 +102,20 @@ typedef struct
 	uint8_t *m_rgb;             // Final Red Green Blue pixel data
 	uint32_t m_width;           // Width of image
 	uint32_t m_height;          // Height of image
-
-	const uint8_t *m_stream;    // Pointer to the current stream
+	uint32_t m_out_width;       // Size of m_rgb (smaller when previewing)
+	uint32_t m_out_height;
+	int m_block;                // Pixels across each decoded block (8, or
+	                            // fewer when previewing)
+	double m_cosine[4][4];      // The reduced IDCT's basis, when previewing
+
+	const uint8_t *m_stream;    // Start of the entropy coded data
+	const uint8_t *m_end;       // End of the file
 	int m_restart_interval;
+	int m_threads;              // Workers to decode restart intervals with
+	uint64_t m_max_memory;      // Scratch budget for the coefficients and pixels
+
+	int m_xmcus;                // MCUs across the image
+	int m_mcus;                 // and in total
 
 	stComponent m_component_info[COMPONENTS];
 
@@ -112,6 +123,35 @@ typedef struct
 	stHuffmanTable m_HTDC[HUFFMAN_TABLES];  // DC huffman tables
 	stHuffmanTable m_HTAC[HUFFMAN_TABLES];  // AC huffman tables
 
+	// When transcoding, where the coefficients are kept
+	int16_t *m_blocks;
+
+	jpeg_message_t *m_message;  // The message being hidden (or found)
+	jpeg_load_e m_action;
+	uint64_t m_fill_size;
+	uint64_t m_margin;          // How far out an estimated capacity may be (bits)
+
+	// How much of the message has been found so far
+	uint64_t m_offset;
+	uint8_t m_bit;
+	bool m_aloc;
+} stJpegData;
+
+/*
+ * Everything that changes while working through the entropy coded data;
+ * one of these for each restart interval being decoded at the same time
+ */
+typedef struct
+{
+	const uint8_t *m_stream;    // Pointer to the current stream
+	const uint8_t *m_end;
+	uint32_t m_reservoir;
+	uint32_t m_nbits_in_reservoir;
+	uint32_t m_padding;         // Bits of that which follow a marker
+
+	int m_previousDC[COMPONENTS];
+	int16_t m_DCT[64];          // DCT coef
+
 	// Temp space used after the IDCT to store each components
 	uint8_t m_Y[256];
 	uint8_t m_Cr[64];
@@ -119,22 +159,12 @@ typedef struct
 
 	// Internal Pointer use for colorspace conversion, do not modify it !!!
 	uint8_t *m_colourspace;
-} stJpegData;
 
-/**********************************************************************/
+	int16_t *m_blocks;          // Where the next block of coefficients goes
+	uint64_t m_bits;            // Coefficients able to carry the message
+	bool m_failed;              // The data couldn't be decoded
+} stScanState;
 
-#define GenHuffCodes(nc, arr, huffVal)                                  \
-	do                                                              \
-	{                                                               \
-		for (int cc = 0, hc = 0, lc = 1; cc < nc; cc++, hc++)   \
-		{                                                       \
-			for (; arr[cc].length > lc; lc++)               \
-				hc = hc << 1;                           \
-			arr[cc].code = hc;                              \
-			arr[cc].value = huffVal[cc];                    \
-		}                                                       \
-	}                                                               \
-	while (0)
 
 /**********************************************************************/
 
@@ -187,53 +217,69 @@ static inline int innerIDCT(int x, int y, const int block[8][8])
 
 /***************************************************************************/
 
-static void DecodeSingleBlock(stComponent *comp, uint8_t *outputBuf, int stride)
+static void ProcessMessageBits(stJpegData *jdata, const int16_t *data)
 {
-	int16_t *inptr = comp->m_DCT;
-	double *quantptr = comp->m_qTable;
+	jpeg_message_t *message = jdata->m_message;
 
-	// Create a temp 8x8, i.e. 64 array for the data
-	int data[64] = { 0x0 };
-
-	// Copy our data into the temp array
-	for (int i = 0; i < 64; i++)
-		data[i] = inptr[i];
-
-
-	static uint64_t offset = 0;
-	static uint8_t bit = 1;
-	static bool aloc = false;
-
-	for (int i = 0; i < 64 && !(aloc && offset >= message->size + sizeof message->size); i++)
+	for (int i = 0; i < 64 && !(jdata->m_aloc && jdata->m_offset >= message->size + sizeof message->size); i++)
 		if (data[i] > 1)
 		{
-			switch (action)
+			switch (jdata->m_action)
 			{
 				case JPEG_LOAD_FIND:
 				{
-					uint8_t *ptr = (aloc ? message->data : (uint8_t *)&message->size) + offset;
+					uint8_t *ptr = (jdata->m_aloc ? message->data : (uint8_t *)&message->size) + jdata->m_offset;
 					if (data[i] & 0x01)
-						*ptr |= (0xFF & bit);
-					bit <<= 1;
-					if (!bit)
+						*ptr |= (0xFF & jdata->m_bit);
+					jdata->m_bit <<= 1;
+					if (!jdata->m_bit)
 					{
-						bit = 1;
-						offset++;
+						jdata->m_bit = 1;
+						jdata->m_offset++;
 					}
-					if (offset >= sizeof message->size && !aloc)
+					if (jdata->m_offset >= sizeof message->size && !jdata->m_aloc)
 					{
-						message->size = fill_size ? : ntohll(message->size);
+						message->size = jdata->m_fill_size ? : ntohll(message->size);
+						// An image with nothing hidden in it gives any old
+						// length, so it's kept to what the image could hold
+						if (message->size > (uint64_t)jdata->m_width * jdata->m_height * 3)
+							message->size = (uint64_t)jdata->m_width * jdata->m_height * 3;
 						message->data = calloc(message->size + sizeof message->size, sizeof (uint8_t));
-						aloc = true;
+						jdata->m_aloc = true;
 					}
 					break;
 				}
 				case JPEG_LOAD_READ:
+				case JPEG_LOAD_TRANSCODE:
+				case JPEG_LOAD_ESTIMATE:
+				case JPEG_LOAD_PREVIEW:
 					message->size++;
 					break;
 			}
 		}
+}
 
+static uint64_t CountMessageBits(const int16_t *data)
+{
+	uint64_t bits = 0;
+	for (int i = 0; i < 64; i++)
+		if (data[i] > 1)
+			bits++;
+	return bits;
+}
+
+/***************************************************************************/
+
+static void DecodeSingleBlock(stComponent *comp, const int16_t *inptr, uint8_t *outputBuf, int stride)
+{
+	double *quantptr = comp->m_qTable;
+
+	// Create a temp 8x8, i.e. 64 array for the data
+	int data[64] = { 0x0 };
+
+	// Copy our data into the temp array
+	for (int i = 0; i < 64; i++)
+		data[i] = inptr[i];
 
 	// De-Quantize
 	DequantizeBlock(data, quantptr);
@@ -263,27 +309,89 @@ static void DecodeSingleBlock(stComponent *comp, uint8_t *outputBuf, int stride)
 	}
 }
 
+//
+// Reduced size decode, for previews: only the n x n lowest frequencies
+// are used, and the block is reconstructed at the middle of each group
+// of 8/n x 8/n pixels; when n is 1 that is just the DC coefficient
+//
+static void BuildScaledCosines(stJpegData *jdata)
+{
+	int n = jdata->m_block;
+	// Each dimension's scaling (1/sqrt(2) for the lowest frequency, and
+	// half of the 1/4 overall) is folded in
+	for (int x = 0; x < n; x++)
+		for (int u = 0; u < n; u++)
+			jdata->m_cosine[x][u] = cos(((x << 1) + 1) * u * M_PI / (n << 1)) * (u ? 0.5 : M_SQRT1_2 / 2);
+}
+
+static void DecodeScaledBlock(const stJpegData *jdata, stComponent *comp, const int16_t *inptr, uint8_t *outputBuf, int stride)
+{
+	int n = jdata->m_block;
+	if (n == 1)
+	{
+		int val = (int)lround(inptr[0] * comp->m_qTable[0] / 8) + 128;
+		outputBuf[0] = byte_limit(val, 0);
+		return;
+	}
+
+	// The rows first, then the columns
+	double rows[4][4];
+	for (int y = 0; y < n; y++)
+		for (int u = 0; u < n; u++)
+		{
+			double sum = 0.0;
+			for (int v = 0; v < n; v++)
+			{
+				int z = ZigZagArray[(v << 3) + u];
+				sum += inptr[z] * comp->m_qTable[z] * jdata->m_cosine[y][v];
+			}
+			rows[y][u] = sum;
+		}
+
+	for (int y = 0; y < n; y++, outputBuf += stride)
+		for (int x = 0; x < n; x++)
+		{
+			double sum = 0.0;
+			for (int u = 0; u < n; u++)
+				sum += rows[y][u] * jdata->m_cosine[x][u];
+			int val = (int)lround(sum) + 128;
+			outputBuf[x] = byte_limit(val, 0);
+		}
+}
+
 /**********************************************************************/
 
-static void BuildHuffmanTable(const uint8_t *bits, stHuffmanTable *HT)
+//
+// The codes are canonical: those of each length follow on from the last
+// of the length before, shifted up a bit. A table with more codes of a
+// length than there's room for is no good.
+//
+static int BuildHuffmanTable(const uint8_t *bits, stHuffmanTable *HT)
 {
-	// Takes two array of bits, and build the huffman table for size, and code
 	for (int j = 1; j <= 16; j++)
 		HT->m_length[j] = bits[j];
 
-	// Work out the total number of codes
-	int numBlocks = 0;
-	for (int i = 1; i <= 16; i++)
-		numBlocks += HT->m_length[i];
-	HT->m_numBlocks = numBlocks;
-
-	// Fill in the data our our blocks, so we know how many bits each
-	// one is
-	for (int i = 1, c = 0; i <= 16; i++)
-		for (int j = 0; j < HT->m_length[i]; j++, c++)
-			HT->m_blocks[c].length = i;
-
-	GenHuffCodes(HT->m_numBlocks, HT->m_blocks, HT->m_hufVal);
+	memset(HT->m_lookLength, 0x00, sizeof HT->m_lookLength);
+	int32_t code = 0;
+	for (int l = 1, p = 0; l <= 16; l++, code <<= 1)
+	{
+		HT->m_valOffset[l] = p - code;
+		for (int j = 0; j < HT->m_length[l]; j++, p++, code++)
+			if (l <= HUFFMAN_LOOKAHEAD)
+			{
+				// Every lookahead starting with this code
+				int shift = HUFFMAN_LOOKAHEAD - l;
+				for (int k = 0; k < (1 << shift); k++)
+				{
+					HT->m_lookLength[(code << shift) | k] = l;
+					HT->m_lookValue[(code << shift) | k] = HT->m_hufVal[p];
+				}
+			}
+		HT->m_maxCode[l] = HT->m_length[l] ? code - 1 : -1;
+		if (code > (1 << l))
+			return -1;
+	}
+	return 0;
 }
 
 /**********************************************************************/
@@ -316,6 +424,9 @@ static int ParseSOF(stJpegData *jdata, const uint8_t *stream)
 		int sampling_factor = *stream++;
 		int Q_table = *stream++;
 
+		if (cid >= COMPONENTS || Q_table >= COMPONENTS)
+			return -1;
+
 		stComponent *c = &jdata->m_component_info[cid];
 		c->m_vFactor = sampling_factor & 0xf;
 		c->m_hFactor = sampling_factor >> 4;
@@ -355,14 +466,10 @@ static int ParseDQT(stJpegData *jdata, const uint8_t *stream)
 			// precision in this case is either 0 or 1 and indicates the precision
 			// of the quantized values;
 			// 8-bit (baseline) for 0 and  up to 16-bit for 1
-			fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-			exit(-1);
+			return -1;
 		}
 		if (qindex >= 4)
-		{
-			fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-			exit(-1);
-		}
+			return -1;
 
 		// The quantization table is the next 64 bytes
 		// the quantization tables are stored in zigzag format, so we
@@ -394,10 +501,7 @@ static int ParseSOS(stJpegData *jdata, const uint8_t *stream)
 	uint32_t nr_components = stream[2];
 
 	if (nr_components != 3)
-	{
-		fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-		exit(-1);
-	}
+		return -1;
 
 	stream += 3;
 	for (uint32_t i = 0; i < nr_components; i++)
@@ -405,16 +509,12 @@ static int ParseSOS(stJpegData *jdata, const uint8_t *stream)
 		uint32_t cid = *stream++;
 		uint32_t table = *stream++;
 
+		if (cid >= COMPONENTS)
+			return -1;
 		if ((table & 0xf) >= 4)
-		{
-			fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-			exit(-1);
-		}
+			return -1;
 		if ((table >> 4) >= 4)
-		{
-			fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-			exit(-1);
-		}
+			return -1;
 
 		jdata->m_component_info[cid].m_acTable = &jdata->m_HTAC[table & 0xf];
 		jdata->m_component_info[cid].m_dcTable = &jdata->m_HTDC[table >> 4];
@@ -454,28 +554,24 @@ static int ParseDHT(stJpegData *jdata, const uint8_t *stream)
 			count += huff_bits[i];
 		}
 		if (count > 256)
-		{
-			fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-			exit(-1);
-		}
+			return -1;
 		if ((index & 0xf) >= HUFFMAN_TABLES)
-		{
-			fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-			exit(-1);
-		}
+			return -1;
 		if (index & 0xf0)
 		{
 			uint8_t *huffval = jdata->m_HTAC[index & 0xf].m_hufVal;
 			for (int i = 0; i < count; i++)
 				huffval[i] = *stream++;
-			BuildHuffmanTable(huff_bits, &jdata->m_HTAC[index & 0xf]); // AC
+			if (BuildHuffmanTable(huff_bits, &jdata->m_HTAC[index & 0xf]) < 0) // AC
+				return -1;
 		}
 		else
 		{
 			uint8_t *huffval = jdata->m_HTDC[index & 0xf].m_hufVal;
 			for (int i = 0; i < count; i++)
 				huffval[i] = *stream++;
-			BuildHuffmanTable(huff_bits, &jdata->m_HTDC[index & 0xf]); // DC
+			if (BuildHuffmanTable(huff_bits, &jdata->m_HTDC[index & 0xf]) < 0) // DC
+				return -1;
 		}
 		length -= 1;
 		length -= 16;
@@ -496,15 +592,20 @@ static int ParseJFIF(stJpegData *jdata, const uint8_t *stream)
 	// Parse marker
 	while (!sos_marker_found)
 	{
-		if (*stream++ != 0xff)
+		if (stream >= jdata->m_end || *stream++ != 0xff)
 			goto bogus_jpeg_format;
 
 		// Skip any padding ff byte (this is normal)
-		while (*stream == 0xff)
+		while (stream < jdata->m_end && *stream == 0xff)
 			stream++;
 
+		// A truncated file runs out before the scan does
+		if (stream + 3 > jdata->m_end)
+			goto bogus_jpeg_format;
 		marker = *stream++;
 		chuck_len = BYTE_TO_WORD(stream);
+		if (marker != SOI && marker != EOI && stream + chuck_len > jdata->m_end)
+			goto bogus_jpeg_format;
 
 		switch (marker)
 		{
@@ -513,6 +614,14 @@ static int ParseJFIF(stJpegData *jdata, const uint8_t *stream)
 					return -1;
 				break;
 
+				// Only baseline frames can be decoded, not progressive,
+				// arithmetic coded or lossless ones
+			case 0xC1: case 0xC2: case 0xC3:
+			case 0xC5: case 0xC6: case 0xC7:
+			case 0xC9: case 0xCA: case 0xCB:
+			case 0xCD: case 0xCE: case 0xCF:
+				return -1;
+
 			case DQT:
 				if (ParseDQT(jdata, stream) < 0)
 					return -1;
@@ -540,7 +649,7 @@ static int ParseJFIF(stJpegData *jdata, const uint8_t *stream)
 				break;
 
 			case 0xDD: //DRI: Restart_markers=1;
-				jdata->m_restart_interval = BYTE_TO_WORD(stream);
+				jdata->m_restart_interval = BYTE_TO_WORD(stream + 2);
 				break;
 
 			case APP0:
@@ -554,16 +663,11 @@ static int ParseJFIF(stJpegData *jdata, const uint8_t *stream)
 	}
 
 	if (!dht_marker_found)
-	{
-		fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-		exit(-1);
-	}
+		return -1;
 
 	return 0;
 
 bogus_jpeg_format:
-	fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-	exit(-1);
 	return -1;
 }
 
@@ -573,244 +677,345 @@ static int JpegParseHeader(stJpegData *jdata, const uint8_t *buf)
 {
 	// Identify the file
 	if ((buf[0] != 0xFF) || (buf[1] != SOI))
+		return -1;
+	const uint8_t *startStream = buf + 2;
+	if (ParseJFIF(jdata, startStream) < 0)
+		return -1;
+	// There's nothing to decode without a frame
+	if (!jdata->m_width || !jdata->m_height)
+		return -1;
+	// and the scan has to be of Y, Cb and Cr, as described by the frame,
+	// with no more than 4 Y blocks and one each of Cb and Cr in an MCU
+	for (int i = cY; i <= cCr; i++)
 	{
-		fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-		exit(-1);
+		stComponent *c = &jdata->m_component_info[i];
+		if (!c->m_hFactor || !c->m_vFactor || !c->m_qTable || !c->m_dcTable || !c->m_acTable)
+			return -1;
+		if (c->m_hFactor * c->m_vFactor > (i == cY ? 4U : 1U))
+			return -1;
 	}
-	const uint8_t *startStream = buf + 2;
-	return ParseJFIF(jdata, startStream);
+	return 0;
 }
 
 /**********************************************************************/
 
-static uint32_t g_reservoir = 0;
-static uint32_t g_nbits_in_reservoir = 0;
-
-#define FillNBits(stream, nbits_wanted)                                 \
+//
+// A marker (anything but a stuffed 0xFF 0x00) ends the data, as does
+// the end of the file; either way what's wanted is padded with zeros and
+// the stream is left at the marker, for ProcessRestart to find. Codes
+// are looked up a few bits ahead, so padding may well be read, but
+// using any of it means the data ran into the marker: it's corrupt. (A
+// truncated file is decoded as if it had been padded, though.)
+//
+#define FillNBits(scan, nbits_wanted)                                   \
 	do                                                              \
 	{                                                               \
-		while (g_nbits_in_reservoir < (unsigned)nbits_wanted)   \
+		while (scan->m_nbits_in_reservoir < (unsigned)nbits_wanted) \
 		{                                                       \
-			uint8_t c = *(*stream)++;                       \
-			g_reservoir <<= 8;                              \
-			if (c == 0xff && **stream == 0x00)              \
-				(*stream)++;                            \
-			g_reservoir |= c;                               \
-			g_nbits_in_reservoir += 8;                      \
+			uint8_t c = 0x00;                               \
+			if (scan->m_stream < scan->m_end && *scan->m_stream != 0xff) \
+				c = *scan->m_stream++;                  \
+			else if (scan->m_stream + 1 < scan->m_end && scan->m_stream[1] == 0x00) \
+			{                                               \
+				c = 0xff;                               \
+				scan->m_stream += 2;                    \
+			}                                               \
+			else if (scan->m_stream + 1 < scan->m_end)      \
+				scan->m_padding += 8;                   \
+			scan->m_reservoir = (scan->m_reservoir << 8) | c; \
+			scan->m_nbits_in_reservoir += 8;                \
 		}                                                       \
 	}                                                               \
 	while (0)
 
-#define shift_bits(nbits_wanted)                                        \
+#define shift_bits(scan, nbits_wanted)                                  \
 	do                                                              \
 	{                                                               \
-		g_nbits_in_reservoir -= nbits_wanted;                   \
-		g_reservoir &= (1U << g_nbits_in_reservoir) - 1;        \
+		scan->m_nbits_in_reservoir -= nbits_wanted;             \
+		scan->m_reservoir &= (1U << scan->m_nbits_in_reservoir) - 1; \
 	}                                                               \
 	while (0)
 
-static inline int16_t GetNBits(const uint8_t **stream, int nbits_wanted)
+static inline int16_t GetNBits(stScanState *scan, int nbits_wanted)
 {
-	FillNBits(stream, nbits_wanted);
-	int16_t result = g_reservoir >> (g_nbits_in_reservoir - nbits_wanted);
-	shift_bits(nbits_wanted);
+	FillNBits(scan, nbits_wanted);
+	int16_t result = scan->m_reservoir >> (scan->m_nbits_in_reservoir - nbits_wanted);
+	shift_bits(scan, nbits_wanted);
 	return result;
 }
 
-static inline int LookNBits(const uint8_t **stream, int nbits_wanted)
-{
-	FillNBits(stream, nbits_wanted);
-	return g_reservoir >> (g_nbits_in_reservoir - nbits_wanted);
-}
-
-#define SkipNBits(stream, nbits_wanted)                                 \
-	do                                                              \
-	{                                                               \
-		FillNBits(stream, nbits_wanted);                        \
-		shift_bits(nbits_wanted);                               \
-	}                                                               \
-	while (0)
-
 /**********************************************************************/
-
-static bool IsInHuffmanCodes(int code, int numCodeBits, int numBlocks, stBlock *blocks, int *outValue)
+//
+// Huffman decode, as libjpeg does it: most codes are short, and are
+// found from a single lookup of the next few bits; the rest are checked
+// against the largest code of each length in turn. Returns the decoded
+// value, or -1 if the bits aren't a code in the table.
+//
+/**********************************************************************/
+static inline int DecodeHuffman(stScanState *scan, const stHuffmanTable *HT)
 {
-	for (int j = 0; j < numBlocks; j++)
-		if (code == blocks[j].code && numCodeBits == blocks[j].length)
+	FillNBits(scan, 16);
+	uint32_t bits = scan->m_reservoir >> (scan->m_nbits_in_reservoir - 16);
+
+	int look = bits >> (16 - HUFFMAN_LOOKAHEAD);
+	int length = HT->m_lookLength[look];
+	if (length)
+	{
+		shift_bits(scan, length);
+		return HT->m_lookValue[look];
+	}
+	for (length = HUFFMAN_LOOKAHEAD + 1; length <= 16; length++)
+	{
+		int32_t code = bits >> (16 - length);
+		if (code <= HT->m_maxCode[length])
 		{
-			*outValue = blocks[j].value;
-			return true; // We've got a match!
+			shift_bits(scan, length);
+			return HT->m_hufVal[(code + HT->m_valOffset[length]) & 0xff];
 		}
-	return false;
+	}
+	return -1;
 }
 
 /**********************************************************************/
 
 #define DetermineSign(val, nBits) ((val < (1 << (nBits - 1))) ? (signed)(val + (UINT64_MAX << nBits) + 1) : val)
 
-static void ProcessHuffmanDataUnit(stJpegData *jdata, int indx)
+//
+// A code which isn't in the table, a run of coefficients past the end
+// of the block, or running into a marker, means the data is corrupt;
+// it's noted in the scan state, rather than exiting, and the decode
+// stops there
+//
+static bool ProcessHuffmanDataUnit(stJpegData *jdata, stScanState *scan, int indx)
 {
 	stComponent *c = &jdata->m_component_info[indx];
 
 	// Start Huffman decoding
-	int16_t DCT_tcoeff[64] = { 0x0 };
-
-	bool found = false;
-	int decodedValue = 0;
-
-	// Scan Decode Resync
-	if (jdata->m_restart_interval > 0)
-		if (jdata->m_stream[0] == 0xff && jdata->m_stream[1] != 0x00)
-		{
-			// Something might be wrong, we should have had an interval marker set
-			jdata->m_stream += 2;
-			g_reservoir = 0;
-			g_nbits_in_reservoir = 0;
-
-			// The value in the interval marker determines what number it will count
-			// upto before looping back...i.e, for an interval marker of 4, we will
-			// have 0xFFD0, 0xFFD1, 0xFFD2, 0xFFD3, 0xFFD4, 0xFFD0, 0xFFD1..etc..looping
-			// so each time we get a resync, it will count from 0 to 4 then restart :)
-		}
-
-	// First thing is get the 1 DC coefficient at the start of our 64 element block
-	for (int k = 1; k < 16; k++)
+	int16_t *DCT_tcoeff = scan->m_DCT;
+	memset(DCT_tcoeff, 0x00, 64 * sizeof (int16_t));
+
+	// First thing is get the 1 DC coefficient at the start of our 64
+	// element block; the decoded value is the number of bits we have to
+	// read in next, for its difference from the one before
+	int numDataBits = DecodeHuffman(scan, c->m_dcTable);
+	if (numDataBits < 0 || numDataBits > 15)
 	{
-		// Keep grabbing one bit at a time till we find one thats a huffman code
-		int code = LookNBits(&jdata->m_stream, k);
-
-		// Check if its one of our huffman codes
-		if (IsInHuffmanCodes(code, k, c->m_dcTable->m_numBlocks, c->m_dcTable->m_blocks, &decodedValue))
-		{
-			// Skip over the rest of the bits now.
-			SkipNBits(&jdata->m_stream, k);
-
-			found = true;
-
-			// The decoded value is the number of bits we have to read in next
-			int numDataBits = decodedValue;
-			// We know the next k bits are for the actual data
-			if (numDataBits == 0)
-				DCT_tcoeff[0] = c->m_previousDC;
-			else
-			{
-				if (jdata->m_restart_interval > 0)
-					if (jdata->m_stream[0] == 0xff && jdata->m_stream[1] != 0x00)
-					{
-						jdata->m_stream += 2;
-						g_reservoir = 0;
-						g_nbits_in_reservoir = 0;
-					}
-
-				int16_t data = GetNBits(&jdata->m_stream, numDataBits);
-				data = (int16_t)DetermineSign(data, numDataBits);
-				DCT_tcoeff[0] = data + c->m_previousDC;
-				c->m_previousDC = DCT_tcoeff[0];
-			}
-			// Found so we can exit out
-			break;
-		}
+		scan->m_failed = true;
+		return false;
 	}
-
-	if (!found)
+	if (numDataBits == 0)
+		DCT_tcoeff[0] = scan->m_previousDC[indx];
+	else
 	{
-		fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-		exit(-1);
+		int16_t data = GetNBits(scan, numDataBits);
+		data = (int16_t)DetermineSign(data, numDataBits);
+		DCT_tcoeff[0] = data + scan->m_previousDC[indx];
+		scan->m_previousDC[indx] = DCT_tcoeff[0];
 	}
 
 	// Second, the 63 AC coefficient
-	int nr = 1;
-	bool EOB_found = false;
-	while ((nr <= 63) && (!EOB_found))
+	for (int nr = 1; nr <= 63; )
 	{
-		int k = 0;
-		for (k = 1; k <= 16; k++)
+		int valCode = DecodeHuffman(scan, c->m_acTable);
+		if (valCode < 0)
 		{
-			// Keep grabbing one bit at a time till we find one thats a huffman code
-			int code = LookNBits(&jdata->m_stream, k);
+			scan->m_failed = true;
+			return false;
+		}
 
-			// Check if its one of our huffman codes
-			if (IsInHuffmanCodes(code, k, c->m_acTable->m_numBlocks, c->m_acTable->m_blocks, &decodedValue))
+		// Our decoded value is broken down into 2 parts, repeating RLE, and then
+		// the number of bits that make up the actual value next
+		uint8_t size_val = valCode & 0xF; // Number of bits for our data
+		uint8_t count_0 = valCode >> 4; // Number RunLengthZeros
+
+		if (size_val == 0)
+		{ // RLE
+			if (count_0 == 0)
+				break; // EOB found, go out
+			else if (count_0 == 0xF)
+				nr += 16; // skip 16 zeros
+		}
+		else
+		{
+			nr += count_0; //skip count_0 zeroes
+			if (nr > 63)
 			{
-				// Skip over k bits, since we found the huffman value
-				SkipNBits(&jdata->m_stream, k);
-
-				// Our decoded value is broken down into 2 parts, repeating RLE, and then
-				// the number of bits that make up the actual value next
-				int valCode = decodedValue;
-
-				uint8_t size_val = valCode & 0xF; // Number of bits for our data
-				uint8_t count_0 = valCode >> 4; // Number RunLengthZeros
-
-				if (size_val == 0)
-				{ // RLE
-					if (count_0 == 0)
-						EOB_found = true; // EOB found, go out
-					else if (count_0 == 0xF)
-						nr += 16; // skip 16 zeros
-				}
-				else
-				{
-					nr += count_0; //skip count_0 zeroes
-					if (nr > 63)
-					{
-						fprintf(stderr, "Fail @ %s:%d\n", __FILE__, __LINE__);
-						exit(-1);
-					}
-
-					int16_t data = GetNBits(&jdata->m_stream, size_val);
-					data = (int16_t)DetermineSign(data, size_val);
-					DCT_tcoeff[nr++] = data;
-				}
-				break;
+				scan->m_failed = true;
+				return false;
 			}
+
+			int16_t data = GetNBits(scan, size_val);
+			data = (int16_t)DetermineSign(data, size_val);
+			DCT_tcoeff[nr++] = data;
 		}
+	}
 
-		if (k > 16)
-			nr++;
+	if (scan->m_nbits_in_reservoir < scan->m_padding)
+	{
+		scan->m_failed = true;
+		return false;
 	}
+	return true;
+}
 
-	// We've decoded a block of data, so copy it across to our buffer
-	for (int j = 0; j < 64; j++)
-		c->m_DCT[j] = DCT_tcoeff[j];
+/**********************************************************************/
+//
+// Scan Decode Resync
+//
+// Every m_restart_interval MCUs the encoder pads to a byte boundary and
+// writes an RSTn marker (0xFFD0 to 0xFFD7, cycling); the DC predictions
+// start again from 0. This has to be done by counting MCUs: the last
+// block before the marker can lie entirely within bits already in the
+// reservoir, so the stream can't be checked for the marker instead.
+//
+/**********************************************************************/
+static void ProcessRestart(stScanState *scan)
+{
+	scan->m_reservoir = 0;
+	scan->m_nbits_in_reservoir = 0;
+	scan->m_padding = 0;
+
+	while (scan->m_stream + 1 < scan->m_end && scan->m_stream[0] == 0xff && scan->m_stream[1] == 0xff)
+		scan->m_stream++;
+	if (scan->m_stream + 1 < scan->m_end && scan->m_stream[0] == 0xff && (scan->m_stream[1] & 0xf8) == 0xd0)
+		scan->m_stream += 2;
+
+	for (int i = 0; i < COMPONENTS; i++)
+		scan->m_previousDC[i] = 0;
 }
 
 /**********************************************************************/
 
-static void ConvertYCrCbtoRGB(int y, int cb, int cr, int *r, int *g, int *b)
+//
+// Colour conversion
+//
+// Fixed point, with the contribution of every possible chroma value
+// looked up rather than calculated; and a kernel for each of the common
+// sampling ratios, so each chroma sample is only fetched once for all of
+// the pixels which share it.
+//
+/**********************************************************************/
+
+#define SCALEBITS 16
+#define ONE_HALF  ((int32_t)1 << (SCALEBITS - 1))
+#define FIX(x)    ((int32_t)((x) * (1L << SCALEBITS) + 0.5))
+
+#define RANGE_OFFSET 256
+
+static int32_t Cr_r[256];
+static int32_t Cb_b[256];
+static int32_t Cr_g[256];
+static int32_t Cb_g[256];
+static uint8_t range_limit[RANGE_OFFSET * 3];
+
+static pthread_once_t colour_tables = PTHREAD_ONCE_INIT;
+
+static void BuildColourTables(void)
 {
-	*r = byte_limit((int)(y + 1.402   * (cb - 128)), 0);
-	*g = byte_limit((int)(y - 0.34414 * (cr - 128) - 0.71414 * (cb - 128)), 0);
-	*b = byte_limit((int)(y + 1.772   * (cr - 128)), 0);
+	for (int i = 0, x = -128; i < 256; i++, x++)
+	{
+		Cr_r[i] = (FIX(1.40200) * x + ONE_HALF) >> SCALEBITS;
+		Cb_b[i] = (FIX(1.77200) * x + ONE_HALF) >> SCALEBITS;
+		Cr_g[i] = -FIX(0.71414) * x;
+		Cb_g[i] = -FIX(0.34414) * x + ONE_HALF;
+	}
+	for (int i = 0; i < RANGE_OFFSET * 3; i++)
+		range_limit[i] = byte_limit(i - RANGE_OFFSET, 0);
 }
 
-/**********************************************************************/
+static inline void PutPixel(uint8_t *pix, int y, int r, int g, int b)
+{
+	pix[0] = range_limit[RANGE_OFFSET + y + r];
+	pix[1] = range_limit[RANGE_OFFSET + y + g];
+	pix[2] = range_limit[RANGE_OFFSET + y + b];
+}
 
-static void YCrCB_to_RGB24_Block8x8(stJpegData *jdata, int w, int h, int imgx, int imgy, int imgw, int imgh)
+// 4:4:4 - every pixel has its own chroma
+static void ConvertRowH1V1(uint8_t *out, const uint8_t *Y, const uint8_t *Cb, const uint8_t *Cr, int cols)
 {
-	const uint8_t *Y  = jdata->m_Y;
-	const uint8_t *Cb = jdata->m_Cb;
-	const uint8_t *Cr = jdata->m_Cr;
+	for (int x = 0; x < cols; x++, out += 3)
+		PutPixel(out, Y[x], Cr_r[Cr[x]], (Cb_g[Cb[x]] + Cr_g[Cr[x]]) >> SCALEBITS, Cb_b[Cb[x]]);
+}
 
-	for (int y = 0; y < (8 * h); y++)
-		for (int x = 0; x < (8 * w); x++)
-		{
-			if ((x + imgx >= imgw) || (y + imgy >= imgh))
-				continue;
+// 4:2:2 - chroma is shared by pairs of pixels across
+static void ConvertRowH2V1(uint8_t *out, const uint8_t *Y, const uint8_t *Cb, const uint8_t *Cr, int cols)
+{
+	for (int x = 0; x < cols; x += 2, out += 6)
+	{
+		int c = x >> 1;
+		int r = Cr_r[Cr[c]];
+		int g = (Cb_g[Cb[c]] + Cr_g[Cr[c]]) >> SCALEBITS;
+		int b = Cb_b[Cb[c]];
+		PutPixel(out, Y[x], r, g, b);
+		if (x + 1 < cols)
+			PutPixel(out + 3, Y[x + 1], r, g, b);
+	}
+}
 
-			int poff = x * 3 + jdata->m_width * 3 * y;
-			uint8_t *pix = &(jdata->m_colourspace[poff]);
+// 4:2:0 - chroma is shared by 2x2 pixels, so do two rows at once
+static void ConvertRowsH2V2(uint8_t *out0, uint8_t *out1, const uint8_t *Y0, const uint8_t *Y1, const uint8_t *Cb, const uint8_t *Cr, int cols)
+{
+	for (int x = 0; x < cols; x += 2, out0 += 6, out1 += 6)
+	{
+		int c = x >> 1;
+		int r = Cr_r[Cr[c]];
+		int g = (Cb_g[Cb[c]] + Cr_g[Cr[c]]) >> SCALEBITS;
+		int b = Cb_b[Cb[c]];
+		PutPixel(out0, Y0[x], r, g, b);
+		if (x + 1 < cols)
+			PutPixel(out0 + 3, Y0[x + 1], r, g, b);
+		// The bottom row of the image may be odd
+		if (!Y1)
+			continue;
+		PutPixel(out1, Y1[x], r, g, b);
+		if (x + 1 < cols)
+			PutPixel(out1 + 3, Y1[x + 1], r, g, b);
+	}
+}
 
-			int yoff = x + y * (w << 3);
-			int coff = (int)(x * (1.0 / w)) + ((int)(y * (1.0 / h)) << 3);
+// Anything else
+static void ConvertRow(uint8_t *out, const uint8_t *Y, const uint8_t *Cb, const uint8_t *Cr, int w, int cols)
+{
+	for (int x = 0; x < cols; x++, out += 3)
+	{
+		int c = x / w;
+		PutPixel(out, Y[x], Cr_r[Cr[c]], (Cb_g[Cb[c]] + Cr_g[Cr[c]]) >> SCALEBITS, Cb_b[Cb[c]]);
+	}
+}
 
-			int r, g, b;
-			ConvertYCrCbtoRGB(Y[yoff], Cr[coff], Cb[coff], &r, &g, &b);
+/**********************************************************************/
 
-			pix[0] = byte_limit(r, 0);
-			pix[1] = byte_limit(g, 0);
-			pix[2] = byte_limit(b, 0);
-		}
+static void YCrCB_to_RGB24_Block8x8(stJpegData *jdata, stScanState *scan, int w, int h, int imgx, int imgy, int imgw, int imgh)
+{
+	const uint8_t *Y  = scan->m_Y;
+	const uint8_t *Cb = scan->m_Cb;
+	const uint8_t *Cr = scan->m_Cr;
+
+	// Blocks are 8x8, or smaller when previewing
+	int n = jdata->m_block;
+
+	// Clip the MCU to the image once, not for every pixel
+	int cols = imgw - imgx < (n * w) ? imgw - imgx : (n * w);
+	int rows = imgh - imgy < (n * h) ? imgh - imgy : (n * h);
+
+	int stride = jdata->m_out_width * 3;
+	int ystride = w * n;
+	uint8_t *out = scan->m_colourspace;
+
+	if (w == 1 && h == 1)
+		for (int y = 0; y < rows; y++)
+			ConvertRowH1V1(out + y * stride, Y + y * ystride, Cb + y * n, Cr + y * n, cols);
+	else if (w == 2 && h == 1)
+		for (int y = 0; y < rows; y++)
+			ConvertRowH2V1(out + y * stride, Y + y * ystride, Cb + y * n, Cr + y * n, cols);
+	else if (w == 2 && h == 2)
+		for (int y = 0; y < rows; y += 2)
+			ConvertRowsH2V2(out + y * stride, out + (y + 1) * stride,
+					Y + y * ystride, y + 1 < rows ? Y + (y + 1) * ystride : NULL,
+					Cb + (y >> 1) * n, Cr + (y >> 1) * n, cols);
+	else
+		for (int y = 0; y < rows; y++)
+			ConvertRow(out + y * stride, Y + y * ystride, Cb + (y / h) * n, Cr + (y / h) * n, w, cols);
 }
 
 /**********************************************************************/
@@ -823,66 +1028,475 @@ static void YCrCB_to_RGB24_Block8x8(stJpegData *jdata, int w, int h, int imgx, i
 //  `-------'
 //
 /**********************************************************************/
-static void DecodeMCU(stJpegData *jdata, int w, int h)
+static void DecodeDataUnit(stJpegData *jdata, stScanState *scan, int indx, uint8_t *outputBuf, int stride)
+{
+	if (scan->m_failed || !ProcessHuffmanDataUnit(jdata, scan, indx))
+		return;
+
+	// When restart intervals are decoded in parallel (or only some of them
+	// are decoded) the message can only be found once the capacity of
+	// every interval before it is known; a preview has no use for it
+	if (jdata->m_action == JPEG_LOAD_PREVIEW)
+		;
+	else if (jdata->m_threads > 1 || jdata->m_action == JPEG_LOAD_ESTIMATE)
+		scan->m_bits += CountMessageBits(scan->m_DCT);
+	else
+		ProcessMessageBits(jdata, scan->m_DCT);
+
+	// Only go back to pixels if we're going to need them
+	if (scan->m_blocks)
+	{
+		memcpy(scan->m_blocks, scan->m_DCT, 64 * sizeof (int16_t));
+		scan->m_blocks += 64;
+	}
+	else if (jdata->m_rgb && jdata->m_block < 8)
+		DecodeScaledBlock(jdata, &jdata->m_component_info[indx], scan->m_DCT, outputBuf, stride);
+	else if (jdata->m_rgb)
+		DecodeSingleBlock(&jdata->m_component_info[indx], scan->m_DCT, outputBuf, stride);
+}
+
+static void DecodeMCU(stJpegData *jdata, stScanState *scan, int w, int h)
 {
+	int n = jdata->m_block;
+
 	// Y
 	for (int y = 0; y < h; y++)
 		for (int x = 0; x < w; x++)
-		{
-			ProcessHuffmanDataUnit(jdata, cY);
-			DecodeSingleBlock(&jdata->m_component_info[cY], &jdata->m_Y[(x << 3) + (y * w << 6)], w << 3);
-		}
+			DecodeDataUnit(jdata, scan, cY, &scan->m_Y[x * n + y * w * n * n], w * n);
 
 	// Cb
-	ProcessHuffmanDataUnit(jdata, cCb);
-	DecodeSingleBlock(&jdata->m_component_info[cCb], jdata->m_Cb, 8);
+	DecodeDataUnit(jdata, scan, cCb, scan->m_Cb, n);
 
 	// Cr
-	ProcessHuffmanDataUnit(jdata, cCr);
-	DecodeSingleBlock(&jdata->m_component_info[cCr], jdata->m_Cr, 8);
+	DecodeDataUnit(jdata, scan, cCr, scan->m_Cr, n);
 }
 
 /**********************************************************************/
 
-static int JpegDecode(stJpegData *jdata)
+static void DecodeMCURange(stJpegData *jdata, stScanState *scan, int first, int last)
 {
-	g_reservoir = 0;
-	g_nbits_in_reservoir = 0;
-
 	int hFactor = jdata->m_component_info[cY].m_hFactor;
 	int vFactor = jdata->m_component_info[cY].m_vFactor;
 
-	// RGB24:
-	if (jdata->m_rgb == NULL)
+	int xstride_by_mcu = hFactor * jdata->m_block;
+	int ystride_by_mcu = vFactor * jdata->m_block;
+
+	// Just the decode the image by 'macroblock' (size is 8x8, 8x16, or 16x16)
+	for (int mcu = first; mcu < last; mcu++)
 	{
-		int h = jdata->m_height * 3;
-		int w = jdata->m_width * 3;
-		int height = h + (hFactor << 3) - (h % (hFactor << 3));
-		int width = w + (vFactor << 3) - (w % (vFactor << 3));
-		jdata->m_rgb = calloc(width * height, sizeof (uint8_t));
+		if (jdata->m_restart_interval && mcu != first && !(mcu % jdata->m_restart_interval))
+			ProcessRestart(scan);
+		// Decode MCU Plane
+		DecodeMCU(jdata, scan, hFactor, vFactor);
+		if (scan->m_failed)
+			return;
+		if (!jdata->m_rgb)
+			continue;
+		int x = (mcu % jdata->m_xmcus) * xstride_by_mcu;
+		int y = (mcu / jdata->m_xmcus) * ystride_by_mcu;
+		scan->m_colourspace = jdata->m_rgb + x * 3 + (y * jdata->m_out_width * 3);
+		YCrCB_to_RGB24_Block8x8(jdata, scan, hFactor, vFactor, x, y, jdata->m_out_width, jdata->m_out_height);
 	}
+}
 
-	jdata->m_component_info[0].m_previousDC = 0;
-	jdata->m_component_info[1].m_previousDC = 0;
-	jdata->m_component_info[2].m_previousDC = 0;
-	jdata->m_component_info[3].m_previousDC = 0;
+/**********************************************************************/
+//
+// Parallel decoding of restart intervals
+//
+// Each interval starts byte aligned, after an RSTn marker, with fresh DC
+// predictions; so given where each one starts they can all be decoded
+// at the same time, each into its own part of the output. The message
+// is then found in a second pass, once the number of usable coefficients
+// in each interval (and so the bit offset of each) is known.
+//
+/**********************************************************************/
 
-	int xstride_by_mcu = hFactor << 3;
-	int ystride_by_mcu = vFactor << 3;
+typedef struct stIntervals
+{
+	stJpegData *m_jdata;
+	void (*m_task)(struct stIntervals *, int);
+	const uint8_t **m_starts;   // Where each interval starts in the stream
+	int *m_sample;              // When sampling, which intervals to decode
+	uint64_t *m_bits;           // How many usable coefficients are in each
+	uint64_t *m_offsets;        // and so each one's offset into the message
+	uint64_t m_limit;           // Bits of message there are to find
+	int m_intervals;
+	int m_next;                 // Next interval for a worker to take
+	bool m_failed;              // Some interval couldn't be decoded
+} stIntervals;
+
+static const uint8_t **FindRestartMarkers(stJpegData *jdata, int intervals)
+{
+	const uint8_t **starts = malloc(intervals * sizeof (uint8_t *));
+	int found = 0;
+	starts[found++] = jdata->m_stream;
 
-	// Just the decode the image by 'macroblock' (size is 8x8, 8x16, or 16x16)
-	for (int y = 0; y < (int)jdata->m_height; y += ystride_by_mcu)
+	for (const uint8_t *p = jdata->m_stream; found < intervals && p + 1 < jdata->m_end; p++)
+	{
+		// Skip any stuffed 0x00 or fill bytes
+		if (p[0] != 0xff || p[1] == 0x00 || p[1] == 0xff)
+			continue;
+		// Any other marker is the end of the scan
+		if ((p[1] & 0xf8) != 0xd0)
+			break;
+		starts[found++] = p + 2;
+		p++;
+	}
+
+	if (found < intervals)
+	{
+		free(starts);
+		return NULL;
+	}
+	return starts;
+}
+
+static void DecodeInterval(stIntervals *work, int i)
+{
+	stJpegData *jdata = work->m_jdata;
+	int units = jdata->m_component_info[cY].m_hFactor * jdata->m_component_info[cY].m_vFactor + 2;
+	int first = i * jdata->m_restart_interval;
+	int last = first + jdata->m_restart_interval;
+	if (last > jdata->m_mcus)
+		last = jdata->m_mcus;
+
+	stScanState scan;
+	memset(&scan, 0x00, sizeof scan);
+	scan.m_stream = work->m_starts[i];
+	scan.m_end = jdata->m_end;
+	if (jdata->m_blocks)
+		scan.m_blocks = jdata->m_blocks + (uint64_t)first * units * 64;
+
+	DecodeMCURange(jdata, &scan, first, last);
+
+	work->m_bits[i] = scan.m_bits;
+	if (scan.m_failed)
+		work->m_failed = true;
+}
+
+static void ExtractInterval(stIntervals *work, int i)
+{
+	stJpegData *jdata = work->m_jdata;
+	int units = jdata->m_component_info[cY].m_hFactor * jdata->m_component_info[cY].m_vFactor + 2;
+	int first = i * jdata->m_restart_interval;
+	int last = first + jdata->m_restart_interval;
+	if (last > jdata->m_mcus)
+		last = jdata->m_mcus;
+
+	jpeg_message_t *message = jdata->m_message;
+	const int16_t *block = jdata->m_blocks + (uint64_t)first * units * 64;
+	const int16_t *end = jdata->m_blocks + (uint64_t)last * units * 64;
+
+	// The length was read before any of this began
+	for (uint64_t offset = work->m_offsets[i]; block < end && offset < work->m_limit; block++)
+		if (*block > 1)
+		{
+			// Intervals can share a byte at either end
+			if (offset >= sizeof message->size * 8 && (*block & 0x01))
+				__sync_fetch_and_or(&message->data[offset >> 3], 1 << (offset & 0x07));
+			offset++;
+		}
+}
+
+static void SampleInterval(stIntervals *work, int i)
+{
+	stJpegData *jdata = work->m_jdata;
+	int first = work->m_sample[i] * jdata->m_restart_interval;
+	int last = first + jdata->m_restart_interval;
+	if (last > jdata->m_mcus)
+		last = jdata->m_mcus;
+
+	stScanState scan;
+	memset(&scan, 0x00, sizeof scan);
+	scan.m_stream = work->m_starts[work->m_sample[i]];
+	scan.m_end = jdata->m_end;
+
+	DecodeMCURange(jdata, &scan, first, last);
+
+	work->m_bits[i] = scan.m_bits;
+	if (scan.m_failed)
+		work->m_failed = true;
+}
+
+static void *IntervalWorker(void *arg)
+{
+	stIntervals *work = arg;
+	for (int i; (i = __sync_fetch_and_add(&work->m_next, 1)) < work->m_intervals; )
+		work->m_task(work, i);
+	return NULL;
+}
+
+static void RunIntervals(stIntervals *work, void (*task)(stIntervals *, int))
+{
+	work->m_task = task;
+	work->m_next = 0;
+
+	int threads = work->m_jdata->m_threads < work->m_intervals ? work->m_jdata->m_threads : work->m_intervals;
+	pthread_t *t = malloc(threads * sizeof (pthread_t));
+	int started = 0;
+	// This thread is one of the workers too
+	for (int i = 1; i < threads; i++)
+		if (!pthread_create(&t[started], NULL, IntervalWorker, work))
+			started++;
+	IntervalWorker(work);
+	for (int i = 0; i < started; i++)
+		pthread_join(t[i], NULL);
+	free(t);
+}
+
+static void ExtractMessage(stJpegData *jdata, stIntervals *work)
+{
+	int units = jdata->m_component_info[cY].m_hFactor * jdata->m_component_info[cY].m_vFactor + 2;
+	const int16_t *end = jdata->m_blocks + (uint64_t)jdata->m_mcus * units * 64;
+
+	// The length comes first, and is needed to know how much to find
+	uint64_t size = 0;
+	uint64_t offset = 0;
+	for (const int16_t *block = jdata->m_blocks; block < end && offset < sizeof size * 8; block++)
+		if (*block > 1)
+		{
+			if (*block & 0x01)
+				((uint8_t *)&size)[offset >> 3] |= 1 << (offset & 0x07);
+			offset++;
+		}
+	work->m_offsets = malloc(work->m_intervals * sizeof (uint64_t));
+	uint64_t o = 0;
+	for (int i = 0; i < work->m_intervals; o += work->m_bits[i], i++)
+		work->m_offsets[i] = o;
+
+	jpeg_message_t *message = jdata->m_message;
+	uint64_t room = o / 8 > sizeof message->size ? o / 8 - sizeof message->size : 0;
+	message->size = ntohll(size);
+	// When filling everything is the message; and an image with nothing
+	// hidden in it gives any old length, so it's kept to what will fit
+	if (jdata->m_fill_size || message->size > room)
+		message->size = room;
+	message->data = calloc(message->size + sizeof message->size, sizeof (uint8_t));
+	work->m_limit = (message->size + sizeof message->size) * 8;
+
+	RunIntervals(work, ExtractInterval);
+
+	free(work->m_offsets);
+}
+
+static bool JpegDecodeIntervals(stJpegData *jdata, const uint8_t **starts, int intervals)
+{
+	stIntervals work;
+	memset(&work, 0x00, sizeof work);
+	work.m_jdata = jdata;
+	work.m_starts = starts;
+	work.m_bits = calloc(intervals, sizeof (uint64_t));
+	work.m_intervals = intervals;
+
+	// The coefficients are needed to find the message afterwards
+	int16_t *blocks = NULL;
+	if (jdata->m_action == JPEG_LOAD_FIND)
+	{
+		int units = jdata->m_component_info[cY].m_hFactor * jdata->m_component_info[cY].m_vFactor + 2;
+		jdata->m_blocks = blocks = scratch_alloc((uint64_t)jdata->m_mcus * units * 64 * sizeof (int16_t), jdata->m_max_memory);
+	}
+
+	RunIntervals(&work, DecodeInterval);
+
+	if (!work.m_failed && jdata->m_action == JPEG_LOAD_FIND)
+		ExtractMessage(jdata, &work);
+	else if (!work.m_failed)
+		for (int i = 0; i < intervals; i++)
+			jdata->m_message->size += work.m_bits[i];
+
+	if (blocks)
+	{
+		scratch_free(blocks);
+		jdata->m_blocks = NULL;
+	}
+	free(work.m_bits);
+	return !work.m_failed;
+}
+
+/**********************************************************************/
+//
+// Capacity estimate
+//
+// The intervals are split into equal strata and one of each, picked at
+// random, is decoded; each stratum is then taken to have as many usable
+// coefficients per MCU as its sample, and the spread of those densities
+// gives the margin of error (95%, allowing for how much of the image
+// was sampled). Always taking the same place in each stratum would only
+// ever see the same rows of an image which repeats down its length, and
+// the margin wouldn't hold. The picks are seeded from the image itself
+// (the lengths of its intervals), so it's always given the same estimate.
+// At least SAMPLE_INTERVALS intervals, or SAMPLE_MCUS MCUs, are decoded;
+// if that's all of them the count is exact.
+//
+/**********************************************************************/
+
+#define SAMPLE_INTERVALS 16
+#define SAMPLE_MCUS      4096
+
+static void SampleSeed(const uint8_t **starts, int intervals, unsigned short seed[3])
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (int i = 1; i < intervals; i++)
+		hash = (hash ^ (uint64_t)(starts[i] - starts[i - 1])) * 0x100000001b3;
+	seed[0] = hash;
+	seed[1] = hash >> 16;
+	seed[2] = hash >> 32;
+}
+
+static bool JpegSampleIntervals(stJpegData *jdata, const uint8_t **starts, int intervals)
+{
+	int interval = jdata->m_restart_interval;
+	int samples = (SAMPLE_MCUS + interval - 1) / interval;
+	if (samples < SAMPLE_INTERVALS)
+		samples = SAMPLE_INTERVALS;
+	if (samples > intervals)
+		samples = intervals;
+
+	stIntervals work;
+	memset(&work, 0x00, sizeof work);
+	work.m_jdata = jdata;
+	work.m_starts = starts;
+	work.m_bits = calloc(samples, sizeof (uint64_t));
+	work.m_sample = malloc(samples * sizeof (int));
+	work.m_intervals = samples;
+
+	unsigned short seed[3];
+	SampleSeed(starts, intervals, seed);
+	for (int i = 0; i < samples; i++)
+	{
+		int first = (int64_t)i * intervals / samples;
+		int last = (int64_t)(i + 1) * intervals / samples;
+		work.m_sample[i] = first + (int)(erand48(seed) * (last - first));
+	}
+
+	RunIntervals(&work, SampleInterval);
+	if (work.m_failed)
+	{
+		free(work.m_sample);
+		free(work.m_bits);
+		return false;
+	}
+
+	double total = 0.0;
+	double sum = 0.0;
+	double squares = 0.0;
+	for (int i = 0; i < samples; i++)
+	{
+		int64_t first = (int64_t)i * intervals / samples * interval;
+		int64_t last = (int64_t)(i + 1) * intervals / samples * interval;
+		if (last > jdata->m_mcus)
+			last = jdata->m_mcus;
+		int64_t sampled = work.m_sample[i] * (int64_t)interval;
+		int64_t mcus = (sampled + interval < jdata->m_mcus ? sampled + interval : jdata->m_mcus) - sampled;
+
+		double density = (double)work.m_bits[i] / mcus;
+		total += density * (last - first);
+		sum += density;
+		squares += density * density;
+	}
+	jdata->m_message->size = llround(total);
+
+	if (samples > 1 && samples < intervals)
+	{
+		double mean = sum / samples;
+		double variance = (squares - samples * mean * mean) / (samples - 1);
+		if (variance > 0.0)
+			jdata->m_margin = llround(1.96 * jdata->m_mcus * sqrt(variance / samples * (1.0 - (double)samples / intervals)));
+	}
+
+	free(work.m_sample);
+	free(work.m_bits);
+	return true;
+}
+
+/**********************************************************************/
+
+static int JpegDecode(stJpegData *jdata)
+{
+	int hFactor = jdata->m_component_info[cY].m_hFactor;
+	int vFactor = jdata->m_component_info[cY].m_vFactor;
+
+	// RGB24: colour conversion is clipped to the image, so this is
+	// exactly the size of the image (or preview) and is handed on as it is
+	if ((jdata->m_action == JPEG_LOAD_READ || jdata->m_action == JPEG_LOAD_PREVIEW) && jdata->m_rgb == NULL)
 	{
-		for (int x = 0; x < (int)jdata->m_width; x += xstride_by_mcu)
+		jdata->m_rgb = scratch_alloc((uint64_t)jdata->m_out_width * jdata->m_out_height * 3, jdata->m_max_memory);
+		pthread_once(&colour_tables, BuildColourTables);
+	}
+
+	jdata->m_xmcus = (jdata->m_width + (hFactor << 3) - 1) / (hFactor << 3);
+	jdata->m_mcus = jdata->m_xmcus * ((jdata->m_height + (vFactor << 3) - 1) / (vFactor << 3));
+
+	bool estimate = jdata->m_action == JPEG_LOAD_ESTIMATE;
+	if ((jdata->m_threads > 1 || estimate) && jdata->m_restart_interval)
+	{
+		int intervals = (jdata->m_mcus + jdata->m_restart_interval - 1) / jdata->m_restart_interval;
+		const uint8_t **starts = intervals > 1 ? FindRestartMarkers(jdata, intervals) : NULL;
+		if (starts)
 		{
-			jdata->m_colourspace = jdata->m_rgb + x * 3 + (y * jdata->m_width * 3);
-			// Decode MCU Plane
-			DecodeMCU(jdata, hFactor, vFactor);
-			YCrCB_to_RGB24_Block8x8(jdata, hFactor, vFactor, x, y, jdata->m_width, jdata->m_height);
+			bool ok = estimate ? JpegSampleIntervals(jdata, starts, intervals) : JpegDecodeIntervals(jdata, starts, intervals);
+			free(starts);
+			return ok ? 0 : -1;
 		}
 	}
 
-	return 0;
+	// Otherwise it's a single pass through the whole scan (which is the
+	// only way to estimate the capacity without restart intervals too,
+	// so the estimate is exact)
+	jdata->m_threads = 1;
+
+	stScanState scan;
+	memset(&scan, 0x00, sizeof scan);
+	scan.m_stream = jdata->m_stream;
+	scan.m_end = jdata->m_end;
+	scan.m_blocks = jdata->m_blocks;
+
+	DecodeMCURange(jdata, &scan, 0, jdata->m_mcus);
+	jdata->m_message->size += scan.m_bits;
+
+	return scan.m_failed ? -1 : 0;
+}
+
+/**********************************************************************/
+//
+// Hold on to everything needed to re-encode the quantised coefficients
+// without going via the pixel domain
+//
+/**********************************************************************/
+static void KeepCoefficients(stJpegData *jdata, jpeg_coefficients_t *coeff, uint8_t *buf)
+{
+	int hFactor = jdata->m_component_info[cY].m_hFactor;
+	int vFactor = jdata->m_component_info[cY].m_vFactor;
+
+	int xmcus = (jdata->m_width + (hFactor << 3) - 1) / (hFactor << 3);
+	int ymcus = (jdata->m_height + (vFactor << 3) - 1) / (vFactor << 3);
+
+	// Only the markers are needed, the scan is written from the blocks
+	coeff->header = jdata->m_stream - buf;
+	coeff->stream = malloc(coeff->header);
+	memcpy(coeff->stream, buf, coeff->header);
+	coeff->mcus = xmcus * ymcus;
+	coeff->h_factor = hFactor;
+	coeff->v_factor = vFactor;
+	coeff->restart_interval = jdata->m_restart_interval;
+
+	for (int i = 0; i < 3; i++)
+	{
+		stComponent *c = &jdata->m_component_info[cY + i];
+		coeff->dc_table[i] = c->m_dcTable - jdata->m_HTDC;
+		coeff->ac_table[i] = c->m_acTable - jdata->m_HTAC;
+	}
+	for (int i = 0; i < HUFFMAN_TABLES; i++)
+	{
+		memcpy(coeff->dc_bits[i], jdata->m_HTDC[i].m_length, sizeof coeff->dc_bits[i]);
+		memcpy(coeff->dc_values[i], jdata->m_HTDC[i].m_hufVal, sizeof coeff->dc_values[i]);
+		memcpy(coeff->ac_bits[i], jdata->m_HTAC[i].m_length, sizeof coeff->ac_bits[i]);
+		memcpy(coeff->ac_values[i], jdata->m_HTAC[i].m_hufVal, sizeof coeff->ac_values[i]);
+	}
+
+	coeff->blocks = scratch_alloc((uint64_t)coeff->mcus * (hFactor * vFactor + 2) * 64 * sizeof (int16_t), jdata->m_max_memory);
+	jdata->m_blocks = coeff->blocks;
 }
 
 /**********************************************************************/
@@ -895,49 +1509,90 @@ static int JpegDecode(stJpegData *jdata)
 /**********************************************************************/
 
 
-extern bool jpeg_decode_data(FILE *file, jpeg_message_t *msg, jpeg_image_t *info, jpeg_load_e a, bool fill)
+extern bool jpeg_decode_data(FILE *file, jpeg_message_t *msg, jpeg_image_t *info, jpeg_load_e action, bool fill, uint32_t threads)
 {
-	message = msg;
-	action = a;
-
-	fseek(file, 0, SEEK_END);
-	int64_t length = ftell(file);
-	fseek(file, 0, SEEK_SET);
-	uint8_t *buf = malloc(length);
-	fread(buf, length, 1, file);
+	// Map the file rather than read it; nothing is copied out of it
+	// except the markers kept for transcoding
+	struct stat st;
+	if (fstat(fileno(file), &st) < 0 || st.st_size < 4)
+		return false;
+	uint64_t length = st.st_size;
+	uint8_t *buf = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (buf == MAP_FAILED)
+		return false;
+	madvise(buf, length, MADV_SEQUENTIAL);
 
 	// Allocate memory for our decoded jpg structure, all our data will be
 	// decompressed and stored in here for the various stages of our jpeg decoding
 	stJpegData jdec;
 	memset(&jdec, 0x00, sizeof jdec);
+	jdec.m_end = buf + length;
+	jdec.m_threads = threads ? : sysconf(_SC_NPROCESSORS_ONLN);
+	jdec.m_max_memory = info->max_memory;
+	jdec.m_message = msg;
+	jdec.m_action = action;
+	jdec.m_bit = 1;
 
 	// Start Parsing.....reading & storing data
 	if (JpegParseHeader(&jdec, buf) < 0)
 	{
-		free(buf);
+		munmap(buf, length);
 		return false;
 	}
 
 	if (fill)
-		fill_size = jdec.m_width * jdec.m_height * 3;
+		jdec.m_fill_size = jdec.m_width * jdec.m_height * 3;
+
+	// Previews are decoded straight to 1/2, 1/4 or 1/8 of the size
+	int scale = action == JPEG_LOAD_PREVIEW && info->scale ? info->scale : 1;
+	jdec.m_block = 8 / scale;
+	jdec.m_out_width = (jdec.m_width + scale - 1) / scale;
+	jdec.m_out_height = (jdec.m_height + scale - 1) / scale;
+	if (scale > 1)
+		BuildScaledCosines(&jdec);
+
+	if (action == JPEG_LOAD_TRANSCODE)
+		KeepCoefficients(&jdec, &info->coefficients, buf);
+
+	// We've read it all in, now start using it, to decompress and create
+	// rgb values; corrupt data is an error, the same as a bad header
+	if (JpegDecode(&jdec) < 0)
+	{
+		scratch_free(jdec.m_rgb);
+		free(msg->data);
+		msg->data = NULL;
+		munmap(buf, length);
+		errno = EBADMSG;
+		return false;
+	}
 
-	// We've read it all in, now start using it, to decompress and create rgb values
-	JpegDecode(&jdec);
+	// Capacity was counted in bits
+	if (action != JPEG_LOAD_FIND)
+		msg->size /= 8;
+	// and when filling, everything that was found is the message (this
+	// is known up front if the intervals were decoded in parallel)
+	else if (fill && jdec.m_threads == 1)
+		msg->size = jdec.m_offset > sizeof msg->size ? jdec.m_offset - sizeof msg->size : 0;
 
-	// Get the size of the image
-	info->width = jdec.m_width;
-	info->height = jdec.m_height;
+	info->margin = jdec.m_margin / 8;
 
-	info->rgb = calloc(info->height, sizeof (uint8_t *));
-	for (uint32_t i = 0; i < info->height; i++)
+	// Get the size of the image (as decoded)
+	info->width = jdec.m_out_width;
+	info->height = jdec.m_out_height;
+
+	// The decoded image is passed on as it is, for the encoder
+	info->rgb = jdec.m_rgb;
+	// along with the original quantisation, to re-encode it the same
+	for (int i = 0; i < 64; i++)
 	{
-		info->rgb[i] = calloc(info->width, 3);
-		memcpy(info->rgb[i], jdec.m_rgb + i * info->width * 3, info->width * 3);
+		info->quant[0][i] = jdec.m_component_info[cY].m_qTable[i];
+		info->quant[1][i] = jdec.m_component_info[cCb].m_qTable[i];
 	}
+	// and its chroma subsampling, as far as the encoder can write it
+	info->h_factor = jdec.m_component_info[cY].m_hFactor > 1 ? 2 : 1;
+	info->v_factor = jdec.m_component_info[cY].m_vFactor > 1 ? 2 : 1;
 
-	// Release the memory for our jpeg decoder structure jdec
-	free(jdec.m_rgb);
-	free(buf);
+	munmap(buf, length);
 
 	return true;
 }
@@ -18,15 +18,16 @@
 #include <string.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "jpeg.h"
+#include "scratch.h"
 
 /**********************************************************************/
 
 
-static jpeg_message_t *message;
-
-
 typedef struct
 {
 	uint16_t marker;            // = 0xFFE0
@@ -41,7 +42,7 @@ typedef struct
 	uint8_t thumbnheight;       // 0
 } APP0infotype;
 
-static APP0infotype APP0info = { 0xFFE0, 16, "JFIF", 1, 1, 0, 1, 1, 0, 0 };
+static const APP0infotype APP0info = { 0xFFE0, 16, "JFIF", 1, 1, 0, 1, 1, 0, 0 };
 
 typedef struct
 {
@@ -62,7 +63,7 @@ typedef struct
 	uint8_t QTCr;               // Normally equal to QTCb = 1
 } SOF0infotype;
 
-static SOF0infotype SOF0info = { 0xFFC0, 17, 8, 0, 0, 3, 1, 0x11, 0, 2, 0x11, 1, 3, 0x11, 1 };
+static const SOF0infotype SOF0default = { 0xFFC0, 17, 8, 0, 0, 3, 1, 0x11, 0, 2, 0x11, 1, 3, 0x11, 1 };
 
 // Default sampling factors are 1,1 for every image component: No downsampling
 
@@ -77,35 +78,11 @@ typedef struct
 	uint8_t Cbtable[64];
 } DQTinfotype;
 
-static DQTinfotype DQTinfo;
-
 // Ytable from DQTinfo should be equal to a scaled and zizag reordered version
 // of the table which can be found in "tables.h": std_luminance_qt
 // Cbtable , similar = std_chrominance_qt
 // We'll init them in the program using set_DQTinfo function
 
-typedef struct
-{
-	uint16_t marker;            // = 0xFFC4
-	uint16_t length;            //0x01A2
-	uint8_t HTYDCinfo;          // bit 0..3: number of HT (0..3), for Y =0
-	// bit 4  :type of HT, 0 = DC table,1 = AC table
-	// bit 5..7: not used, must be 0
-	uint8_t YDC_nrcodes[16];    //at index i = nr of codes with length i
-	uint8_t YDC_values[12];
-	uint8_t HTYACinfo;          // = 0x10
-	uint8_t YAC_nrcodes[16];
-	uint8_t YAC_values[162];    //we'll use the standard Huffman tables
-	uint8_t HTCbDCinfo;         // = 1
-	uint8_t CbDC_nrcodes[16];
-	uint8_t CbDC_values[12];
-	uint8_t HTCbACinfo;         //  = 0x11
-	uint8_t CbAC_nrcodes[16];
-	uint8_t CbAC_values[162];
-} DHTinfotype;
-
-static DHTinfotype DHTinfo;
-
 typedef struct
 {
 	uint16_t marker;            // = 0xFFDA
@@ -121,7 +98,7 @@ typedef struct
 	uint8_t Ss, Se, Bf;         // not interesting, they should be 0,63,0
 } SOSinfotype;
 
-static SOSinfotype SOSinfo = { 0xFFDA, 12, 3, 1, 0, 2, 0x11, 3, 0x11, 0, 0x3F, 0 };
+static const SOSinfotype SOSinfo = { 0xFFDA, 12, 3, 1, 0, 2, 0x11, 3, 0x11, 0, 0x3F, 0 };
 
 typedef struct
 {
@@ -136,15 +113,21 @@ typedef struct
 	uint16_t value;
 } bitstring;
 
+typedef struct
+{
+	uint32_t recip[64];         // Quantisation is done by multiplying by the reciprocal
+	uint32_t corr[64];          // of each divisor, plus a correction for rounding,
+	uint8_t shift[64];          // then shifting back down
+} divisors;
+
 #define  Y(R,G,B) ((uint8_t)((YRtab[(R)]  + YGtab[(G)]  + YBtab[(B)])  >> 16) - 128)
 #define Cb(R,G,B) ((uint8_t)((CbRtab[(R)] + CbGtab[(G)] + CbBtab[(B)]) >> 16))
 #define Cr(R,G,B) ((uint8_t)((CrRtab[(R)] + CrGtab[(G)] + CrBtab[(B)]) >> 16))
 
-#define writebyte(b) fputc((b), fp_jpeg_stream)
-#define writeword(w) writebyte((w) / 256); writebyte((w) % 256)
-#define writetext(t) fputs((t), fp_jpeg_stream)
+#define writeword(e, w) writebyte(e, (w) / 256); writebyte(e, (w) % 256)
+#define writetext(e, t) for (const char *c = (t); *c; c++) writebyte(e, *c)
 
-static uint8_t zigzag[64] =
+static const uint8_t zigzag[64] =
 {
 	 0,  1,  5,  6, 14, 15, 27, 28,
 	 2,  4,  7, 13, 16, 26, 29, 42,
@@ -159,7 +142,7 @@ static uint8_t zigzag[64] =
 // These are the sample quantization tables given in JPEG spec section K.1.
 // The spec says that the values given produce "good" quality, and
 // when divided by 2, "very good" quality
-static uint8_t std_luminance_qt[64] =
+static const uint8_t std_luminance_qt[64] =
 {
 	16, 11, 10, 16,  24,  40,  51,  61,
 	12, 12, 14, 19,  26,  58,  60,  55,
@@ -171,7 +154,7 @@ static uint8_t std_luminance_qt[64] =
 	72, 92, 95, 98, 112, 100, 103,  99
 };
 
-static uint8_t std_chrominance_qt[64] =
+static const uint8_t std_chrominance_qt[64] =
 {
 	17, 18, 24, 47, 99, 99, 99, 99,
 	18, 21, 26, 66, 99, 99, 99, 99,
@@ -185,15 +168,15 @@ static uint8_t std_chrominance_qt[64] =
 
 // Standard Huffman tables (cf. JPEG standard section K.3)
 
-static uint8_t std_dc_luminance_nrcodes[17] = { 0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
-static uint8_t std_dc_luminance_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const uint8_t std_dc_luminance_nrcodes[17] = { 0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t std_dc_luminance_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
 
-static uint8_t std_dc_chrominance_nrcodes[17] = { 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
-static uint8_t std_dc_chrominance_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const uint8_t std_dc_chrominance_nrcodes[17] = { 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t std_dc_chrominance_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
 
-static uint8_t std_ac_luminance_nrcodes[17] = { 0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t std_ac_luminance_nrcodes[17] = { 0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
 
-static uint8_t std_ac_luminance_values[162] =
+static const uint8_t std_ac_luminance_values[162] =
 {
 	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
 	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
@@ -218,9 +201,9 @@ static uint8_t std_ac_luminance_values[162] =
 	0xf9, 0xfa
 };
 
-static uint8_t std_ac_chrominance_nrcodes[17] = { 0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t std_ac_chrominance_nrcodes[17] = { 0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
 
-static uint8_t std_ac_chrominance_values[162] =
+static const uint8_t std_ac_chrominance_values[162] =
 {
 	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
 	0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
@@ -245,105 +228,170 @@ static uint8_t std_ac_chrominance_values[162] =
 	0xf9, 0xfa
 };
 
-static const double AAN_SCALE_FACTOR[8] =
+/**********************************************************************/
+
+// Tables for a faster RGB->YCbCr transformation, scaled by 2^16 so that
+// we can work with integers; all are worked out as the code is compiled
+#define RED_Y     19595.76400 // 65536 *  0.29900 + 0.5
+#define RED_Cb   -11058.04464 // 65536 * -0.16874 + 0.5
+#define RED_Cr    32768.00000 // 32768
+
+#define GREEN_Y   38470.13200 // 65536 *  0.58700 + 0.5
+#define GREEN_Cb -21708.95536 // 65536 * -0.33126 + 0.5
+#define GREEN_Cr -27438.76784 // 65536 * -0.41869 + 0.5
+
+#define BLUE_Y     7471.60400 // 65536 *  0.11400 + 0.5
+#define BLUE_Cb   32768.00000 // 32768
+#define BLUE_Cr   -5328.23216 // 65536 * -0.08131 + 0.5
+
+#define SCALED(c, i) ((int32_t)((c) * (i)))
+#define SCALED4(c, i)   SCALED(c, i),     SCALED(c, i + 1),    SCALED(c, i + 2),     SCALED(c, i + 3)
+#define SCALED16(c, i)  SCALED4(c, i),    SCALED4(c, i + 4),   SCALED4(c, i + 8),    SCALED4(c, i + 12)
+#define SCALED64(c, i)  SCALED16(c, i),   SCALED16(c, i + 16), SCALED16(c, i + 32),  SCALED16(c, i + 48)
+#define SCALED256(c)    SCALED64(c, 0),   SCALED64(c, 64),     SCALED64(c, 128),     SCALED64(c, 192)
+
+static const int32_t  YRtab[256] = { SCALED256(RED_Y) };
+static const int32_t  YGtab[256] = { SCALED256(GREEN_Y) };
+static const int32_t  YBtab[256] = { SCALED256(BLUE_Y) };
+static const int32_t CbRtab[256] = { SCALED256(RED_Cb) };
+static const int32_t CbGtab[256] = { SCALED256(GREEN_Cb) };
+static const int32_t CbBtab[256] = { SCALED256(BLUE_Cb) };
+static const int32_t CrRtab[256] = { SCALED256(RED_Cr) };
+static const int32_t CrGtab[256] = { SCALED256(GREEN_Cr) };
+static const int32_t CrBtab[256] = { SCALED256(BLUE_Cr) };
+
+// The codes for the standard Huffman tables are the same for every image,
+// so are only worked out once
+static bitstring  std_YDC_HT[12];
+static bitstring std_CbDC_HT[12];
+static bitstring  std_YAC_HT[256];
+static bitstring std_CbAC_HT[256];
+static pthread_once_t shared_tables = PTHREAD_ONCE_INIT;
+
+// Everything else belongs to the image being encoded
+typedef struct
 {
-	1.0, 1.387039845, 1.306562965, 1.175875602,
-	1.0, 0.785694958, 0.541196100, 0.275899379
-};
+	jpeg_message_t *message;
+	FILE *stream;
+
+	uint64_t bitbuf;            // Bits waiting to be written, from the bottom up
+	int freebits;               // and how much room is left for more
+
+	uint8_t *out;               // Everything is written here first and then
+	size_t outpos;              // written out in large blocks
+
+	uint64_t offset;            // How much of the message has been hidden
+	uint8_t bit;
+
+	SOF0infotype SOF0info;
+	DQTinfotype DQTinfo;
+
+	// The Huffman tables we'll use: the standard ones, or those built
+	// for this image; written as YDC, YAC, CbDC, CbAC
+	const uint8_t *HT_bits[4];
+	const uint8_t *HT_values[4];
+	const bitstring  *YDC_HT;
+	const bitstring *CbDC_HT;
+	const bitstring  *YAC_HT;
+	const bitstring *CbAC_HT;
+
+	divisors  fdtbl_Y;
+	divisors fdtbl_Cb;          // the same with the fdtbl_Cr
+
+	const colorRGB *RGB_buffer; // image to be encoded
+	uint32_t width;
+	uint32_t height;
+	uint32_t Ximage;
+	uint32_t Yimage;            // image dimensions divisible by the MCU size
+
+	uint8_t h_factor;           // luminance sampling factors; chroma is
+	uint8_t v_factor;           // always 1x1, so subsampled by these
+	uint8_t units;              // luminance DUs per MCU
+
+	int8_t     YDU[4][64];      // This is the Data Unit of Y after YCbCr->RGB transformation
+	int8_t    CbDU[64];
+	int8_t    CrDU[64];
+	int16_t DU_DCT[64];         // Current DU (after DCT and quantization) which we'll zigzag
+	int16_t    MCU[6][64];      // zigzag reordered DUs which will be Huffman coded
+
+	// When optimising the Huffman tables every DU is kept from the
+	// first pass, with how often each symbol was used, for the second
+	int16_t *blocks;
+	uint64_t max_memory;        // beyond which they're kept in a scratch file
+	uint32_t dc_freq[2][257];
+	uint32_t ac_freq[2][257];
+	uint8_t dc_bits[2][17];
+	uint8_t dc_values[2][256];
+	uint8_t ac_bits[2][17];
+	uint8_t ac_values[2][256];
+	bitstring optimal_DC_HT[2][12];
+	bitstring optimal_AC_HT[2][256];
+}
+encoder_t;
 
 /**********************************************************************/
 
-static uint8_t bytenew = 0;     // The byte that will be written in the JPG file
-static int8_t bytepos = 7;      // bit position in the byte we write (bytenew)
-                                // should be<=7 and >=0
-static uint16_t mask[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768 };
-
-// The Huffman tables we'll use:
-static bitstring   YDC_HT[12]   = { { 0x00, 0x0000 } };
-static bitstring  CbDC_HT[12]   = { { 0x00, 0x0000 } };
-static bitstring  YAC_HT[256]   = { { 0x00, 0x0000 } };
-static bitstring CbAC_HT[256]   = { { 0x00, 0x0000 } };
-
-static uint8_t    category_alloc[65535] = { 0x0 };
-static uint8_t   *category      = NULL;     // Here we'll keep the category of the numbers in range: -32767..32767
-static bitstring  bitcode_alloc[65535]  = { { 0x00, 0x0000 } };
-static bitstring *bitcode       = NULL;     // their bitcoded representation
-
-// Precalculated tables for a faster YCbCr->RGB transformation
-// We use a int32_t table because we'll scale values by 2^16 and work with integers
-static int32_t  YRtab[256]      = { 0x0 };
-static int32_t  YGtab[256]      = { 0x0 };
-static int32_t  YBtab[256]      = { 0x0 };
-static int32_t CbRtab[256]      = { 0x0 };
-static int32_t CbGtab[256]      = { 0x0 };
-static int32_t CbBtab[256]      = { 0x0 };
-static int32_t CrRtab[256]      = { 0x0 };
-static int32_t CrGtab[256]      = { 0x0 };
-static int32_t CrBtab[256]      = { 0x0 };
-
-static double  fdtbl_Y[64]       = { 0x0 };
-static double fdtbl_Cb[64]       = { 0x0 };  // the same with the fdtbl_Cr[64]
-
-static colorRGB *RGB_buffer     = NULL;     // image to be encoded
-static uint32_t Ximage;
-static uint32_t Yimage;                     // image dimensions divisible by 8
-
-static int8_t     YDU[64]       = { 0x0 };  // This is the Data Unit of Y after YCbCr->RGB transformation
-static int8_t    CbDU[64]       = { 0x0 };
-static int8_t    CrDU[64]       = { 0x0 };
-static int16_t DU_DCT[64]       = { 0x0 };  // Current DU (after DCT and quantization) which we'll zigzag
-static int16_t     DU[64]       = { 0x0 };  // zigzag reordered DU which will be Huffman coded
-
-static FILE *fp_jpeg_stream     = NULL;
+#define OUTPUT_BUFFER_SIZE 0x40000
 
-/**********************************************************************/
+static void flush_output(encoder_t *e)
+{
+	fwrite(e->out, e->outpos, 1, e->stream);
+	e->outpos = 0;
+}
 
-static void write_APP0info(void)
+static inline void writebyte(encoder_t *e, uint8_t b)
+{
+	if (e->outpos == OUTPUT_BUFFER_SIZE)
+		flush_output(e);
+	e->out[e->outpos++] = b;
+}
+
+static void write_APP0info(encoder_t *e)
 // Nothing to overwrite for APP0info
 {
-	writeword(APP0info.marker);
-	writeword(APP0info.length);
-	writetext(APP0info.JFIFsignature);
-	writebyte(0); // extra nul necessary as JFIF should be \0 terminated
-	writebyte(APP0info.versionhi);
-	writebyte(APP0info.versionlo);
-	writebyte(APP0info.xyunits);
-	writeword(APP0info.xdensity);
-	writeword(APP0info.ydensity);
-	writebyte(APP0info.thumbnwidth);
-	writebyte(APP0info.thumbnheight);
+	writeword(e, APP0info.marker);
+	writeword(e, APP0info.length);
+	writetext(e, APP0info.JFIFsignature);
+	writebyte(e, 0); // extra nul necessary as JFIF should be \0 terminated
+	writebyte(e, APP0info.versionhi);
+	writebyte(e, APP0info.versionlo);
+	writebyte(e, APP0info.xyunits);
+	writeword(e, APP0info.xdensity);
+	writeword(e, APP0info.ydensity);
+	writebyte(e, APP0info.thumbnwidth);
+	writebyte(e, APP0info.thumbnheight);
 }
 
-static void write_SOF0info(void)
+static void write_SOF0info(encoder_t *e)
 // We should overwrite width and height
 {
-	writeword(SOF0info.marker);
-	writeword(SOF0info.length);
-	writebyte(SOF0info.precision);
-	writeword(SOF0info.height);
-	writeword(SOF0info.width);
-	writebyte(SOF0info.nrofcomponents);
-	writebyte(SOF0info.IdY);
-	writebyte(SOF0info.HVY);
-	writebyte(SOF0info.QTY);
-	writebyte(SOF0info.IdCb);
-	writebyte(SOF0info.HVCb);
-	writebyte(SOF0info.QTCb);
-	writebyte(SOF0info.IdCr);
-	writebyte(SOF0info.HVCr);
-	writebyte(SOF0info.QTCr);
-}
-
-static void write_DQTinfo(void)
-{
-	writeword(DQTinfo.marker);
-	writeword(DQTinfo.length);
-	writebyte(DQTinfo.QTYinfo);
+	writeword(e, e->SOF0info.marker);
+	writeword(e, e->SOF0info.length);
+	writebyte(e, e->SOF0info.precision);
+	writeword(e, e->SOF0info.height);
+	writeword(e, e->SOF0info.width);
+	writebyte(e, e->SOF0info.nrofcomponents);
+	writebyte(e, e->SOF0info.IdY);
+	writebyte(e, e->SOF0info.HVY);
+	writebyte(e, e->SOF0info.QTY);
+	writebyte(e, e->SOF0info.IdCb);
+	writebyte(e, e->SOF0info.HVCb);
+	writebyte(e, e->SOF0info.QTCb);
+	writebyte(e, e->SOF0info.IdCr);
+	writebyte(e, e->SOF0info.HVCr);
+	writebyte(e, e->SOF0info.QTCr);
+}
+
+static void write_DQTinfo(encoder_t *e)
+{
+	writeword(e, e->DQTinfo.marker);
+	writeword(e, e->DQTinfo.length);
+	writebyte(e, e->DQTinfo.QTYinfo);
 	for (int i = 0; i < 64; i++)
-		writebyte(DQTinfo.Ytable[i]);
-	writebyte(DQTinfo.QTCbinfo);
+		writebyte(e, e->DQTinfo.Ytable[i]);
+	writebyte(e, e->DQTinfo.QTCbinfo);
 	for (int i = 0; i < 64; i++)
-		writebyte(DQTinfo.Cbtable[i]);
+		writebyte(e, e->DQTinfo.Cbtable[i]);
 }
 
 // Set quantization table and zigzag reorder it
@@ -351,113 +399,115 @@ static void write_DQTinfo(void)
 	for (int i = 0; i < 64; i++)                                    \
 		newtable[zigzag[i]] = byte_limit((basic_table[i] * scale_factor + 50) / 100, 1)
 
-static void set_DQTinfo(void)
-{
-	// scalefactor controls the visual quality of the image
-	// the smaller is, the better image we'll get, and the smaller
-	// compression we'll achieve
-	uint8_t scalefactor = 1; /* this could be a parameter */
-	DQTinfo.marker = 0xFFDB;
-	DQTinfo.length = 132;
-	DQTinfo.QTYinfo = 0;
-	DQTinfo.QTCbinfo = 1;
-	set_quant_table(std_luminance_qt, scalefactor, DQTinfo.Ytable);
-	set_quant_table(std_chrominance_qt, scalefactor, DQTinfo.Cbtable);
-}
-
-static void write_DHTinfo(void)
-{
-	writeword(DHTinfo.marker);
-	writeword(DHTinfo.length);
-	writebyte(DHTinfo.HTYDCinfo);
-	for (int i = 0; i < 16; i++)
-		writebyte(DHTinfo.YDC_nrcodes[i]);
-	for (int i = 0; i <= 11; i++)
-		writebyte(DHTinfo.YDC_values[i]);
-	writebyte(DHTinfo.HTYACinfo);
-	for (int i = 0; i < 16; i++)
-		writebyte(DHTinfo.YAC_nrcodes[i]);
-	for (int i = 0; i <= 161; i++)
-		writebyte(DHTinfo.YAC_values[i]);
-	writebyte(DHTinfo.HTCbDCinfo);
-	for (int i = 0; i < 16; i++)
-		writebyte(DHTinfo.CbDC_nrcodes[i]);
-	for (int i = 0; i <= 11; i++)
-		writebyte(DHTinfo.CbDC_values[i]);
-	writebyte(DHTinfo.HTCbACinfo);
-	for (int i = 0; i < 16; i++)
-		writebyte(DHTinfo.CbAC_nrcodes[i]);
-	for (int i = 0; i <= 161; i++)
-		writebyte(DHTinfo.CbAC_values[i]);
-}
-
-static void set_DHTinfo(void)
-{
-	DHTinfo.marker = 0xFFC4;
-	DHTinfo.length = 0x01A2;
-	DHTinfo.HTYDCinfo = 0;
-	for (int i = 0; i < 16; i++)
-		DHTinfo.YDC_nrcodes[i] = std_dc_luminance_nrcodes[i + 1];
-	for (int i = 0; i <= 11; i++)
-		DHTinfo.YDC_values[i] = std_dc_luminance_values[i];
-	DHTinfo.HTYACinfo = 0x10;
-	for (int i = 0; i < 16; i++)
-		DHTinfo.YAC_nrcodes[i] = std_ac_luminance_nrcodes[i + 1];
-	for (int i = 0; i <= 161; i++)
-		DHTinfo.YAC_values[i] = std_ac_luminance_values[i];
-	DHTinfo.HTCbDCinfo = 1;
-	for (int i = 0; i < 16; i++)
-		DHTinfo.CbDC_nrcodes[i] = std_dc_chrominance_nrcodes[i + 1];
-	for (int i = 0; i <= 11; i++)
-		DHTinfo.CbDC_values[i] = std_dc_chrominance_values[i];
-	DHTinfo.HTCbACinfo = 0x11;
-	for (int i = 0; i < 16; i++)
-		DHTinfo.CbAC_nrcodes[i] = std_ac_chrominance_nrcodes[i + 1];
-	for (int i = 0; i <= 161; i++)
-		DHTinfo.CbAC_values[i] = std_ac_chrominance_values[i];
-}
-
-static void write_SOSinfo(void)
-// Nothing to overwrite for SOSinfo
+static void set_DQTinfo(encoder_t *e, const jpeg_image_t *info)
 {
-	writeword(SOSinfo.marker);
-	writeword(SOSinfo.length);
-	writebyte(SOSinfo.nrofcomponents);
-	writebyte(SOSinfo.IdY);
-	writebyte(SOSinfo.HTY);
-	writebyte(SOSinfo.IdCb);
-	writebyte(SOSinfo.HTCb);
-	writebyte(SOSinfo.IdCr);
-	writebyte(SOSinfo.HTCr);
-	writebyte(SOSinfo.Ss);
-	writebyte(SOSinfo.Se);
-	writebyte(SOSinfo.Bf);
-}
-
-static void writebits(bitstring bs)
-{
-	// bit position in the bitstring we read, should be<=15 and >=0
-	for (int posval = bs.length - 1; posval >= 0; )
-	{
-		if (bs.value & mask[posval])
-			bytenew |= mask[bytepos];
-		posval--;
-		bytepos--;
-		if (bytepos < 0)
+	e->DQTinfo.marker = 0xFFDB;
+	e->DQTinfo.length = 132;
+	e->DQTinfo.QTYinfo = 0;
+	e->DQTinfo.QTCbinfo = 1;
+	if (info->quality)
+	{
+		// scalefactor controls the visual quality of the image
+		// the smaller is, the better image we'll get, and the smaller
+		// compression we'll achieve; mapped from quality as by IJG
+		int scalefactor = info->quality < 50 ? 5000 / info->quality : 200 - info->quality * 2;
+		set_quant_table(std_luminance_qt, scalefactor, e->DQTinfo.Ytable);
+		set_quant_table(std_chrominance_qt, scalefactor, e->DQTinfo.Cbtable);
+	}
+	else
+		// Otherwise use the tables from the original (already in zigzag order)
+		for (int i = 0; i < 64; i++)
 		{
-			if (bytenew == 0xFF)
-			{
-				writebyte(0xFF);
-				writebyte(0);
-			}
-			else
-				writebyte(bytenew);
-			bytepos = 7;
-			bytenew = 0;
+			e->DQTinfo.Ytable[i] = info->quant[0][i] ? : 1;
+			e->DQTinfo.Cbtable[i] = info->quant[1][i] ? : 1;
 		}
+}
+
+static void write_DHTinfo(encoder_t *e)
+{
+	// Four tables, each with its class/number, counts, and values
+	uint16_t length = 2 + 4 * (1 + 16);
+	for (int t = 0; t < 4; t++)
+		for (int i = 1; i <= 16; i++)
+			length += e->HT_bits[t][i];
+	writeword(e, 0xFFC4);
+	writeword(e, length);
+	for (int t = 0; t < 4; t++)
+	{
+		int n = 0;
+		writebyte(e, ((t & 0x01) << 4) | (t >> 1));
+		for (int i = 1; i <= 16; n += e->HT_bits[t][i], i++)
+			writebyte(e, e->HT_bits[t][i]);
+		for (int i = 0; i < n; i++)
+			writebyte(e, e->HT_values[t][i]);
 	}
 }
 
+static void write_SOSinfo(encoder_t *e)
+// Nothing to overwrite for SOSinfo
+{
+	writeword(e, SOSinfo.marker);
+	writeword(e, SOSinfo.length);
+	writebyte(e, SOSinfo.nrofcomponents);
+	writebyte(e, SOSinfo.IdY);
+	writebyte(e, SOSinfo.HTY);
+	writebyte(e, SOSinfo.IdCb);
+	writebyte(e, SOSinfo.HTCb);
+	writebyte(e, SOSinfo.IdCr);
+	writebyte(e, SOSinfo.HTCr);
+	writebyte(e, SOSinfo.Ss);
+	writebyte(e, SOSinfo.Se);
+	writebyte(e, SOSinfo.Bf);
+}
+
+static void write_DRIinfo(encoder_t *e, uint16_t interval)
+{
+	writeword(e, 0xFFDD);
+	writeword(e, 4);
+	writeword(e, interval);
+}
+
+// Write whole bytes of entropy coded data from the top of v, stuffing a 0
+// after any 0xFF
+static inline void write_entropy_bytes(encoder_t *e, uint64_t v, int n)
+{
+	// Quickest when there's room for them all and no 0xFF among them
+	if (n == 8 && e->outpos + 8 <= OUTPUT_BUFFER_SIZE && !(((~v - 0x0101010101010101ULL) & v) & 0x8080808080808080ULL))
+	{
+		for (int i = 0; i < 8; i++)
+			e->out[e->outpos + i] = (uint8_t)(v >> (56 - 8 * i));
+		e->outpos += 8;
+		return;
+	}
+	for (int i = 0; i < n; i++)
+	{
+		uint8_t b = (uint8_t)(v >> (56 - 8 * i));
+		writebyte(e, b);
+		if (b == 0xFF)
+			writebyte(e, 0);
+	}
+}
+
+// Codes are appended to a 64-bit accumulator which is only written out
+// once it's full, 8 bytes at a time
+static inline void writebits(encoder_t *e, bitstring bs)
+{
+	int n = bs.length;
+	uint64_t v = bs.value & ((1U << n) - 1);
+	if (n < e->freebits)
+	{
+		e->bitbuf = (e->bitbuf << n) | v;
+		e->freebits -= n;
+		return;
+	}
+	int rest = n - e->freebits;
+	write_entropy_bytes(e, (e->bitbuf << e->freebits) | (v >> rest), 8);
+	// Anything above the bits still to be written will be shifted out
+	// before they are
+	e->bitbuf = v;
+	e->freebits = 64 - rest;
+}
+
 #define compute_Huffman_table(nrcodes, std_table, HT)                   \
 	do                                                              \
 		for (int i = 1, c = 0, p = 0; i <= 16; i++, c *= 2)     \
@@ -468,167 +518,147 @@ static void writebits(bitstring bs)
 			}                                               \
 	while (0)
 
-static void init_Huffman_tables(void)
+// The category of a value is how many bits its magnitude needs, and its
+// bitcode is those low bits of it (less one, if it's negative)
+static inline uint8_t category(int16_t v)
 {
-	compute_Huffman_table(std_dc_luminance_nrcodes,   std_dc_luminance_values,   YDC_HT);
-	compute_Huffman_table(std_dc_chrominance_nrcodes, std_dc_chrominance_values, CbDC_HT);
-	compute_Huffman_table(std_ac_luminance_nrcodes,   std_ac_luminance_values,   YAC_HT);
-	compute_Huffman_table(std_ac_chrominance_nrcodes, std_ac_chrominance_values, CbAC_HT);
+	return v ? 32 - __builtin_clz(v < 0 ? -v : v) : 0;
 }
 
-static void set_numbers_category_and_bitcode(void)
+static inline bitstring bitcode(int16_t v, uint8_t cat)
 {
-	int32_t nrlower = 1;
-	int32_t nrupper = 2;
+	bitstring bs = { cat, (uint16_t)((v < 0 ? v - 1 : v) & ((1U << cat) - 1)) };
+	return bs;
+}
 
-	category = category_alloc + 32767; // allow negative subscripts
-	bitcode = bitcode_alloc + 32767;
+// Using the accurate integer FDCT routine from IJG's C source (jfdctint.c):
+// a scaled version of the Loeffler, Ligtenberg and Moschytz algorithm,
+// in fixed point, with 12 multiplies and 32 adds for each 1-D DCT
+#define CONST_BITS 13
+#define PASS1_BITS 2
+
+#define FIX_0_298631336 ((int32_t)  2446)
+#define FIX_0_390180644 ((int32_t)  3196)
+#define FIX_0_541196100 ((int32_t)  4433)
+#define FIX_0_765366865 ((int32_t)  6270)
+#define FIX_0_899976223 ((int32_t)  7373)
+#define FIX_1_175875602 ((int32_t)  9633)
+#define FIX_1_501321110 ((int32_t) 12299)
+#define FIX_1_847759065 ((int32_t) 15137)
+#define FIX_1_961570560 ((int32_t) 16069)
+#define FIX_2_053119869 ((int32_t) 16819)
+#define FIX_2_562915447 ((int32_t) 20995)
+#define FIX_3_072711026 ((int32_t) 25172)
+
+#define DESCALE(x, n) (((x) + ((int32_t)1 << ((n) - 1))) >> (n))
+
+// The output of the FDCT is scaled up by 8, so that is folded into each
+// divisor; then, as with libjpeg-turbo, the reciprocal (and a rounding
+// correction) is found so that x / divisor, rounded to the nearest, is
+// ((|x| + corr) * recip) >> shift for every coefficient the FDCT can give
+static void compute_reciprocal(uint16_t divisor, divisors *div, int i)
+{
+	int r = 16 + 31 - __builtin_clz(divisor);
+	uint32_t fq = (1U << r) / divisor;
+	uint32_t fr = (1U << r) % divisor;
+	uint32_t c = divisor / 2;
 
-	for (int cat = 1; cat <= 15; cat++)
+	if (fr == 0)
 	{
-		// Positive numbers
-		for (int nr = nrlower; nr < nrupper; nr++)
-		{
-			category[nr] = cat;
-			bitcode[nr].length = cat;
-			bitcode[nr].value = (uint16_t)nr;
-		}
-		// Negative numbers
-		for (int nr = -(nrupper - 1); nr <= -nrlower; nr++)
-		{
-			category[nr] = cat;
-			bitcode[nr].length = cat;
-			bitcode[nr].value = (uint16_t)(nrupper - 1 + nr);
-		}
-		nrlower <<= 1;
-		nrupper <<= 1;
+		// divisor is a power of two
+		fq >>= 1;
+		r--;
 	}
-}
-
-#define RED_Y     19595.76400
-#define RED_Cb   -11058.04464
-#define RED_Cr    32768.00000
-
-#define GREEN_Y   38470.13200
-#define GREEN_Cb -21708.95536
-#define GREEN_Cr -27438.76784
+	else if (fr <= divisor / 2U)
+		c++;
+	else
+		fq++;
 
-#define BLUE_Y     7471.60400
-#define BLUE_Cb   32768.00000
-#define BLUE_Cr   -5328.23216
+	div->recip[i] = fq;
+	div->corr[i] = c;
+	div->shift[i] = r;
+}
 
-static void precalculate_YCbCr_tables(void)
+static void prepare_quant_tables(encoder_t *e)
 {
-	for (int i = 0; i <= 255; i++)
+	for (int i = 0; i < 64; i++)
 	{
-		// red values
-		YRtab[i]  = (int32_t)(RED_Y    * i); // 65536 *  0.29900 + 0.5
-		CbRtab[i] = (int32_t)(RED_Cb   * i); // 65536 * -0.16874 + 0.5
-		CrRtab[i] = (int32_t)(RED_Cr   * i); // 32768
-		// green values
-		YGtab[i]  = (int32_t)(GREEN_Y  * i); // 65536 *  0.58700 + 0.5
-		CbGtab[i] = (int32_t)(GREEN_Cb * i); // 65536 * -0.33126 + 0.5
-		CrGtab[i] = (int32_t)(GREEN_Cr * i); // 65536 * -0.41869 + 0.5
-		// blue values
-		YBtab[i]  = (int32_t)(BLUE_Y   * i); // 65536 *  0.11400 + 0.5
-		CbBtab[i] = (int32_t)(BLUE_Cb  * i); // 32768
-		CrBtab[i] = (int32_t)(BLUE_Cr  * i); // 65536 * -0.08131 + 0.5
+		compute_reciprocal(e->DQTinfo.Ytable[zigzag[i]] * 8, &e->fdtbl_Y, i);
+		compute_reciprocal(e->DQTinfo.Cbtable[zigzag[i]] * 8, &e->fdtbl_Cb, i);
 	}
 }
 
-// Using a bit modified form of the FDCT routine from IJG's C source:
-// Forward DCT routine idea taken from Independent JPEG Group's C source for
-// JPEG encoders/decoders
-
-// For double AA&N IDCT method, divisors are equal to quantization
-// coefficients scaled by scalefactor[row]*scalefactor[col], where
-// scalefactor[0] = 1
-// scalefactor[k] = cos(k*M_PI/16) * sqrt(2)    for k=1..7
-// We apply a further scale factor of 8.
-// What's actually stored is 1/divisor so that the inner loop can
-// use a multiplication rather than a division.
-static void prepare_quant_tables(void)
+static void fdct_and_quantization(int8_t *data, divisors *fdtbl, int16_t *outdata)
 {
-	for (int i = 0, row = 0; row < 8; row++)
-		for (int col = 0; col < 8; col++, i++)
-		{
-			fdtbl_Y[i] = 1.0 /                   \
-				((DQTinfo.Ytable[zigzag[i]]  \
-				* AAN_SCALE_FACTOR[row]      \
-				* AAN_SCALE_FACTOR[col])     \
-				* 8);
-			fdtbl_Cb[i] = 1.0 /                  \
-				((DQTinfo.Cbtable[zigzag[i]] \
-				* AAN_SCALE_FACTOR[row]      \
-				* AAN_SCALE_FACTOR[col])     \
-				* 8);
-		}
-}
-
-static void fdct_and_quantization(int8_t *data, double *fdtbl, int16_t *outdata)
-{
-	double tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
-	double tmp10, tmp11, tmp12, tmp13;
-	double z1, z2, z3, z4, z5, z11, z13;
-	double *dataptr;
-	double datafloat[64];
-
-	for (int i = 0; i < 64; i++)
-		datafloat[i] = data[i];
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int32_t tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+	int32_t *dataptr;
+	int32_t workspace[64];
 
 	// Pass 1: process rows.
-	dataptr = datafloat;
+	// Results are scaled up by sqrt(8) compared to a true DCT;
+	// furthermore, we scale the results by 2**PASS1_BITS.
+	int8_t *inptr = data;
+	dataptr = workspace;
 	for (int i = 7; i >= 0; i--)
 	{
-		tmp0 = dataptr[0] + dataptr[7];
-		tmp7 = dataptr[0] - dataptr[7];
-		tmp1 = dataptr[1] + dataptr[6];
-		tmp6 = dataptr[1] - dataptr[6];
-		tmp2 = dataptr[2] + dataptr[5];
-		tmp5 = dataptr[2] - dataptr[5];
-		tmp3 = dataptr[3] + dataptr[4];
-		tmp4 = dataptr[3] - dataptr[4];
+		tmp0 = inptr[0] + inptr[7];
+		tmp7 = inptr[0] - inptr[7];
+		tmp1 = inptr[1] + inptr[6];
+		tmp6 = inptr[1] - inptr[6];
+		tmp2 = inptr[2] + inptr[5];
+		tmp5 = inptr[2] - inptr[5];
+		tmp3 = inptr[3] + inptr[4];
+		tmp4 = inptr[3] - inptr[4];
 
 		// Even part
 
-		tmp10 = tmp0 + tmp3;                // phase 2
+		tmp10 = tmp0 + tmp3;
 		tmp13 = tmp0 - tmp3;
 		tmp11 = tmp1 + tmp2;
 		tmp12 = tmp1 - tmp2;
 
-		dataptr[0] = tmp10 + tmp11;         // phase 3
-		dataptr[4] = tmp10 - tmp11;
+		dataptr[0] = (tmp10 + tmp11) * (1 << PASS1_BITS);
+		dataptr[4] = (tmp10 - tmp11) * (1 << PASS1_BITS);
 
-		z1 = 0.707106781 * (tmp12 + tmp13); // c4
-		dataptr[2] = tmp13 + z1;            // phase 5
-		dataptr[6] = tmp13 - z1;
+		z1 = (tmp12 + tmp13) * FIX_0_541196100;
+		dataptr[2] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS - PASS1_BITS);
+		dataptr[6] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS - PASS1_BITS);
 
 		// Odd part
 
-		tmp10 = tmp4 + tmp5;                // phase 2
-		tmp11 = tmp5 + tmp6;
-		tmp12 = tmp6 + tmp7;
-
-		// The rotator is modified from fig 4-8 to avoid extra negations
-		z5 = 0.382683433 * (tmp10 - tmp12); // c6
-		z2 = 0.541196100 * tmp10 + z5;      // c2-c6
-		z4 = 1.306562965 * tmp12 + z5;      // c2+c6
-		z3 = 0.707106781 * tmp11;           // c4
-
-		z11 = tmp7 + z3;                    // phase 5
-		z13 = tmp7 - z3;
-
-		dataptr[5] = z13 + z2;              // phase 6
-		dataptr[3] = z13 - z2;
-		dataptr[1] = z11 + z4;
-		dataptr[7] = z11 - z4;
-
-		dataptr += 8;                       // advance pointer to next row
+		z1 = tmp4 + tmp7;
+		z2 = tmp5 + tmp6;
+		z3 = tmp4 + tmp6;
+		z4 = tmp5 + tmp7;
+		z5 = (z3 + z4) * FIX_1_175875602;   // sqrt(2) * c3
+
+		tmp4 *= FIX_0_298631336;            // sqrt(2) * (-c1+c3+c5-c7)
+		tmp5 *= FIX_2_053119869;            // sqrt(2) * ( c1+c3-c5+c7)
+		tmp6 *= FIX_3_072711026;            // sqrt(2) * ( c1+c3+c5-c7)
+		tmp7 *= FIX_1_501321110;            // sqrt(2) * ( c1+c3-c5-c7)
+		z1 *= -FIX_0_899976223;             // sqrt(2) * ( c7-c3)
+		z2 *= -FIX_2_562915447;             // sqrt(2) * (-c1-c3)
+		z3 *= -FIX_1_961570560;             // sqrt(2) * (-c3-c5)
+		z4 *= -FIX_0_390180644;             // sqrt(2) * ( c5-c3)
+
+		z3 += z5;
+		z4 += z5;
+
+		dataptr[7] = DESCALE(tmp4 + z1 + z3, CONST_BITS - PASS1_BITS);
+		dataptr[5] = DESCALE(tmp5 + z2 + z4, CONST_BITS - PASS1_BITS);
+		dataptr[3] = DESCALE(tmp6 + z2 + z3, CONST_BITS - PASS1_BITS);
+		dataptr[1] = DESCALE(tmp7 + z1 + z4, CONST_BITS - PASS1_BITS);
+
+		inptr += 8;                         // advance pointers to next row
+		dataptr += 8;
 	}
 
-	// Pass 2: process columns
-
-	dataptr = datafloat;
+	// Pass 2: process columns.
+	// We remove the PASS1_BITS scaling, but leave the results scaled up
+	// by an overall factor of 8.
+	dataptr = workspace;
 	for (int i = 7; i >= 0; i--)
 	{
 		tmp0 = dataptr[0] + dataptr[56];
@@ -642,99 +672,100 @@ static void fdct_and_quantization(int8_t *data, double *fdtbl, int16_t *outdata)
 
 		// Even part
 
-		tmp10 = tmp0 + tmp3;                // phase 2
+		tmp10 = tmp0 + tmp3;
 		tmp13 = tmp0 - tmp3;
 		tmp11 = tmp1 + tmp2;
 		tmp12 = tmp1 - tmp2;
 
-		dataptr[0] = tmp10 + tmp11;         // phase 3
-		dataptr[32] = tmp10 - tmp11;
+		dataptr[0] = DESCALE(tmp10 + tmp11, PASS1_BITS);
+		dataptr[32] = DESCALE(tmp10 - tmp11, PASS1_BITS);
 
-		z1 = 0.707106781 * (tmp12 + tmp13); // c4
-		dataptr[16] = tmp13 + z1;           // phase 5
-		dataptr[48] = tmp13 - z1;
+		z1 = (tmp12 + tmp13) * FIX_0_541196100;
+		dataptr[16] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS + PASS1_BITS);
+		dataptr[48] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS + PASS1_BITS);
 
 		// Odd part
 
-		tmp10 = tmp4 + tmp5;                // phase 2
-		tmp11 = tmp5 + tmp6;
-		tmp12 = tmp6 + tmp7;
-
-		// The rotator is modified from fig 4-8 to avoid extra negations.
-		z5 = 0.382683433 * (tmp10 - tmp12); // c6
-		z2 = 0.541196100 * tmp10 + z5;      // c2-c6
-		z4 = 1.306562965 * tmp12 + z5;      // c2+c6
-		z3 = 0.707106781 * tmp11;           // c4
-
-		z11 = tmp7 + z3;                    // phase 5
-		z13 = tmp7 - z3;
-		dataptr[40] = z13 + z2;             // phase 6
-		dataptr[24] = z13 - z2;
-		dataptr[8] = z11 + z4;
-		dataptr[56] = z11 - z4;
+		z1 = tmp4 + tmp7;
+		z2 = tmp5 + tmp6;
+		z3 = tmp4 + tmp6;
+		z4 = tmp5 + tmp7;
+		z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp4 *= FIX_0_298631336;
+		tmp5 *= FIX_2_053119869;
+		tmp6 *= FIX_3_072711026;
+		tmp7 *= FIX_1_501321110;
+		z1 *= -FIX_0_899976223;
+		z2 *= -FIX_2_562915447;
+		z3 *= -FIX_1_961570560;
+		z4 *= -FIX_0_390180644;
+
+		z3 += z5;
+		z4 += z5;
+
+		dataptr[56] = DESCALE(tmp4 + z1 + z3, CONST_BITS + PASS1_BITS);
+		dataptr[40] = DESCALE(tmp5 + z2 + z4, CONST_BITS + PASS1_BITS);
+		dataptr[24] = DESCALE(tmp6 + z2 + z3, CONST_BITS + PASS1_BITS);
+		dataptr[8] = DESCALE(tmp7 + z1 + z4, CONST_BITS + PASS1_BITS);
 
 		dataptr++;                          // advance pointer to next column
 	}
 
-	// Quantize/descale the coefficients, and store into output array
-	// Apply the quantization and scaling factor
-	// Round to nearest integer.
-	// Since C does not specify the direction of rounding for negative
-	// quotients, we have to force the dividend positive for portability.
-	// The maximum coefficient size is +-16K (for 12-bit data), so this
-	// code should work for either 16-bit or 32-bit ints.
+	// Quantize/descale the coefficients, and store into output array;
+	// no division, and no branches, so the compiler is free to vectorise
 	for (int i = 0; i < 64; i++)
-		outdata[i] = (int16_t)((int16_t)(datafloat[i] * fdtbl[i] + 16384.5) - 16384);
+	{
+		int32_t x = workspace[i];
+		int32_t sign = x >> 31;
+		uint32_t t = (x ^ sign) - sign;
+		t = ((t + fdtbl->corr[i]) * fdtbl->recip[i]) >> fdtbl->shift[i];
+		outdata[i] = (int16_t)(((int32_t)t ^ sign) - sign);
+	}
 }
 
-static void process_DU(int8_t *ComponentDU, double *fdtbl, int16_t *DC, bitstring *HTDC, bitstring *HTAC)
+static void hide_message_bits(jpeg_message_t *message, int16_t *DU, uint64_t *offset, uint8_t *bit)
 {
-	bitstring EOB = HTAC[0x00];
-	bitstring M16zeroes = HTAC[0xF0];
-	uint8_t end0pos;
-
-	fdct_and_quantization(ComponentDU, fdtbl, DU_DCT);
-	// zigzag reorder
-	for (int i = 0; i <= 63; i++)
-		DU[zigzag[i]] = DU_DCT[i];
-
-
-	static uint64_t offset = 0;
-	static uint8_t bit = 1;
-
-	for (uint64_t i = 0; i < 64 && offset < message->size + sizeof message->size; i++)
+	for (uint64_t i = 0; i < 64 && *offset < message->size + sizeof message->size; i++)
 		if (DU[i] > 1)
 		{
-			uint8_t v = (*(message->data + offset) & bit);
+			uint8_t v = (*(message->data + *offset) & *bit);
 			if (v)
 				DU[i] |= 0x0001;
 			else
 				DU[i] &= 0xFFFE;
-			bit <<= 1;
-			if (!bit)
+			*bit <<= 1;
+			if (!*bit)
 			{
-				bit = 1;
-				offset++;
+				*bit = 1;
+				(*offset)++;
 			}
 		}
+}
 
+static void encode_DU(encoder_t *e, int16_t *DU, int16_t *DC, const bitstring *HTDC, const bitstring *HTAC)
+{
+	bitstring EOB = HTAC[0x00];
+	bitstring M16zeroes = HTAC[0xF0];
+	uint8_t end0pos;
 
 	int16_t diff = DU[0] - *DC;
 	*DC = DU[0];
 	// Encode DC
 	if (diff == 0)
-		writebits(HTDC[0]); // diff might be 0
+		writebits(e, HTDC[0]); // diff might be 0
 	else
 	{
-		writebits(HTDC[category[diff]]);
-		writebits(bitcode[diff]);
+		uint8_t cat = category(diff);
+		writebits(e, HTDC[cat]);
+		writebits(e, bitcode(diff, cat));
 	}
 	// Encode ACs
 	for (end0pos = 63; (end0pos > 0) && (DU[end0pos] == 0); end0pos--);
 	// end0pos = first element in reverse order !=0
 	if (end0pos == 0)
 	{
-		writebits(EOB);
+		writebits(e, EOB);
 		return;
 	}
 
@@ -746,107 +777,722 @@ static void process_DU(int8_t *ComponentDU, double *fdtbl, int16_t *DC, bitstrin
 		if (nrzeroes >= 16)
 		{
 			for (int nrmarker = 1; nrmarker <= (nrzeroes >> 4); nrmarker++)
-				writebits(M16zeroes);
+				writebits(e, M16zeroes);
+			nrzeroes %= 16;
+		}
+		uint8_t cat = category(DU[i]);
+		writebits(e, HTAC[(nrzeroes << 4) + cat]);
+		writebits(e, bitcode(DU[i], cat));
+	}
+	if (end0pos != 63)
+		writebits(e, EOB);
+}
+
+// The same walk through the DU as encode_DU, but only counting how often
+// each symbol would be written
+static void count_DU(int16_t *DU, int16_t *DC, uint32_t *dc_freq, uint32_t *ac_freq)
+{
+	uint8_t end0pos;
+
+	int16_t diff = DU[0] - *DC;
+	*DC = DU[0];
+	dc_freq[category(diff)]++;
+
+	for (end0pos = 63; (end0pos > 0) && (DU[end0pos] == 0); end0pos--);
+	if (end0pos == 0)
+	{
+		ac_freq[0x00]++;
+		return;
+	}
+
+	for (int i = 1; i <= end0pos; i++)
+	{
+		int startpos = i;
+		for (; (DU[i] == 0) && (i <= end0pos); i++);
+		int nrzeroes = i - startpos;
+		if (nrzeroes >= 16)
+		{
+			ac_freq[0xF0] += nrzeroes >> 4;
 			nrzeroes %= 16;
 		}
-		writebits(HTAC[(nrzeroes << 4) + category[DU[i]]]);
-		writebits(bitcode[DU[i]]);
+		ac_freq[(nrzeroes << 4) + category(DU[i])]++;
 	}
 	if (end0pos != 63)
-		writebits(EOB);
+		ac_freq[0x00]++;
+}
+
+// Generate the optimal Huffman code for the given symbol frequencies,
+// limited to 16 bits, as in section K.2 of the JPEG spec (and IJG's
+// jpeg_gen_optimal_table)
+#define MAX_CLEN 32
+
+static void generate_optimal_table(uint32_t *freq, uint8_t *bits, uint8_t *values)
+{
+	uint8_t bits_tmp[MAX_CLEN + 1] = { 0x0 };
+	int codesize[257] = { 0x0 };
+	int others[257];
+	for (int i = 0; i < 257; i++)
+		others[i] = -1;
+
+	// Reserve one code point so that no real code is all 1s
+	freq[256] = 1;
+
+	for (;;)
+	{
+		// Find the two least frequent symbols (favouring the larger
+		// symbol value on a tie, so the reserved one is the longest)
+		int c1 = -1;
+		int c2 = -1;
+		for (int i = 0; i <= 256; i++)
+			if (freq[i] && (c1 < 0 || freq[i] <= freq[c1]))
+				c1 = i;
+		for (int i = 0; i <= 256; i++)
+			if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2]))
+				c2 = i;
+		if (c2 < 0)
+			break;
+
+		// Merge the two, and add one bit to the code of everything in them
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		codesize[c1]++;
+		while (others[c1] >= 0)
+		{
+			c1 = others[c1];
+			codesize[c1]++;
+		}
+		others[c1] = c2;
+		codesize[c2]++;
+		while (others[c2] >= 0)
+		{
+			c2 = others[c2];
+			codesize[c2]++;
+		}
+	}
+
+	for (int i = 0; i <= 256; i++)
+		if (codesize[i])
+			bits_tmp[codesize[i]]++;
+
+	// Codes can be at most 16 bits; move any longer ones up the tree,
+	// taking a prefix from the nearest shorter code to make room
+	int i = MAX_CLEN;
+	for (; i > 16; i--)
+		while (bits_tmp[i] > 0)
+		{
+			int j = i - 2;
+			while (bits_tmp[j] == 0)
+				j--;
+			bits_tmp[i] -= 2;
+			bits_tmp[i - 1]++;
+			bits_tmp[j + 1] += 2;
+			bits_tmp[j]--;
+		}
+	// Lose the reserved code point, which is one of the longest
+	while (bits_tmp[i] == 0)
+		i--;
+	bits_tmp[i]--;
+
+	memcpy(bits, bits_tmp, 17);
+	for (int p = 0, l = 1; l <= MAX_CLEN; l++)
+		for (int j = 0; j < 256; j++)
+			if (codesize[j] == l)
+				values[p++] = j;
 }
 
-static void load_data_units_from_RGB_buffer(int xpos, int ypos)
+// Pad the last byte with 1s (only if it's been started) and write out
+// everything that's left
+static void flush_bits(encoder_t *e)
 {
-	uint8_t pos = 0;
-	uint32_t location = ypos * Ximage + xpos;
-	for (int y = 0; y < 8; y++)
+	int used = 64 - e->freebits;
+	if (used & 0x07)
 	{
-		for (int x = 0; x < 8; x++)
+		int pad = 8 - (used & 0x07);
+		e->bitbuf = (e->bitbuf << pad) | ((1U << pad) - 1);
+		used += pad;
+	}
+	if (used)
+		write_entropy_bytes(e, e->bitbuf << (64 - used), used / 8);
+	e->bitbuf = 0;
+	e->freebits = 64;
+}
+
+// Blocks which overhang the edge of the image repeat its last row and
+// column; chroma is the average of the pixels each sample covers
+static void load_data_units_from_RGB_buffer(encoder_t *e, uint32_t xpos, uint32_t ypos)
+{
+	int Cbsum[64] = { 0x0 };
+	int Crsum[64] = { 0x0 };
+	int hshift = e->h_factor - 1;
+	int vshift = e->v_factor - 1;
+
+	for (uint32_t y = 0; y < 8U * e->v_factor; y++)
+	{
+		uint32_t yy = ypos + y < e->height ? ypos + y : e->height - 1;
+		const colorRGB *row = e->RGB_buffer + yy * e->width;
+		for (uint32_t x = 0; x < 8U * e->h_factor; x++)
 		{
-			int R = RGB_buffer[location].R;
-			int G = RGB_buffer[location].G;
-			int B = RGB_buffer[location].B;
-			YDU[pos] = Y(R, G, B);
-			CbDU[pos] = Cb(R, G, B);
-			CrDU[pos] = Cr(R, G, B);
-			location++;
-			pos++;
+			const colorRGB *p = row + (xpos + x < e->width ? xpos + x : e->width - 1);
+			int R = p->R;
+			int G = p->G;
+			int B = p->B;
+			e->YDU[(y >> 3) * e->h_factor + (x >> 3)][((y & 7) << 3) + (x & 7)] = Y(R, G, B);
+			int c = ((y >> vshift) << 3) + (x >> hshift);
+			Cbsum[c] += (int8_t)Cb(R, G, B);
+			Crsum[c] += (int8_t)Cr(R, G, B);
 		}
-		location += Ximage - 8;
 	}
+
+	int shift = hshift + vshift;
+	for (int i = 0; i < 64; i++)
+	{
+		e->CbDU[i] = (Cbsum[i] + ((1 << shift) >> 1)) >> shift;
+		e->CrDU[i] = (Crsum[i] + ((1 << shift) >> 1)) >> shift;
+	}
+}
+
+// Transform and quantise every DU in the MCU at xpos, ypos into e->MCU:
+// the luminance DUs, then Cb, then Cr, each in zigzag order
+static void transform_MCU(encoder_t *e, uint32_t xpos, uint32_t ypos)
+{
+	load_data_units_from_RGB_buffer(e, xpos, ypos);
+	for (int b = 0; b < e->units + 2; b++)
+	{
+		if (b < e->units)
+			fdct_and_quantization(e->YDU[b], &e->fdtbl_Y, e->DU_DCT);
+		else
+			fdct_and_quantization(b == e->units ? e->CbDU : e->CrDU, &e->fdtbl_Cb, e->DU_DCT);
+		for (int i = 0; i <= 63; i++)
+			e->MCU[b][zigzag[i]] = e->DU_DCT[i];
+	}
+}
+
+static void main_encoder(encoder_t *e)
+{
+	int16_t DC[3] = { 0 }; // DC coefficients used for differential encoding
+	const bitstring *HTDC[3] = { e->YDC_HT, e->CbDC_HT, e->CbDC_HT };
+	const bitstring *HTAC[3] = { e->YAC_HT, e->CbAC_HT, e->CbAC_HT };
+
+	for (uint32_t ypos = 0; ypos < e->Yimage; ypos += 8 * e->v_factor)
+		for (uint32_t xpos = 0; xpos < e->Ximage; xpos += 8 * e->h_factor)
+		{
+			transform_MCU(e, xpos, ypos);
+			for (int b = 0; b < e->units + 2; b++)
+			{
+				int c = b < e->units ? 0 : b - e->units + 1;
+				hide_message_bits(e->message, e->MCU[b], &e->offset, &e->bit);
+				if (!e->blocks)
+					encode_DU(e, e->MCU[b], &DC[c], HTDC[c], HTAC[c]);
+				else
+				{
+					// Keep it to be written once the tables are known
+					count_DU(e->MCU[b], &DC[c], e->dc_freq[c ? 1 : 0], e->ac_freq[c ? 1 : 0]);
+					memcpy(e->blocks, e->MCU[b], sizeof e->MCU[b]);
+					e->blocks += 64;
+				}
+			}
+		}
+}
+
+// Replace the standard tables with those best for the symbols counted
+static void replace_Huffman_tables(encoder_t *e)
+{
+	for (int t = 0; t < 2; t++)
+	{
+		generate_optimal_table(e->dc_freq[t], e->dc_bits[t], e->dc_values[t]);
+		generate_optimal_table(e->ac_freq[t], e->ac_bits[t], e->ac_values[t]);
+	}
+	memset(e->optimal_DC_HT, 0x00, sizeof e->optimal_DC_HT);
+	memset(e->optimal_AC_HT, 0x00, sizeof e->optimal_AC_HT);
+	for (int t = 0; t < 2; t++)
+	{
+		compute_Huffman_table(e->dc_bits[t], e->dc_values[t], e->optimal_DC_HT[t]);
+		compute_Huffman_table(e->ac_bits[t], e->ac_values[t], e->optimal_AC_HT[t]);
+		e->HT_bits[2 * t] = e->dc_bits[t];
+		e->HT_values[2 * t] = e->dc_values[t];
+		e->HT_bits[2 * t + 1] = e->ac_bits[t];
+		e->HT_values[2 * t + 1] = e->ac_values[t];
+	}
+	e->YDC_HT = e->optimal_DC_HT[0];
+	e->CbDC_HT = e->optimal_DC_HT[1];
+	e->YAC_HT = e->optimal_AC_HT[0];
+	e->CbAC_HT = e->optimal_AC_HT[1];
+}
+
+// First pass: transform, quantise, and hide everything, counting the
+// symbols used, then replace the standard tables with those best for
+// this image
+static void optimise_Huffman_tables(encoder_t *e)
+{
+	uint64_t mcus = (uint64_t)(e->Ximage / (8 * e->h_factor)) * (e->Yimage / (8 * e->v_factor));
+	int16_t *blocks = scratch_alloc(mcus * (e->units + 2) * 64 * sizeof (int16_t), e->max_memory);
+	e->blocks = blocks;
+	main_encoder(e);
+	e->blocks = blocks;
+	replace_Huffman_tables(e);
+}
+
+// Second pass: write out the DUs kept from the first
+static void encode_kept_blocks(encoder_t *e)
+{
+	int16_t DCY = 0, DCCb = 0, DCCr = 0;
+	int16_t *block = e->blocks;
+	uint64_t mcus = (uint64_t)(e->Ximage / (8 * e->h_factor)) * (e->Yimage / (8 * e->v_factor));
+	for (; mcus; mcus--)
+	{
+		for (int b = 0; b < e->units; b++, block += 64)
+			encode_DU(e, block, &DCY, e->YDC_HT, e->YAC_HT);
+		encode_DU(e, block, &DCCb, e->CbDC_HT, e->CbAC_HT);
+		encode_DU(e, block + 64, &DCCr, e->CbDC_HT, e->CbAC_HT);
+		block += 128;
+	}
+	scratch_free(e->blocks);
+	e->blocks = NULL;
+}
+
+// Larger images are encoded a stripe at a time on several threads; each
+// stripe is a whole number of MCU rows, ended by a restart marker, so it
+// has its own DC predictions and can be coded without the others
+typedef struct stripes_t
+{
+	encoder_t *e;
+	void (*task)(struct stripes_t *, int);
+	int16_t *blocks;            // Every DU, in the order they'll be written
+	uint64_t *bits;             // How many coefficients can carry the message in each stripe
+	uint64_t *offsets;          // and so where each one's part of the message begins
+	char **scan;                // Each stripe's entropy coded data
+	size_t *length;
+	uint32_t xmcus;
+	uint32_t ymcus;
+	uint32_t rows;              // MCU rows per stripe
+	uint32_t threads;
+	int stripes;
+	int next;                   // Next stripe for a worker to take
+	bool optimise;
+	bool failed;
+}
+stripes_t;
+
+// Decide how to divide the image; not worth it unless there are at least
+// two stripes and two threads to encode them
+static bool plan_stripes(encoder_t *e, uint32_t threads, stripes_t *work)
+{
+	memset(work, 0x00, sizeof (stripes_t));
+	work->e = e;
+	work->xmcus = e->Ximage / (8 * e->h_factor);
+	work->ymcus = e->Yimage / (8 * e->v_factor);
+	work->threads = threads ? : sysconf(_SC_NPROCESSORS_ONLN);
+	if (work->threads < 2 || work->ymcus < 2)
+		return false;
+
+	// A few stripes for each thread keeps them all busy to the end; the
+	// restart interval has to fit in 16 bits
+	work->rows = (work->ymcus + work->threads * 4 - 1) / (work->threads * 4);
+	if (work->rows * work->xmcus > 0xFFFF)
+		work->rows = 0xFFFF / work->xmcus;
+	work->stripes = (work->ymcus + work->rows - 1) / work->rows;
+	if (work->stripes < 2)
+		return false;
+	work->bits = calloc(work->stripes, sizeof (uint64_t));
+	return work->bits;
+}
+
+static int16_t *stripe_blocks(stripes_t *work, int i)
+{
+	return work->blocks + (uint64_t)i * work->rows * work->xmcus * (work->e->units + 2) * 64;
+}
+
+static uint64_t stripe_mcus(stripes_t *work, int i)
+{
+	uint32_t first = i * work->rows;
+	uint32_t last = first + work->rows < work->ymcus ? first + work->rows : work->ymcus;
+	return (uint64_t)(last - first) * work->xmcus;
+}
+
+// Transform and quantise the stripe, counting the coefficients which can
+// carry the message, and keeping the DUs if there's somewhere to keep them
+static void transform_stripe(stripes_t *work, int i)
+{
+	encoder_t e = *work->e;
+	int16_t *block = work->blocks ? stripe_blocks(work, i) : NULL;
+	uint64_t bits = 0;
+
+	uint32_t last = (i + 1) * work->rows < work->ymcus ? (i + 1) * work->rows : work->ymcus;
+	for (uint32_t y = i * work->rows; y < last; y++)
+		for (uint32_t x = 0; x < work->xmcus; x++)
+		{
+			transform_MCU(&e, x * 8 * e.h_factor, y * 8 * e.v_factor);
+			for (int b = 0; b < e.units + 2; b++)
+			{
+				for (int j = 0; j < 64; j++)
+					if (e.MCU[b][j] > 1)
+						bits++;
+				if (block)
+				{
+					memcpy(block, e.MCU[b], sizeof e.MCU[b]);
+					block += 64;
+				}
+			}
+		}
+	work->bits[i] = bits;
+}
+
+// Hide the stripe's part of the message and count the symbols it will
+// use, for optimised Huffman tables
+static void hide_stripe(stripes_t *work, int i)
+{
+	encoder_t *e = work->e;
+	uint32_t dc_freq[2][257] = { { 0x0 } };
+	uint32_t ac_freq[2][257] = { { 0x0 } };
+	int16_t DC[3] = { 0 };
+	uint64_t offset = work->offsets[i] >> 3;
+	uint8_t bit = 1 << (work->offsets[i] & 0x07);
+
+	int16_t *block = stripe_blocks(work, i);
+	for (uint64_t n = stripe_mcus(work, i); n; n--)
+		for (int b = 0; b < e->units + 2; b++, block += 64)
+		{
+			int t = b < e->units ? 0 : 1;
+			hide_message_bits(e->message, block, &offset, &bit);
+			count_DU(block, &DC[t ? b - e->units + 1 : 0], dc_freq[t], ac_freq[t]);
+		}
+
+	for (int t = 0; t < 2; t++)
+		for (int j = 0; j < 257; j++)
+		{
+			if (dc_freq[t][j])
+				__sync_fetch_and_add(&e->dc_freq[t][j], dc_freq[t][j]);
+			if (ac_freq[t][j])
+				__sync_fetch_and_add(&e->ac_freq[t][j], ac_freq[t][j]);
+		}
 }
 
-static void main_encoder(void)
+// Hide the stripe's part of the message (unless that's been done already)
+// and code it into memory, ending with a restart marker unless it's last
+static void encode_stripe(stripes_t *work, int i)
 {
-	int16_t DCY = 0, DCCb = 0, DCCr = 0; // DC coefficients used for differential encoding
-	for (uint32_t ypos = 0; ypos < Yimage; ypos += 8)
-		for (uint32_t xpos = 0; xpos < Ximage; xpos += 8)
+	encoder_t e = *work->e;
+	e.stream = open_memstream(&work->scan[i], &work->length[i]);
+	e.out = malloc(OUTPUT_BUFFER_SIZE);
+	if (!e.stream || !e.out)
+	{
+		work->failed = true;
+		if (e.stream)
+			fclose(e.stream);
+		free(e.out);
+		return;
+	}
+	e.outpos = 0;
+	e.bitbuf = 0;
+	e.freebits = 64;
+	e.offset = work->offsets[i] >> 3;
+	e.bit = 1 << (work->offsets[i] & 0x07);
+
+	int16_t DC[3] = { 0 };
+	const bitstring *HTDC[3] = { e.YDC_HT, e.CbDC_HT, e.CbDC_HT };
+	const bitstring *HTAC[3] = { e.YAC_HT, e.CbAC_HT, e.CbAC_HT };
+
+	int16_t *block = stripe_blocks(work, i);
+	for (uint64_t n = stripe_mcus(work, i); n; n--)
+		for (int b = 0; b < e.units + 2; b++, block += 64)
 		{
-			load_data_units_from_RGB_buffer(xpos, ypos);
-			process_DU(YDU, fdtbl_Y, &DCY, YDC_HT, YAC_HT);
-			process_DU(CbDU, fdtbl_Cb, &DCCb, CbDC_HT, CbAC_HT);
-			process_DU(CrDU, fdtbl_Cb, &DCCr, CbDC_HT, CbAC_HT);
+			int c = b < e.units ? 0 : b - e.units + 1;
+			if (!work->optimise)
+				hide_message_bits(e.message, block, &e.offset, &e.bit);
+			encode_DU(&e, block, &DC[c], HTDC[c], HTAC[c]);
 		}
+
+	flush_bits(&e);
+	if (i < work->stripes - 1)
+	{
+		writebyte(&e, 0xFF);
+		writebyte(&e, 0xD0 + (i & 0x07)); // RSTn
+	}
+	flush_output(&e);
+	if (fclose(e.stream))
+		work->failed = true;
+	free(e.out);
+}
+
+static void *stripe_worker(void *arg)
+{
+	stripes_t *work = arg;
+	for (int i; (i = __sync_fetch_and_add(&work->next, 1)) < work->stripes; )
+		work->task(work, i);
+	return NULL;
+}
+
+static void run_stripes(stripes_t *work, void (*task)(stripes_t *, int))
+{
+	work->task = task;
+	work->next = 0;
+
+	uint32_t threads = work->threads < (uint32_t)work->stripes ? work->threads : (uint32_t)work->stripes;
+	pthread_t *t = malloc(threads * sizeof (pthread_t));
+	uint32_t started = 0;
+	// This thread is one of the workers too
+	for (uint32_t i = 1; t && i < threads; i++)
+		if (!pthread_create(&t[started], NULL, stripe_worker, work))
+			started++;
+	stripe_worker(work);
+	for (uint32_t i = 0; i < started; i++)
+		pthread_join(t[i], NULL);
+	free(t);
+}
+
+static void free_stripes(stripes_t *work)
+{
+	if (work->scan)
+		for (int i = 0; i < work->stripes; i++)
+			free(work->scan[i]);
+	free(work->scan);
+	free(work->length);
+	free(work->offsets);
+	free(work->bits);
+	scratch_free(work->blocks);
+}
+
+// Somewhere to keep every DU and each stripe's coded data
+static bool alloc_stripes(stripes_t *work)
+{
+	uint64_t mcus = (uint64_t)work->xmcus * work->ymcus;
+	work->blocks = scratch_alloc(mcus * (work->e->units + 2) * 64 * sizeof (int16_t), work->e->max_memory);
+	work->offsets = calloc(work->stripes, sizeof (uint64_t));
+	work->scan = calloc(work->stripes, sizeof (char *));
+	work->length = calloc(work->stripes, sizeof (size_t));
+	if (work->blocks && work->offsets && work->scan && work->length)
+		return true;
+	free_stripes(work);
+	return false;
+}
+
+// Transform every stripe, then, knowing how much of the message each one
+// holds, hide and code them all independently; the message is hidden in
+// exactly the same coefficients as it would be serially
+static void encode_stripes(stripes_t *work)
+{
+	run_stripes(work, transform_stripe);
+	for (int i = 1; i < work->stripes; i++)
+		work->offsets[i] = work->offsets[i - 1] + work->bits[i - 1];
+
+	if (work->optimise)
+	{
+		run_stripes(work, hide_stripe);
+		replace_Huffman_tables(work->e);
+	}
+
+	run_stripes(work, encode_stripe);
+}
+
+static void init_shared(void)
+{
+	compute_Huffman_table(std_dc_luminance_nrcodes,   std_dc_luminance_values,   std_YDC_HT);
+	compute_Huffman_table(std_dc_chrominance_nrcodes, std_dc_chrominance_values, std_CbDC_HT);
+	compute_Huffman_table(std_ac_luminance_nrcodes,   std_ac_luminance_values,   std_YAC_HT);
+	compute_Huffman_table(std_ac_chrominance_nrcodes, std_ac_chrominance_values, std_CbAC_HT);
 }
 
-static void init_all(void)
+static void init_Huffman_tables(encoder_t *e)
 {
-	set_DQTinfo();
-	set_DHTinfo();
-	init_Huffman_tables();
-	set_numbers_category_and_bitcode();
-	precalculate_YCbCr_tables();
-	prepare_quant_tables();
+	const uint8_t *bits[4] = { std_dc_luminance_nrcodes, std_ac_luminance_nrcodes, std_dc_chrominance_nrcodes, std_ac_chrominance_nrcodes };
+	const uint8_t *values[4] = { std_dc_luminance_values, std_ac_luminance_values, std_dc_chrominance_values, std_ac_chrominance_values };
+	memcpy(e->HT_bits, bits, sizeof bits);
+	memcpy(e->HT_values, values, sizeof values);
+	e->YDC_HT = std_YDC_HT;
+	e->CbDC_HT = std_CbDC_HT;
+	e->YAC_HT = std_YAC_HT;
+	e->CbAC_HT = std_CbAC_HT;
 }
 
+static encoder_t *init_all(const jpeg_image_t *info)
+{
+	pthread_once(&shared_tables, init_shared);
+
+	encoder_t *e = calloc(1, sizeof (encoder_t));
+
+	// Chroma can be subsampled by 2 either across, or across and down
+	e->h_factor = info->h_factor == 2 ? 2 : 1;
+	e->v_factor = info->v_factor == 2 && e->h_factor == 2 ? 2 : 1;
+	e->units = e->h_factor * e->v_factor;
+
+	// The image is encoded straight from the decoded pixels; the last
+	// row and column are repeated as the blocks are loaded, until Ximage
+	// and Yimage are divisible by the MCU size
+	e->RGB_buffer = (const colorRGB *)info->rgb;
+	e->max_memory = info->max_memory;
+	e->width = info->width;
+	e->height = info->height;
+	e->Ximage = e->width + (8 * e->h_factor) - 1;
+	e->Ximage -= e->Ximage % (8 * e->h_factor);
+	e->Yimage = e->height + (8 * e->v_factor) - 1;
+	e->Yimage -= e->Yimage % (8 * e->v_factor);
+
+	e->SOF0info = SOF0default;
+	e->SOF0info.width = info->width;
+	e->SOF0info.height = info->height;
+	e->SOF0info.HVY = (e->h_factor << 4) | e->v_factor;
+	set_DQTinfo(e, info);
+	init_Huffman_tables(e);
+	prepare_quant_tables(e);
+	return e;
+}
+
+/*
+ * How much can be hidden once the image is re-encoded: the coefficients
+ * which will be written are not those which were read (the quantisation
+ * may well be different) so go through the same transform and
+ * quantisation now, just counting those which can carry the message
+ */
+extern uint64_t jpeg_encode_capacity(jpeg_image_t *info)
+{
+	encoder_t *e = init_all(info);
+	uint64_t bits = 0;
+
+	stripes_t work;
+	if (plan_stripes(e, info->threads, &work))
+	{
+		run_stripes(&work, transform_stripe);
+		for (int i = 0; i < work.stripes; i++)
+			bits += work.bits[i];
+		free_stripes(&work);
+		free(e);
+		return bits / 8;
+	}
+
+	for (uint32_t ypos = 0; ypos < e->Yimage; ypos += 8 * e->v_factor)
+		for (uint32_t xpos = 0; xpos < e->Ximage; xpos += 8 * e->h_factor)
+		{
+			transform_MCU(e, xpos, ypos);
+			for (int b = 0; b < e->units + 2; b++)
+				for (int i = 0; i < 64; i++)
+					if (e->MCU[b][i] > 1)
+						bits++;
+		}
+
+	free(e);
+	return bits / 8;
+}
 
 extern void jpeg_encode_data(FILE *file, jpeg_message_t *msg, jpeg_image_t *info)
 {
-	message = msg;
+	encoder_t *e = init_all(info);
+	e->message = msg;
+	e->stream = file;
+	e->out = malloc(OUTPUT_BUFFER_SIZE);
+
+	e->offset = 0;
+	e->bit = 1;
+	stripes_t work;
+	bool striped = plan_stripes(e, info->threads, &work) && alloc_stripes(&work);
+	if (striped)
+	{
+		work.optimise = info->optimise;
+		encode_stripes(&work);
+	}
+	else if (info->optimise)
+		optimise_Huffman_tables(e);
 
-	bitstring fillbits; // filling bitstring for the bit alignment of the EOI marker
+	writeword(e, 0xFFD8); // SOI
+	write_APP0info(e);
 
-	Ximage = info->width;
-	Yimage = info->height;
+	write_DQTinfo(e);
+	write_SOF0info(e);
+	write_DHTinfo(e);
+	if (striped)
+		write_DRIinfo(e, work.rows * work.xmcus);
+	write_SOSinfo(e);
 
-	uint32_t Xdiv8 = (Ximage % 8) ? ((Ximage / 8) << 3) + 8 : Ximage;
-	uint32_t Ydiv8 = (Yimage % 8) ? ((Yimage / 8) << 3) + 8 : Yimage;
+	if (striped)
+	{
+		// Each stripe is already aligned, and all but the last restarted
+		flush_output(e);
+		for (int i = 0; i < work.stripes; i++)
+			if (work.scan[i])
+				fwrite(work.scan[i], work.length[i], 1, e->stream);
+		if (work.failed)
+			errno = ENOMEM;
+		free_stripes(&work);
+	}
+	else
+	{
+		e->bitbuf = 0;
+		e->freebits = 64;
+		if (info->optimise)
+			encode_kept_blocks(e);
+		else
+			main_encoder(e);
+		// Do the bit alignment of the EOI marker
+		flush_bits(e);
+	}
+	writeword(e, 0xFFD9); //EOI
+	flush_output(e);
+	free(e->out);
+	free(e);
+}
+
+/*
+ * Write the image back out using the coefficients as they were read:
+ * all the markers (and so the quantisation and Huffman tables and the
+ * sampling factors) are the originals and only the scan is regenerated.
+ * Hiding the message only ever toggles the LSB of values greater than 1
+ * which never changes their category, so the original Huffman tables
+ * can still code everything.
+ */
+extern void jpeg_transcode_data(FILE *file, jpeg_message_t *msg, jpeg_image_t *info)
+{
+	pthread_once(&shared_tables, init_shared);
+
+	encoder_t e;
+	memset(&e, 0x00, sizeof e);
+	e.message = msg;
+	e.stream = file;
+	e.out = malloc(OUTPUT_BUFFER_SIZE);
 
-	// The image we encode shall be filled with the last line and the last column
-	// from the original bitmap, until Ximage and Yimage are divisible by 8
-	// Load BMP image from disk and complete X
-	RGB_buffer = calloc(Xdiv8 * Ydiv8, sizeof (colorRGB));
+	jpeg_coefficients_t *coeff = &info->coefficients;
 
-	//uint8_t nr_fillingbytes = (Ximage % 4) ? 4 - (Ximage % 4) : 0;
-	for (uint32_t nrline = 0; nrline < Yimage; nrline++)
-		memcpy(RGB_buffer + nrline * Xdiv8, info->rgb[nrline], Ximage * 3);
-	Ximage = Xdiv8;
-	Yimage = Ydiv8;
+	bitstring HTDC[4][256];
+	bitstring HTAC[4][256];
+	memset(HTDC, 0x00, sizeof HTDC);
+	memset(HTAC, 0x00, sizeof HTAC);
+	for (int t = 0; t < 4; t++)
+	{
+		compute_Huffman_table(coeff->dc_bits[t], coeff->dc_values[t], HTDC[t]);
+		compute_Huffman_table(coeff->ac_bits[t], coeff->ac_values[t], HTAC[t]);
+	}
 
+	fwrite(coeff->stream, coeff->header, 1, e.stream);
 
-	fp_jpeg_stream = file;
-	init_all();
-	SOF0info.width = info->width;
-	SOF0info.height = info->height;
-	writeword(0xFFD8); // SOI
-	write_APP0info();
+	e.bitbuf = 0;
+	e.freebits = 64;
+	e.offset = 0;
+	e.bit = 1;
 
-	write_DQTinfo();
-	write_SOF0info();
-	write_DHTinfo();
-	write_SOSinfo();
+	int16_t DC[3] = { 0 }; // DC coefficients used for differential encoding
+	int16_t *block = coeff->blocks;
+	uint32_t units = coeff->h_factor * coeff->v_factor;
 
-	bytenew = 0;
-	bytepos = 7;
-	main_encoder();
-	// Do the bit alignment of the EOI marker
-	if (bytepos >= 0)
+	for (uint32_t mcu = 0; mcu < coeff->mcus; mcu++)
 	{
-		fillbits.length = bytepos + 1;
-		fillbits.value = (1 << (bytepos + 1)) - 1;
-		writebits(fillbits);
+		if (coeff->restart_interval && mcu && !(mcu % coeff->restart_interval))
+		{
+			flush_bits(&e);
+			writebyte(&e, 0xFF);
+			writebyte(&e, 0xD0 + ((mcu / coeff->restart_interval - 1) & 0x07)); // RSTn
+			DC[0] = DC[1] = DC[2] = 0;
+		}
+		// Y, Cb, Cr; there may be several luminance blocks per MCU
+		for (int c = 0; c < 3; c++)
+			for (uint32_t u = 0; u < (c ? 1 : units); u++, block += 64)
+			{
+				hide_message_bits(e.message, block, &e.offset, &e.bit);
+				encode_DU(&e, block, &DC[c], HTDC[coeff->dc_table[c]], HTAC[coeff->ac_table[c]]);
+			}
 	}
-	writeword(0xFFD9); //EOI
-	free(RGB_buffer);
+	flush_bits(&e);
+	writeword(&e, 0xFFD9); //EOI
+	flush_output(&e);
+	free(e.out);
+	// The image ran out of coefficients before the message did
+	if (e.offset < msg->size + sizeof msg->size)
+		errno = ENOSPC;
 }
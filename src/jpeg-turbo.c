@@ -0,0 +1,570 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * An alternative to the JPEG plugin (jpeg.c and its own codec) built on
+ * libjpeg-turbo instead; it reads any JPEG that library can (progressive,
+ * arithmetic coded, any subsampling) and hides data exactly as the other
+ * plugin does, so either can find what the other hid
+ */
+
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+#include <jpegint.h>
+
+/* submodule includes */
+
+#include "common.h"
+
+/* project includes */
+
+#include "hide.h"
+
+static const char jpeg_header[] = { 0xFF, 0xD8, 0xFF };
+
+/*
+ * libjpeg keeps coefficients in their natural order; the message is
+ * hidden in them in zigzag order, the order they are written in
+ */
+static const uint8_t natural_order[64] =
+{
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63
+};
+
+typedef struct
+{
+	struct jpeg_error_mgr pub;
+	jmp_buf jump;
+}
+turbo_error_t;
+
+typedef struct
+{
+	FILE *fp;
+	struct jpeg_decompress_struct src;
+	turbo_error_t error;
+	jvirt_barray_ptr *coefficients;
+	bool optimise;
+	uint8_t *memory;            /* the image re-encoded, when recompressing */
+	unsigned long memory_size;
+	uint64_t capacity;          /* in bits */
+	uint8_t *message;           /* what was found, when finding */
+	uint64_t size;
+}
+turbo_image_t;
+
+typedef struct
+{
+	uint8_t *data;
+	uint64_t offset;            /* in bits */
+	uint64_t limit;
+	bool fill;
+}
+turbo_message_t;
+
+/*
+ * libjpeg writes the blocks padding out the last MCU of a row or column
+ * as dummies, throwing away whatever was hidden in them; the other plugin
+ * writes (and hides in) them as they are, so this writes them as they are
+ * too, in place of libjpeg's own coefficient controller
+ */
+typedef struct
+{
+	struct jpeg_c_coef_controller pub;
+	jvirt_barray_ptr *coefficients;
+	JDIMENSION row;             /* iMCU row being written */
+	JBLOCKROW mcu[C_MAX_BLOCKS_IN_MCU];
+}
+turbo_coef_t;
+
+/*
+ * libjpeg's errors are fatal unless caught; so “catch” them and return
+ * to where we can clean up
+ */
+static void error_exit(j_common_ptr cinfo)
+{
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(((turbo_error_t *)cinfo->err)->jump, 1);
+}
+
+static bool is_jpeg(char *file_name)
+{
+	FILE *fp = fopen(file_name, "rb");
+	if (!fp)
+		return false;
+
+	uint8_t header[3];
+	fread(header, 1, sizeof header, fp);
+	fclose(fp);
+
+	return !memcmp(header, jpeg_header, sizeof header);
+}
+
+/*
+ * visit every block, in the order they are in an interleaved scan: MCU
+ * by MCU, and within each the luminance blocks row by row, then Cb and
+ * Cr; stops early if f returns false
+ */
+static void walk_blocks(turbo_image_t *image, bool writable, bool (*f)(JCOEF *, void *), void *arg)
+{
+	struct jpeg_decompress_struct *src = &image->src;
+	int components = src->num_components;
+	bool interleaved = components > 1;
+	JDIMENSION rows = interleaved ? src->total_iMCU_rows : src->comp_info[0].height_in_blocks;
+	/* MCUs_per_row is whatever the last scan left it as */
+	JDIMENSION columns = interleaved ? (src->image_width + src->max_h_samp_factor * DCTSIZE - 1) / (src->max_h_samp_factor * DCTSIZE) : src->comp_info[0].width_in_blocks;
+
+	for (JDIMENSION row = 0; row < rows; row++)
+	{
+		JBLOCKARRAY blocks[MAX_COMPONENTS];
+		for (int c = 0; c < components; c++)
+		{
+			int v = interleaved ? src->comp_info[c].v_samp_factor : 1;
+			blocks[c] = (*src->mem->access_virt_barray)((j_common_ptr)src, image->coefficients[c], row * v, v, writable);
+		}
+		for (JDIMENSION column = 0; column < columns; column++)
+			for (int c = 0; c < components; c++)
+			{
+				int h = interleaved ? src->comp_info[c].h_samp_factor : 1;
+				int v = interleaved ? src->comp_info[c].v_samp_factor : 1;
+				for (int y = 0; y < v; y++)
+					for (int x = 0; x < h; x++)
+						if (!f(blocks[c][y][column * h + x], arg))
+							return;
+			}
+	}
+}
+
+static bool count_block(JCOEF *block, void *arg)
+{
+	uint64_t *bits = arg;
+	for (int i = 0; i < 64; i++)
+		if (block[i] > 1)
+			(*bits)++;
+	return true;
+}
+
+static bool hide_block(JCOEF *block, void *arg)
+{
+	turbo_message_t *message = arg;
+	for (int i = 0; i < 64 && message->offset < message->limit; i++)
+	{
+		JCOEF *c = &block[natural_order[i]];
+		if (*c > 1)
+		{
+			if (message->data[message->offset >> 3] & (1 << (message->offset & 0x07)))
+				*c |= 0x0001;
+			else
+				*c &= ~0x0001;
+			message->offset++;
+		}
+	}
+	return message->offset < message->limit;
+}
+
+static bool find_block(JCOEF *block, void *arg)
+{
+	turbo_message_t *message = arg;
+	for (int i = 0; i < 64 && message->offset < message->limit; i++)
+	{
+		JCOEF c = block[natural_order[i]];
+		if (c > 1)
+		{
+			if (c & 0x01)
+				message->data[message->offset >> 3] |= 1 << (message->offset & 0x07);
+			message->offset++;
+			/* the length comes first, unless the image was filled */
+			if (message->offset == sizeof (uint64_t) * 8 && !message->fill)
+			{
+				uint64_t size;
+				memcpy(&size, message->data, sizeof size);
+				size = (ntohll(size) + sizeof size) * 8;
+				if (size < message->limit)
+					message->limit = size;
+			}
+		}
+	}
+	return message->offset < message->limit;
+}
+
+static void start_coef(j_compress_ptr cinfo, J_BUF_MODE pass_mode)
+{
+	(void)pass_mode;
+	((turbo_coef_t *)cinfo->coef)->row = 0;
+}
+
+static boolean write_coef(j_compress_ptr cinfo, JSAMPIMAGE input_buf)
+{
+	(void)input_buf;
+	turbo_coef_t *coef = (turbo_coef_t *)cinfo->coef;
+	bool interleaved = cinfo->comps_in_scan > 1;
+	jpeg_component_info *first = cinfo->cur_comp_info[0];
+	int rows = 1;
+	if (!interleaved)
+		rows = coef->row < cinfo->total_iMCU_rows - 1 ? first->v_samp_factor : first->last_row_height;
+
+	JBLOCKARRAY blocks[MAX_COMPS_IN_SCAN];
+	for (int c = 0; c < cinfo->comps_in_scan; c++)
+	{
+		jpeg_component_info *component = cinfo->cur_comp_info[c];
+		blocks[c] = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, coef->coefficients[component->component_index], coef->row * component->v_samp_factor, component->v_samp_factor, FALSE);
+	}
+	for (int y = 0; y < rows; y++)
+		for (JDIMENSION column = 0; column < cinfo->MCUs_per_row; column++)
+		{
+			int n = 0;
+			for (int c = 0; c < cinfo->comps_in_scan; c++)
+			{
+				jpeg_component_info *component = cinfo->cur_comp_info[c];
+				for (int v = 0; v < component->MCU_height; v++)
+					for (int h = 0; h < component->MCU_width; h++)
+						coef->mcu[n++] = blocks[c][y + v] + column * component->MCU_width + h;
+			}
+			if (!(*cinfo->entropy->encode_mcu)(cinfo, coef->mcu))
+				return FALSE;
+		}
+	coef->row++;
+	return TRUE;
+}
+
+/*
+ * decode the image and encode it again, into memory, with the chosen
+ * quality and subsampling (or the original's), so that what's hidden is
+ * hidden in the coefficients which will be written
+ */
+static void recompress(turbo_image_t *image, const image_options_t *options)
+{
+	struct jpeg_decompress_struct *src = &image->src;
+	struct jpeg_compress_struct dst;
+	dst.err = &image->error.pub;
+	jpeg_create_compress(&dst);
+
+	/* no need to go all the way to RGB and back */
+	if (src->jpeg_color_space == JCS_YCbCr)
+		src->out_color_space = JCS_YCbCr;
+	jpeg_start_decompress(src);
+
+	jpeg_mem_dest(&dst, &image->memory, &image->memory_size);
+	dst.image_width = src->output_width;
+	dst.image_height = src->output_height;
+	dst.input_components = src->output_components;
+	dst.in_color_space = src->out_color_space;
+	jpeg_set_defaults(&dst);
+	dst.optimize_coding = image->optimise;
+
+	if (options->quality)
+		jpeg_set_quality(&dst, options->quality, TRUE);
+	else
+		for (int n = 0; n < NUM_QUANT_TBLS; n++)
+			if (src->quant_tbl_ptrs[n])
+			{
+				unsigned int table[DCTSIZE2];
+				for (int i = 0; i < DCTSIZE2; i++)
+					table[i] = src->quant_tbl_ptrs[n]->quantval[i];
+				jpeg_add_quant_table(&dst, n, table, 100, TRUE);
+			}
+	if (dst.num_components == src->num_components)
+		for (int c = 0; c < dst.num_components; c++)
+		{
+			if (!options->quality)
+				dst.comp_info[c].quant_tbl_no = src->comp_info[c].quant_tbl_no;
+			dst.comp_info[c].h_samp_factor = src->comp_info[c].h_samp_factor;
+			dst.comp_info[c].v_samp_factor = src->comp_info[c].v_samp_factor;
+		}
+	if (options->subsample && dst.num_components == 3)
+	{
+		dst.comp_info[0].h_samp_factor = options->subsample == 444 ? 1 : 2;
+		dst.comp_info[0].v_samp_factor = options->subsample == 420 ? 2 : 1;
+		for (int c = 1; c < 3; c++)
+			dst.comp_info[c].h_samp_factor = dst.comp_info[c].v_samp_factor = 1;
+	}
+
+	jpeg_start_compress(&dst, TRUE);
+	JSAMPARRAY row = (*src->mem->alloc_sarray)((j_common_ptr)src, JPOOL_IMAGE, src->output_width * src->output_components, 1);
+	while (src->output_scanline < src->output_height)
+	{
+		jpeg_read_scanlines(src, row, 1);
+		jpeg_write_scanlines(&dst, row, 1);
+	}
+	jpeg_finish_compress(&dst);
+	jpeg_destroy_compress(&dst);
+	jpeg_finish_decompress(src);
+
+	/*
+	 * now read it back in as if it were the original (libjpeg won't
+	 * swap one kind of source for another, so forget the old one)
+	 */
+	src->src = NULL;
+	jpeg_mem_src(src, image->memory, image->memory_size);
+	jpeg_read_header(src, TRUE);
+}
+
+static int read_jpeg(image_info_t *image_info, void (*progress_update)(uint64_t, uint64_t))
+{
+	errno = EXIT_SUCCESS;
+
+	turbo_image_t *image = calloc(1, sizeof (turbo_image_t));
+	if (!image)
+		return errno;
+	if (!(image->fp = fopen(image_info->file, "rb")))
+	{
+		free(image);
+		return errno;
+	}
+	data_info_t data = *image_info->data;
+	image->optimise = data.options.optimise;
+
+	image->src.err = jpeg_std_error(&image->error.pub);
+	image->error.pub.error_exit = error_exit;
+	jpeg_create_decompress(&image->src);
+	if (setjmp(image->error.jump))
+	{
+		errno = EFTYPE;
+		goto clean_up;
+	}
+	jpeg_stdio_src(&image->src, image->fp);
+	/* keep everything else in the image, to be written back out */
+	jpeg_save_markers(&image->src, JPEG_COM, 0xFFFF);
+	for (int m = 0; m < 16; m++)
+		jpeg_save_markers(&image->src, JPEG_APP0 + m, 0xFFFF);
+	jpeg_read_header(&image->src, TRUE);
+
+	if (data.hide && data.options.recompress)
+		recompress(image, &data.options);
+	image->coefficients = jpeg_read_coefficients(&image->src);
+
+	walk_blocks(image, false, count_block, &image->capacity);
+
+	if (!data.hide)
+	{
+		/* when filling the image, everything in it is the message */
+		turbo_message_t message = { NULL, 0, image->capacity & ~0x07ULL, data.fill };
+		if (!(message.data = calloc(image->capacity / 8 + 1, sizeof (uint8_t))))
+			goto clean_up;
+		walk_blocks(image, false, find_block, &message);
+		image->message = message.data;
+		image->size = message.offset / 8 > sizeof (uint64_t) ? message.offset / 8 - sizeof (uint64_t) : 0;
+	}
+
+	/* as with the other plugin, there are no pixels, just bytes */
+	image_info->bpp = 1;
+	image_info->width = image->capacity / 8;
+	image_info->height = 1;
+	image_info->columns = image->src.image_width;
+	image_info->rows = image->src.image_height;
+	image_info->buffer = NULL;
+	image_info->extra = image;
+	if (progress_update)
+		progress_update(image_info->width, image_info->width);
+	return errno;
+
+clean_up:
+	jpeg_destroy_decompress(&image->src);
+	fclose(image->fp);
+	free(image->memory);
+	free(image);
+	image_info->extra = NULL;
+	return errno ? : EFTYPE;
+}
+
+static void free_image(turbo_image_t *image)
+{
+	if (!image)
+		return;
+	jpeg_destroy_decompress(&image->src);
+	fclose(image->fp);
+	free(image->memory);
+	free(image->message);
+	free(image);
+}
+
+static int embed_jpeg(image_info_t image_info, const uint8_t *payload, uint64_t length, void (*progress_update)(uint64_t, uint64_t))
+{
+	errno = EXIT_SUCCESS;
+
+	turbo_image_t *image = image_info.extra;
+	FILE *fp = fopen(image_info.file, "wb");
+	if (!fp)
+	{
+		free_image(image);
+		return errno;
+	}
+
+	struct jpeg_compress_struct dst;
+	dst.err = &image->error.pub;
+	jpeg_create_compress(&dst);
+	if (setjmp(image->error.jump))
+	{
+		errno = EIO;
+		goto clean_up;
+	}
+
+	/* the payload begins with its length, which is hidden too */
+	turbo_message_t message = { (uint8_t *)payload, 0, length * 8, false };
+	walk_blocks(image, true, hide_block, &message);
+	if (message.offset < message.limit)
+	{
+		errno = ENOSPC;
+		goto clean_up;
+	}
+
+	jpeg_stdio_dest(&dst, fp);
+	/*
+	 * always sequential, as the other plugin writes it: a progressive
+	 * scan of a single component wouldn't include the padding blocks
+	 */
+	jpeg_copy_critical_parameters(&image->src, &dst);
+	dst.optimize_coding = image->optimise;
+	jpeg_write_coefficients(&dst, image->coefficients);
+	turbo_coef_t *coef = (*dst.mem->alloc_small)((j_common_ptr)&dst, JPOOL_IMAGE, sizeof (turbo_coef_t));
+	coef->pub.start_pass = start_coef;
+	coef->pub.compress_data = write_coef;
+	coef->coefficients = image->coefficients;
+	dst.coef = &coef->pub;
+
+	/* JFIF and Adobe markers have been written already */
+	for (jpeg_saved_marker_ptr m = image->src.marker_list; m; m = m->next)
+	{
+		if (m->marker == JPEG_APP0 && m->data_length >= 5 && !memcmp(m->data, "JFIF", 5))
+			continue;
+		if (m->marker == JPEG_APP0 + 14 && m->data_length >= 5 && !memcmp(m->data, "Adobe", 5))
+			continue;
+		jpeg_write_marker(&dst, m->marker, m->data, m->data_length);
+	}
+
+	jpeg_finish_compress(&dst);
+	jpeg_finish_decompress(&image->src);
+	if (progress_update)
+		progress_update(length, length);
+
+clean_up:
+	jpeg_destroy_compress(&dst);
+	free_image(image);
+	int e = errno;
+	fclose(fp);
+	/* an image which couldn't take all of it is no use to anyone */
+	if (e)
+		unlink(image_info.file);
+	return errno = e;
+}
+
+static int extract_jpeg(image_info_t image_info, int (*sink)(void *, const uint8_t *, uint64_t), void *arg)
+{
+	turbo_image_t *image = image_info.extra;
+	/* the length was used while finding; it isn't part of the data */
+	return image->message ? sink(arg, image->message + sizeof (uint64_t), image->size) : EXIT_SUCCESS;
+}
+
+static uint64_t info_jpeg(image_info_t *image_info)
+{
+	/* the coefficients can only be had all at once, so there's no estimating */
+	data_info_t data = { .hide = true };
+	image_info->data = &data;
+	if (read_jpeg(image_info, NULL))
+		return 0;
+	return HIDE_CAPACITY;
+}
+
+static int preview_jpeg(image_info_t *image_info, uint8_t scale)
+{
+	errno = EXIT_SUCCESS;
+
+	FILE *fp = fopen(image_info->file, "rb");
+	if (!fp)
+		return errno;
+
+	struct jpeg_decompress_struct src;
+	turbo_error_t error;
+	src.err = jpeg_std_error(&error.pub);
+	error.pub.error_exit = error_exit;
+	jpeg_create_decompress(&src);
+	if (setjmp(error.jump))
+	{
+		errno = EFTYPE;
+		goto clean_up;
+	}
+	jpeg_stdio_src(&src, fp);
+	jpeg_read_header(&src, TRUE);
+
+	/* libjpeg decodes straight to the smaller size, with a reduced IDCT */
+	src.scale_num = 1;
+	src.scale_denom = scale;
+	src.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&src);
+
+	image_info->bpp = 3;
+	image_info->width = src.output_width;
+	if (!(image_info->buffer = calloc(src.output_height, sizeof (uint8_t *))))
+		goto clean_up;
+	image_info->height = src.output_height;
+	for (uint64_t y = 0; y < image_info->height; y++)
+		if (!(image_info->buffer[y] = malloc(image_info->width * image_info->bpp)))
+			goto clean_up;
+	while (src.output_scanline < src.output_height)
+		jpeg_read_scanlines(&src, image_info->buffer + src.output_scanline, src.output_height - src.output_scanline);
+	jpeg_finish_decompress(&src);
+
+clean_up:
+	jpeg_destroy_decompress(&src);
+	fclose(fp);
+	return errno;
+}
+
+static void free_jpeg(image_info_t image_info)
+{
+	/* only previews have rows */
+	if (image_info.buffer)
+	{
+		for (uint64_t y = 0; y < image_info.height; y++)
+			free(image_info.buffer[y]);
+		free(image_info.buffer);
+	}
+	free_image(image_info.extra);
+}
+
+extern image_type_t *init(void)
+{
+	static image_type_t jpeg;
+	jpeg.type = "JPEG";
+	jpeg.is_type = is_jpeg;
+	jpeg.read = read_jpeg;
+	jpeg.info = info_jpeg;
+	jpeg.free = free_jpeg;
+	jpeg.embed = embed_jpeg;
+	jpeg.extract = extract_jpeg;
+	jpeg.preview = preview_jpeg;
+	return &jpeg;
+}
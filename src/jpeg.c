@@ -34,6 +34,7 @@
 /* project includes */
 
 #include "hide.h"
+#include "scratch.h"
 #include "jpeg.h"
 
 static const char jpeg_header[] = { 0xFF, 0xD8, 0xFF };
@@ -51,6 +52,17 @@ static bool is_jpeg(char *file_name)
 	return !memcmp(header, jpeg_header, sizeof header);
 }
 
+static void free_image(jpeg_image_t *image)
+{
+	if (!image)
+		return;
+	scratch_free(image->rgb);
+	scratch_free(image->coefficients.blocks);
+	free(image->coefficients.stream);
+	free(image->message.data);
+	free(image);
+}
+
 static int read_jpeg(image_info_t *image_info, void (*progress_update)(uint64_t, uint64_t))
 {
 	errno = EXIT_SUCCESS;
@@ -61,40 +73,67 @@ static int read_jpeg(image_info_t *image_info, void (*progress_update)(uint64_t,
 
 	jpeg_message_t msg = { 0x00, NULL };
 	jpeg_image_t *image = calloc(1, sizeof (jpeg_image_t));
-	data_info_t extra = *(data_info_t *)image_info->extra;
-	jpeg_load_e action = extra.hide ? JPEG_LOAD_READ : JPEG_LOAD_FIND;
+	data_info_t data = *image_info->data;
+	/*
+	 * unless asked to recompress the image, work directly on the
+	 * quantised coefficients; much quicker and the output will be
+	 * almost identical in size to the original
+	 */
+	jpeg_load_e action = JPEG_LOAD_FIND;
+	if (data.hide)
+		action = data.options.recompress ? JPEG_LOAD_READ : JPEG_LOAD_TRANSCODE;
+	/* only ever asked for when all that's wanted is the capacity */
+	if (action == JPEG_LOAD_TRANSCODE && data.options.estimate)
+		action = JPEG_LOAD_ESTIMATE;
 
-	if (!jpeg_decode_data(fp, &msg, image, action, extra.fill))
+	image->max_memory = data.options.max_memory;
+	if (!jpeg_decode_data(fp, &msg, image, action, data.fill, data.options.threads))
+	{
+		free_image(image);
+		errno = errno ? : EFTYPE;
 		goto clean_up;
+	}
+	image->optimise = data.options.optimise;
+	image->quality = data.options.quality;
+	image->threads = data.options.threads;
+	switch (data.options.subsample)
+	{
+		case 444:
+			image->h_factor = 1, image->v_factor = 1;
+			break;
+		case 422:
+			image->h_factor = 2, image->v_factor = 1;
+			break;
+		case 420:
+			image->h_factor = 2, image->v_factor = 2;
+			break;
+	}
+	/*
+	 * when re-encoding, what can be hidden depends on what will be
+	 * written, not on what was read
+	 */
+	if (action == JPEG_LOAD_READ)
+		msg.size = jpeg_encode_capacity(image);
 
+	/*
+	 * the message goes straight to (or from) the coefficients, so
+	 * there are no pixels to work with, just bytes: all those which can
+	 * be hidden, length and all (HIDE_CAPACITY takes the length off)
+	 */
 	if (action == JPEG_LOAD_FIND)
 	{
-		msg.size = htonll(msg.size);
-		memcpy(msg.data, &msg.size, sizeof msg.size);
-		msg.size = ntohll(msg.size) + sizeof msg.size;
+		image->message = msg;
+		msg.size += sizeof msg.size;
 	}
-	else
-		msg.size -= sizeof msg.size; /* available capacity */
 
-	image_info->bpp = 3;
+	image_info->bpp = 1;
 	image_info->width = msg.size;
+	image_info->margin = image->margin;
 	image_info->height = 1;
-	image_info->buffer = malloc(sizeof (uint8_t *) * image_info->height);
-	image_info->buffer[0] = malloc(image_info->width * image_info->bpp);
-	/* (if necessary) copy message.data into image_info->buffer */
-	if (msg.data)
-	{
-		for (uint64_t x = 0, i = 0; i < msg.size; x += image_info->bpp, i++)
-		{
-			image_info->buffer[0][x + 0] = (msg.data[i] & 0xE0) >> 5;
-			image_info->buffer[0][x + 1] = (msg.data[i] & 0x18) >> 3;
-			image_info->buffer[0][x + 2] = (msg.data[i] & 0x07);
-			if (progress_update)
-				progress_update(x, image_info->width);
-		}
-		free(msg.data);
-	}
-	else if (progress_update)
+	image_info->columns = image->width;
+	image_info->rows = image->height;
+	image_info->buffer = NULL;
+	if (progress_update)
 		progress_update(image_info->width, image_info->width);
 
 	/* store the image data where we can get it back later */
@@ -105,48 +144,78 @@ clean_up:
 	return errno;
 }
 
-static int write_jpeg(image_info_t image_info, void (*progress_update)(uint64_t, uint64_t))
+static int preview_jpeg(image_info_t *image_info, uint8_t scale)
 {
 	errno = EXIT_SUCCESS;
 
-	FILE *fp = fopen(image_info.file, "wb");
+	FILE *fp = fopen(image_info->file, "rb");
 	if (!fp)
 		return errno;
 
-	jpeg_message_t msg = { image_info.width, NULL };
-	msg.data = malloc(msg.size); // total capacity
-
-	/* retrieve the image data */
-	jpeg_image_t *image = image_info.extra;
-
-	/* copy message from image_info.buffer to message.data */
-	for (uint64_t x = 0, i = 0; x < image_info.width * image_info.bpp; x += image_info.bpp, i++)
+	jpeg_message_t msg = { 0x00, NULL };
+	jpeg_image_t *image = calloc(1, sizeof (jpeg_image_t));
+	if (!image)
+		goto clean_up;
+	/* decoded straight to the smaller size; it never exists at full size */
+	image->scale = scale;
+	if (!jpeg_decode_data(fp, &msg, image, JPEG_LOAD_PREVIEW, false, 0) || !image->rgb)
 	{
-		msg.data[i]  = (image_info.buffer[0][x + 0] & 0x07) << 5;
-		msg.data[i] |= (image_info.buffer[0][x + 1] & 0x03) << 3;
-		msg.data[i] |= (image_info.buffer[0][x + 2] & 0x07);
-		if (progress_update)
-			progress_update(x, image_info.width);
+		scratch_free(image->rgb);
+		free(image);
+		errno = errno ? : EFTYPE;
+		goto clean_up;
 	}
-	free(image_info.buffer[0]);
-	free(image_info.buffer);
 
-	/* get actual message length from data */
-	memcpy(&msg.size, msg.data, sizeof msg.size);
-	msg.size = ntohll(msg.size);
+	image_info->bpp = 3;
+	image_info->width = image->width;
+	image_info->height = image->height;
+	image_info->buffer = malloc(image->height * sizeof (uint8_t *));
+	for (uint32_t y = 0; y < image->height; y++)
+		image_info->buffer[y] = image->rgb + (uint64_t)y * image->width * 3;
+	image_info->extra = image;
+
+clean_up:
+	fclose(fp);
+	return errno;
+}
+
+static int embed_jpeg(image_info_t image_info, const uint8_t *payload, uint64_t length, void (*progress_update)(uint64_t, uint64_t))
+{
+	errno = EXIT_SUCCESS;
+
+	FILE *fp = fopen(image_info.file, "wb");
+	if (!fp)
+		return errno;
+
+	/* the payload begins with its length, which is hidden too */
+	jpeg_message_t msg = { length - sizeof msg.size, (uint8_t *)payload };
+	jpeg_image_t *image = image_info.extra;
 
 	/* write the message to the image */
-	jpeg_encode_data(fp, &msg, image);
+	if (image->coefficients.blocks)
+		jpeg_transcode_data(fp, &msg, image);
+	else
+		jpeg_encode_data(fp, &msg, image);
+	int e = errno;
+	if (progress_update)
+		progress_update(length, length);
 
-	free(msg.data);
-	for (uint64_t i = 0; i < image->height; i++)
-		free(image->rgb[i]);
-	free(image->rgb);
-	free(image);
+	free_image(image);
 
 	fclose(fp);
+	/* an image which couldn't take all of it is no use to anyone */
+	if (e)
+		unlink(image_info.file);
 
-	return errno;
+	return errno = e;
+}
+
+static int extract_jpeg(image_info_t image_info, int (*sink)(void *, const uint8_t *, uint64_t), void *arg)
+{
+	jpeg_image_t *image = image_info.extra;
+	jpeg_message_t *msg = &image->message;
+	/* the length was used while decoding; it isn't part of the data */
+	return msg->data ? sink(arg, msg->data + sizeof msg->size, msg->size) : EXIT_SUCCESS;
 }
 
 #ifndef __DEBUG_JPEG__
@@ -155,9 +224,17 @@ static uint64_t info_jpeg(image_info_t *image_info)
 extern uint64_t info_jpeg(image_info_t *image_info)
 #endif
 {
-	data_info_t extra = { NULL, 0, true, false };
-	image_info->extra = &extra;
-	read_jpeg(image_info, NULL);
+	data_info_t data = { .hide = true };
+	/* how many threads, and whether to sample, can still be chosen */
+	if (image_info->data)
+	{
+		data.options.threads = image_info->data->options.threads;
+		data.options.estimate = image_info->data->options.estimate;
+		data.options.max_memory = image_info->data->options.max_memory;
+	}
+	image_info->data = &data;
+	if (read_jpeg(image_info, NULL))
+		return 0;
 	return HIDE_CAPACITY;
 }
 
@@ -167,13 +244,9 @@ static void free_jpeg(image_info_t image_info)
 extern void free_jpeg(image_info_t image_info)
 #endif
 {
-	free(image_info.buffer[0]);
+	/* only previews have rows, and they point into the decoded image */
 	free(image_info.buffer);
-	jpeg_image_t *image = image_info.extra;
-	for (uint64_t i = 0; i < image->height; i++)
-		free(image->rgb[i]);
-	free(image->rgb);
-	free(image);
+	free_image(image_info.extra);
 }
 
 extern image_type_t *init(void)
@@ -182,8 +255,10 @@ extern image_type_t *init(void)
 	jpeg.type = "JPEG";
 	jpeg.is_type = is_jpeg;
 	jpeg.read = read_jpeg;
-	jpeg.write = write_jpeg;
 	jpeg.info = info_jpeg;
 	jpeg.free = free_jpeg;
+	jpeg.embed = embed_jpeg;
+	jpeg.extract = extract_jpeg;
+	jpeg.preview = preview_jpeg;
 	return &jpeg;
 }
@@ -19,15 +19,20 @@
  */
 
 #ifndef _HIDE_JPEG_H_
+#define _HIDE_JPEG_H_
 
 #include <inttypes.h>
+#include <stdbool.h>
 
 #define byte_limit(i, j) (i < j ? j : (i > 255 ? 255 : i))
 
 typedef enum
 {
-	JPEG_LOAD_READ,
-	JPEG_LOAD_FIND
+	JPEG_LOAD_READ,      /* decode to RGB ready to be re-encoded */
+	JPEG_LOAD_FIND,
+	JPEG_LOAD_TRANSCODE, /* keep the quantised coefficients as they are */
+	JPEG_LOAD_ESTIMATE,  /* sample the capacity rather than count it */
+	JPEG_LOAD_PREVIEW    /* decode to RGB at 1/scale the size */
 }
 jpeg_load_e;
 
@@ -38,16 +43,53 @@ typedef struct
 }
 jpeg_message_t;
 
+/*
+ * everything needed to write the scan back out without leaving the
+ * frequency domain: the original markers are copied verbatim (so the
+ * quantisation tables, sampling factors, and Huffman tables are those of
+ * the source image) and only the entropy-coded data is regenerated
+ */
+typedef struct
+{
+	uint8_t *stream;            /* the original markers */
+	uint64_t header;            /* length of the markers before the scan data */
+	int16_t *blocks;            /* quantised coefficients, zigzag order, MCU by MCU (from scratch_alloc) */
+	uint32_t mcus;
+	uint8_t h_factor;           /* luminance sampling factors */
+	uint8_t v_factor;
+	uint16_t restart_interval;
+	uint8_t dc_table[3];        /* Huffman table selectors for Y, Cb, Cr */
+	uint8_t ac_table[3];
+	uint8_t dc_bits[4][17];     /* as read from each DHT */
+	uint8_t dc_values[4][256];
+	uint8_t ac_bits[4][17];
+	uint8_t ac_values[4][256];
+}
+jpeg_coefficients_t;
+
 typedef struct
 {
-	uint8_t **rgb;
-	uint32_t width;
+	uint8_t *rgb;               /* width * 3 bytes per row, no padding (from scratch_alloc) */
+	uint32_t width;             /* as decoded, so smaller when previewing */
 	uint32_t height;
+	uint8_t scale;              /* when previewing: 1, 2, 4 or 8 */
+	bool optimise;              /* build Huffman tables for this image when re-encoding */
+	uint8_t quality;            /* re-encode with the standard tables scaled to this, */
+	uint8_t quant[2][64];       /* or with the original's (luminance, chrominance; zigzag order) */
+	uint8_t h_factor;           /* luminance sampling factors to re-encode with; */
+	uint8_t v_factor;           /* chroma is subsampled by these (1 or 2 each) */
+	uint32_t threads;           /* to re-encode with, or 0 for one per CPU */
+	uint64_t margin;            /* how far out an estimated capacity may be (bytes, 95% confidence) */
+	uint64_t max_memory;        /* scratch budget for the coefficients and pixels (see scratch.h) */
+	jpeg_message_t message;     /* what was found, when finding */
+	jpeg_coefficients_t coefficients;
 }
 jpeg_image_t;
 
 
-extern bool jpeg_decode_data(FILE *, jpeg_message_t *, jpeg_image_t *, jpeg_load_e, bool);
+extern bool jpeg_decode_data(FILE *, jpeg_message_t *, jpeg_image_t *, jpeg_load_e, bool, uint32_t);
 extern void jpeg_encode_data(FILE *, jpeg_message_t *, jpeg_image_t *);
+extern uint64_t jpeg_encode_capacity(jpeg_image_t *);
+extern void jpeg_transcode_data(FILE *, jpeg_message_t *, jpeg_image_t *);
 
 #endif /* _HIDE_JPEG_H */
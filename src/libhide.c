@@ -0,0 +1,118 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* project includes */
+
+#include "hide.h"
+#include "job.h"
+#include "libhide.h"
+
+static plugins_t plugins;
+static pthread_once_t loaded = PTHREAD_ONCE_INIT;
+
+static void load_plugins(void)
+{
+	plugins_load(DIR_LIBRARY, &plugins);
+	return;
+}
+
+/*
+ * run a job on (up to) three buffers: the image, the document (unless
+ * finding or sizing up) and the output (unless sizing up), which is read
+ * back once the job is done
+ */
+static int run_memory(job_t *job, const uint8_t *carrier, size_t carrier_length, const uint8_t *payload, size_t payload_length, bool output, const hide_options_t *options, uint8_t **out, size_t *out_length)
+{
+	int fds[3] = { -1, -1, -1 };
+
+	if (!carrier || !options || (output && (!out || !out_length)))
+		return EINVAL;
+	job_watch_t watch;
+	job_watch_start(&watch, options->image.threads);
+	pthread_once(&loaded, load_plugins);
+	if (!plugins.count)
+		return ENOENT;
+	job_watch_lap(&watch, &job->stats, JOB_LOAD);
+
+	if ((fds[0] = memory_open(carrier, carrier_length, &job->files.image_in)) < 0
+			|| (payload && (fds[1] = memory_open(payload, payload_length, &job->files.data_file)) < 0)
+			|| (output && (fds[2] = memory_open(NULL, 0, payload ? &job->files.image_out : &job->files.data_file)) < 0))
+		job->error = errno;
+	else
+	{
+		job_run_loaded(&plugins, job, options->fill, options->image);
+		if (!job->error && output)
+			job->error = memory_read(fds[2], out, out_length);
+	}
+	if (options->stats)
+		*options->stats = job->stats;
+
+	for (int i = 0; i < 3; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	free(job->files.image_in);
+	free(job->files.data_file);
+	free(job->files.image_out);
+	free(job->why);
+	return job->error;
+}
+
+extern int hide_embed_mem(const uint8_t *carrier, size_t carrier_length, const uint8_t *payload, size_t payload_length, const hide_options_t *options, uint8_t **out, size_t *out_length)
+{
+	job_t job;
+	memset(&job, 0x00, sizeof job);
+	if (!payload && payload_length)
+		return EINVAL;
+	return run_memory(&job, carrier, carrier_length, payload ? payload : (const uint8_t *)"", payload_length, true, options, out, out_length);
+}
+
+extern int hide_extract_mem(const uint8_t *carrier, size_t carrier_length, const hide_options_t *options, uint8_t **out, size_t *out_length)
+{
+	job_t job;
+	memset(&job, 0x00, sizeof job);
+	return run_memory(&job, carrier, carrier_length, NULL, 0, true, options, out, out_length);
+}
+
+extern int hide_capacity_mem(const uint8_t *carrier, size_t carrier_length, const hide_options_t *options, uint64_t *capacity, uint64_t *margin)
+{
+	job_t job;
+	memset(&job, 0x00, sizeof job);
+	int r = run_memory(&job, carrier, carrier_length, NULL, 0, false, options, NULL, NULL);
+	if (!r && capacity)
+		*capacity = job.capacity;
+	if (!r && margin)
+		*margin = job.margin;
+	return r;
+}
@@ -0,0 +1,58 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _LIBHIDE_H_
+#define _LIBHIDE_H_
+
+/*
+ * hiding and finding in memory, for other programs to do without running
+ * hide: images (and documents) are given and returned as bytes, never as
+ * files; the image libraries are loaded on first use and kept, and each
+ * call is reentrant, so can be made from as many threads as the caller
+ * likes (such as from a pool of its own)
+ *
+ * every call returns 0 on success, otherwise an errno value; buffers it
+ * returns are the caller's to free
+ *
+ * the statistics are those hide --stats reports: the time each phase
+ * took (the first call's load includes finding the image libraries),
+ * the bytes read and written, and so on; the CPU time is the calling
+ * thread's own when image.threads is 1, otherwise the whole process's
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hide.h"
+
+typedef struct
+{
+	bool fill;             /* fill the image to capacity (no length is stored) */
+	image_options_t image; /* as the command line's; image.threads is how many each call may use */
+	job_stats_t *stats;    /* if not NULL, how the call went (so each thread needs its own options) */
+}
+hide_options_t;
+
+extern int hide_embed_mem(const uint8_t *carrier, size_t carrier_length, const uint8_t *payload, size_t payload_length, const hide_options_t *options, uint8_t **out, size_t *out_length);
+extern int hide_extract_mem(const uint8_t *carrier, size_t carrier_length, const hide_options_t *options, uint8_t **out, size_t *out_length);
+extern int hide_capacity_mem(const uint8_t *carrier, size_t carrier_length, const hide_options_t *options, uint64_t *capacity, uint64_t *margin);
+
+#endif
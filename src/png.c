@@ -30,6 +30,8 @@
 #include <png.h>
 
 #include "hide.h"
+#include "preview.h"
+#include "scratch.h"
 
 static bool is_png(char *file_name)
 {
@@ -102,15 +104,23 @@ static int read_png(image_info_t *image_info, void (*progress_update)(uint64_t,
 	if (setjmp(png_jmpbuf(png_ptr)))
 		goto cleanup;
 
-	image_info->buffer = malloc(sizeof (uint8_t *) * image_info->height);
-	for (uint64_t y = 0; y < image_info->height; y++)
-	{
-		image_info->buffer[y] = malloc(image_info->width * image_info->bpp);
-		if (progress_update)
-			progress_update(y, image_info->height);
-	}
+	if (!(image_info->buffer = scratch_rows(image_info->height, image_info->width * image_info->bpp, SCRATCH_BUDGET(image_info))))
+		goto cleanup;
 
-	png_read_image(png_ptr, image_info->buffer);
+	/*
+	 * an interlaced image has to be read in full, otherwise each band
+	 * can go as soon as it's read
+	 */
+	if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE)
+		png_read_image(png_ptr, image_info->buffer);
+	else
+		for (uint64_t y = 0; y < image_info->height; y++)
+		{
+			png_read_row(png_ptr, image_info->buffer[y], NULL);
+			scratch_rows_done(image_info->buffer, y);
+			if (progress_update)
+				progress_update(y, image_info->height);
+		}
 
 cleanup:
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
@@ -174,7 +184,13 @@ static int write_png(image_info_t image_info, void (*progress_update)(uint64_t,
 	if (setjmp(png_jmpbuf(png_ptr)))
 		goto cleanup;
 
-	png_write_image(png_ptr, image_info.buffer);
+	for (uint64_t y = 0; y < image_info.height; y++)
+	{
+		png_write_row(png_ptr, image_info.buffer[y]);
+		scratch_rows_done(image_info.buffer, y);
+		if (progress_update)
+			progress_update(y, image_info.height);
+	}
 
 	/* end write */
 	if (setjmp(png_jmpbuf(png_ptr)))
@@ -183,13 +199,7 @@ static int write_png(image_info_t image_info, void (*progress_update)(uint64_t,
 	png_write_end(png_ptr, NULL);
 
 	/* clean up heap allocation */
-	for (uint64_t y = 0; y < image_info.height; y++)
-	{
-		free(image_info.buffer[y]);
-		if (progress_update)
-			progress_update(y, image_info.height);
-	}
-	free(image_info.buffer);
+	scratch_rows_free(image_info.buffer);
 
 cleanup:
 	png_destroy_write_struct(&png_ptr, &info_ptr);
@@ -198,17 +208,106 @@ cf:
 	return errno;
 }
 
+/*
+ * the capacity only depends on the width and height, which are in the
+ * first chunk (IHDR), so there's no need to read any further
+ */
 static uint64_t info_png(image_info_t *image_info)
 {
-	read_png(image_info, NULL);
+	FILE *fp = fopen(image_info->file, "rb");
+	if (!fp)
+		return 0;
+
+	uint8_t header[24]; /* signature, then IHDR's length, type, width and height */
+	size_t l = fread(header, 1, sizeof header, fp);
+	fclose(fp);
+
+	if (l < sizeof header || png_sig_cmp(header, 0, 8) || memcmp(header + 12, "IHDR", 4))
+		return 0;
+	image_info->width = png_get_uint_32(header + 16);
+	image_info->height = png_get_uint_32(header + 20);
 	return HIDE_CAPACITY;
 }
 
+static int preview_png(image_info_t *image_info, uint8_t scale)
+{
+	errno = EXIT_SUCCESS;
+
+	FILE *fp = fopen(image_info->file, "rb");
+	if (!fp)
+		return errno;
+
+	preview_t preview = { NULL, 0, 0, 0, 0, NULL };
+	uint8_t **volatile rows = NULL;
+	volatile uint64_t allocated = 0;
+
+	png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr)
+		goto cf;
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr)
+		goto cleanup;
+
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		errno = EFTYPE;
+		goto cleanup;
+	}
+
+	png_init_io(png_ptr, fp);
+	png_read_info(png_ptr, info_ptr);
+
+	/* whatever it is, have it as 8-bit RGB */
+	png_set_expand(png_ptr);
+	png_set_strip_16(png_ptr);
+	png_set_strip_alpha(png_ptr);
+	png_set_gray_to_rgb(png_ptr);
+	int passes = png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+
+	uint64_t width = png_get_image_width(png_ptr, info_ptr);
+	uint64_t height = png_get_image_height(png_ptr, info_ptr);
+	if (!preview_start(&preview, image_info, width, height, scale))
+		goto cleanup;
+
+	/*
+	 * an interlaced image isn't complete until the last pass, so it has
+	 * to be read in full first; otherwise a row at a time will do
+	 */
+	uint64_t needed = passes > 1 ? height : 1;
+	if (!(rows = calloc(needed, sizeof (uint8_t *))))
+		goto cleanup;
+	for (; allocated < needed; allocated++)
+		if (!(rows[allocated] = malloc(png_get_rowbytes(png_ptr, info_ptr))))
+			goto cleanup;
+	if (passes > 1)
+	{
+		png_read_image(png_ptr, rows);
+		for (uint64_t y = 0; y < height; y++)
+			preview_row(&preview, y, rows[y], 3, false);
+	}
+	else
+		for (uint64_t y = 0; y < height; y++)
+		{
+			png_read_row(png_ptr, rows[0], NULL);
+			preview_row(&preview, y, rows[0], 3, false);
+		}
+
+cleanup:
+	preview_finish(&preview);
+	for (uint64_t y = 0; y < allocated; y++)
+		free(rows[y]);
+	free(rows);
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+cf:
+	fclose(fp);
+
+	return errno;
+}
+
 static void free_png(image_info_t image_info)
 {
-	for (uint64_t y = 0; y < image_info.height; y++)
-		free(image_info.buffer[y]);
-	free(image_info.buffer);
+	scratch_rows_free(image_info.buffer);
 	free(image_info.extra);
 }
 
@@ -221,5 +320,6 @@ extern image_type_t *init(void)
 	png.write = write_png;
 	png.info = info_png;
 	png.free = free_png;
+	png.preview = preview_png;
 	return &png;
 }
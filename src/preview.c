@@ -0,0 +1,95 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hide.h"
+#include "preview.h"
+#include "scratch.h"
+
+extern bool preview_start(preview_t *preview, image_info_t *image_info, uint64_t width, uint64_t height, uint8_t scale)
+{
+	preview->image = image_info;
+	preview->width = width;
+	preview->scale = scale;
+	preview->row = 0;
+	preview->rows = 0;
+
+	image_info->bpp = 3;
+	image_info->width = (width + scale - 1) / scale;
+	image_info->height = 0;
+	if (!(preview->sums = calloc(image_info->width * 3, sizeof (uint32_t))))
+		return false;
+	if (!(image_info->buffer = scratch_rows((height + scale - 1) / scale, image_info->width * image_info->bpp, 0)))
+		return false;
+	image_info->height = (height + scale - 1) / scale;
+	return true;
+}
+
+static void flush_row(preview_t *preview)
+{
+	if (!preview->rows)
+		return;
+	uint8_t *out = preview->image->buffer[preview->row];
+	for (uint64_t x = 0; x < preview->image->width; x++)
+	{
+		/* the last column (and row) may cover fewer pixels */
+		uint64_t columns = preview->width - x * preview->scale;
+		if (columns > preview->scale)
+			columns = preview->scale;
+		uint32_t n = columns * preview->rows;
+		for (int c = 0; c < 3; c++)
+		{
+			out[x * 3 + c] = (preview->sums[x * 3 + c] + n / 2) / n;
+			preview->sums[x * 3 + c] = 0;
+		}
+	}
+	preview->rows = 0;
+}
+
+/*
+ * rows can come in either order (BMP images are stored upside down) but
+ * those of each preview row have to come together
+ */
+extern void preview_row(preview_t *preview, uint64_t y, const uint8_t *pixels, uint16_t bpp, bool bgr)
+{
+	if (y / preview->scale != preview->row)
+	{
+		flush_row(preview);
+		preview->row = y / preview->scale;
+	}
+	for (uint64_t x = 0; x < preview->width; x++, pixels += bpp)
+	{
+		uint32_t *sum = preview->sums + x / preview->scale * 3;
+		sum[0] += pixels[bgr ? 2 : 0];
+		sum[1] += pixels[1];
+		sum[2] += pixels[bgr ? 0 : 2];
+	}
+	preview->rows++;
+}
+
+extern void preview_finish(preview_t *preview)
+{
+	flush_row(preview);
+	free(preview->sums);
+	preview->sums = NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _HIDE_PREVIEW_H_
+#define _HIDE_PREVIEW_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hide.h"
+
+/*
+ * for formats which can only be decoded at full size: the preview is
+ * built up as each row is read, every pixel of it the average of those
+ * it covers, so the whole image is never held at full size
+ */
+typedef struct
+{
+	image_info_t *image;        /* whose buffer the preview is in */
+	uint64_t width;             /* of the full size image */
+	uint8_t scale;
+	uint64_t row;               /* of the preview, being added to */
+	uint32_t rows;              /* how many image rows it has had so far */
+	uint32_t *sums;
+}
+preview_t;
+
+extern bool preview_start(preview_t *, image_info_t *, uint64_t, uint64_t, uint8_t);
+extern void preview_row(preview_t *, uint64_t, const uint8_t *, uint16_t, bool);
+extern void preview_finish(preview_t *);
+
+#endif
@@ -0,0 +1,426 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* project includes */
+
+#include "hide.h"
+#include "job.h"
+#include "scan.h"
+
+#define SCAN_HEADER (sizeof HIDE_SCAN_MAGIC - 1 + 2 * sizeof (uint32_t))
+
+typedef struct
+{
+	char *path;
+	scan_record_t record;
+	bool indexed;        /* and unchanged since, so there's no need to size it up */
+	int error;
+}
+scan_entry_t;
+
+typedef struct
+{
+	plugins_t plugins;
+	scan_entry_t *entries;   /* every file, in the order they were found */
+	size_t total;
+	size_t space;
+	scan_entry_t **probes;   /* those which have to be sized up */
+	size_t probe_total;
+	size_t next;             /* next probe to be claimed by a worker */
+	image_options_t options;
+	void *map;               /* the index as it was */
+	size_t map_length;
+	const scan_record_t *index;
+	size_t indexed;
+	uint8_t *seen;           /* a flag for each record in the index */
+}
+scan_t;
+
+static int by_file(const void *a, const void *b)
+{
+	const scan_record_t *x = a;
+	const scan_record_t *y = b;
+	if (x->device != y->device)
+		return x->device < y->device ? -1 : 1;
+	return x->inode < y->inode ? -1 : x->inode > y->inode;
+}
+
+static char *index_default(void)
+{
+	char *cache = NULL;
+	char *index = NULL;
+	if (getenv("XDG_CACHE_HOME") && *getenv("XDG_CACHE_HOME"))
+		cache = strdup(getenv("XDG_CACHE_HOME"));
+	else if (getenv("HOME") && asprintf(&cache, "%s/.cache", getenv("HOME")) < 0)
+		cache = NULL;
+	if (!cache)
+		return NULL;
+	mkdir(cache, S_IRWXU);
+	if (asprintf(&index, "%s/%s", cache, HIDE_SCAN_INDEX) < 0)
+		index = NULL;
+	free(cache);
+	return index;
+}
+
+/*
+ * the index is used where it is, mapped into memory; one which can't be
+ * read (or isn't an index at all) is treated as being empty
+ */
+static void index_load(scan_t *scan, const char *index)
+{
+	int f = open(index, O_RDONLY);
+	if (f < 0)
+		return;
+	struct stat s;
+	uint8_t *map = MAP_FAILED;
+	if (!fstat(f, &s) && (uint64_t)s.st_size >= SCAN_HEADER && (s.st_size - SCAN_HEADER) % sizeof (scan_record_t) == 0)
+		map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+	close(f);
+	if (map == MAP_FAILED)
+		return;
+
+	uint32_t version;
+	uint32_t size;
+	memcpy(&version, map + sizeof HIDE_SCAN_MAGIC - 1, sizeof version);
+	memcpy(&size, map + sizeof HIDE_SCAN_MAGIC - 1 + sizeof version, sizeof size);
+	if (memcmp(map, HIDE_SCAN_MAGIC, sizeof HIDE_SCAN_MAGIC - 1) || version != HIDE_SCAN_VERSION || size != sizeof (scan_record_t))
+	{
+		munmap(map, s.st_size);
+		return;
+	}
+	scan->map = map;
+	scan->map_length = s.st_size;
+	scan->index = (const scan_record_t *)(map + SCAN_HEADER);
+	scan->indexed = (s.st_size - SCAN_HEADER) / sizeof (scan_record_t);
+	scan->seen = calloc(scan->indexed ? scan->indexed : 1, sizeof (uint8_t));
+	if (!scan->seen)
+		scan->indexed = 0;
+	return;
+}
+
+/*
+ * the new index has everything that was scanned, along with whatever was
+ * in the old one that wasn't (from elsewhere); it's written alongside
+ * and then moved over the old one, so a scan which is interrupted never
+ * leaves half an index
+ */
+static int index_save(const scan_t *scan, const char *index)
+{
+	size_t count = 0;
+	scan_record_t *records = malloc((scan->total + scan->indexed + 1) * sizeof (scan_record_t));
+	if (!records)
+		return errno;
+	for (size_t i = 0; i < scan->total; i++)
+		if (!scan->entries[i].error)
+			records[count++] = scan->entries[i].record;
+	for (size_t i = 0; i < scan->indexed; i++)
+		if (!scan->seen[i])
+			records[count++] = scan->index[i];
+	qsort(records, count, sizeof (scan_record_t), by_file);
+
+	char *temporary = NULL;
+	int f = -1;
+	FILE *out = NULL;
+	errno = EXIT_SUCCESS;
+	if (asprintf(&temporary, "%s.XXXXXX", index) < 0)
+		temporary = NULL;
+	else if ((f = mkstemp(temporary)) >= 0 && (out = fdopen(f, "wb")))
+	{
+		uint32_t version = HIDE_SCAN_VERSION;
+		uint32_t size = sizeof (scan_record_t);
+		fwrite(HIDE_SCAN_MAGIC, sizeof HIDE_SCAN_MAGIC - 1, 1, out);
+		fwrite(&version, sizeof version, 1, out);
+		fwrite(&size, sizeof size, 1, out);
+		/* a file found twice over (by a hard link, say) is only kept once */
+		for (size_t i = 0; i < count; i++)
+			if (!i || by_file(&records[i - 1], &records[i]))
+				fwrite(&records[i], sizeof (scan_record_t), 1, out);
+		bool failed = ferror(out);
+		if (fclose(out) || failed || rename(temporary, index))
+		{
+			if (!errno)
+				errno = EIO;
+			unlink(temporary);
+		}
+		else
+			errno = EXIT_SUCCESS;
+	}
+	else if (f >= 0)
+	{
+		close(f);
+		unlink(temporary);
+	}
+	int e = errno;
+	free(temporary);
+	free(records);
+	return errno = e;
+}
+
+static int not_hidden(const struct dirent *d)
+{
+	return d->d_name[0] != '.';
+}
+
+static void add_file(scan_t *scan, char *path, const struct stat *s)
+{
+	if (scan->total == scan->space)
+	{
+		scan_entry_t *entries = realloc(scan->entries, (scan->space = scan->space ? scan->space * 2 : 1024) * sizeof (scan_entry_t));
+		if (!entries)
+		{
+			free(path);
+			return;
+		}
+		scan->entries = entries;
+	}
+	scan_entry_t *entry = &scan->entries[scan->total++];
+	memset(entry, 0x00, sizeof (scan_entry_t));
+	entry->path = path;
+	entry->record.device = s->st_dev;
+	entry->record.inode = s->st_ino;
+	entry->record.size = s->st_size;
+	entry->record.mtime = s->st_mtim.tv_sec;
+	entry->record.mtime_ns = s->st_mtim.tv_nsec;
+
+	const scan_record_t *r = scan->indexed ? bsearch(&entry->record, scan->index, scan->indexed, sizeof (scan_record_t), by_file) : NULL;
+	if (!r)
+		return;
+	scan->seen[r - scan->index] = true;
+	/* an estimate will only do if that's what was asked for this time */
+	if (r->size == entry->record.size && r->mtime == entry->record.mtime && r->mtime_ns == entry->record.mtime_ns && (!r->margin || scan->options.estimate))
+	{
+		entry->record = *r;
+		entry->indexed = true;
+	}
+	return;
+}
+
+/*
+ * every file in the tree, in order; hidden files (and directories) are
+ * skipped, as are symbolic links to directories
+ */
+static void walk(scan_t *scan, const char *directory)
+{
+	struct dirent **eps;
+	int n = scandir(directory, &eps, not_hidden, alphasort);
+	if (n < 0)
+	{
+		fprintf(stderr, "Could not read directory %s\n", directory);
+		return;
+	}
+	for (int i = 0; i < n; i++)
+	{
+		char *path = NULL;
+		struct stat s;
+		if (asprintf(&path, "%s/%s", directory, eps[i]->d_name) < 0)
+			path = NULL;
+		else if (eps[i]->d_type == DT_DIR || (eps[i]->d_type == DT_UNKNOWN && !lstat(path, &s) && S_ISDIR(s.st_mode)))
+			walk(scan, path);
+		else if (!stat(path, &s) && S_ISREG(s.st_mode))
+		{
+			add_file(scan, path, &s);
+			path = NULL;
+		}
+		free(path);
+		free(eps[i]);
+	}
+	free(eps);
+	return;
+}
+
+/*
+ * workers claim files in turn until there are none left, as in a batch;
+ * a file that isn't an image is noted as such, but one which couldn't be
+ * read is left out of the index, to be tried again next time
+ */
+static void *scan_worker(void *arg)
+{
+	scan_t *scan = arg;
+
+	for (size_t i; (i = __sync_fetch_and_add(&scan->next, 1)) < scan->probe_total; )
+	{
+		scan_entry_t *entry = scan->probes[i];
+		job_t job;
+		memset(&job, 0x00, sizeof job);
+		job.files.image_in = entry->path;
+		job_run_loaded(&scan->plugins, &job, false, scan->options);
+		if (!job.error)
+		{
+			entry->record.capacity = job.capacity;
+			entry->record.margin = job.margin;
+			entry->record.width = job.width;
+			entry->record.height = job.height;
+			strncpy(entry->record.format, job.format, sizeof entry->record.format - 1);
+		}
+		else if (job.error != EFTYPE)
+			entry->error = job.error;
+		free(job.why);
+	}
+	return NULL;
+}
+
+static void print_csv_field(const char *s)
+{
+	if (!strpbrk(s, ",\"\r\n"))
+	{
+		fputs(s, stdout);
+		return;
+	}
+	putchar('"');
+	for (; *s; s++)
+	{
+		if (*s == '"')
+			putchar('"');
+		putchar(*s);
+	}
+	putchar('"');
+	return;
+}
+
+extern int scan(char **paths, int count, char *index, bool json, image_options_t options, uint32_t workers)
+{
+	scan_t scan;
+	memset(&scan, 0x00, sizeof scan);
+	scan.options = options;
+	if (!scan.options.threads)
+		scan.options.threads = 1;
+
+	char *fallback = index ? NULL : index_default();
+	if (!index)
+		index = fallback;
+	if (index)
+		index_load(&scan, index);
+
+	for (int i = 0; i < count; i++)
+	{
+		/* trailing slashes would otherwise be doubled up in every path */
+		for (size_t l = strlen(paths[i]); l > 1 && paths[i][l - 1] == '/'; l--)
+			paths[i][l - 1] = '\0';
+		struct stat s;
+		if (stat(paths[i], &s) < 0)
+			fprintf(stderr, "Could not read %s\n", paths[i]);
+		else if (S_ISDIR(s.st_mode))
+			walk(&scan, paths[i]);
+		else if (S_ISREG(s.st_mode))
+			add_file(&scan, strdup(paths[i]), &s);
+	}
+
+	if (!(scan.probes = calloc(scan.total ? scan.total : 1, sizeof (scan_entry_t *))))
+		goto done;
+	for (size_t i = 0; i < scan.total; i++)
+		if (!scan.entries[i].indexed)
+			scan.probes[scan.probe_total++] = &scan.entries[i];
+
+	if (scan.probe_total)
+	{
+		if (!plugins_load(DIR_LIBRARY, &scan.plugins))
+		{
+			fprintf(stderr, "Could not find any hide image libraries!\n");
+			errno = ENOENT;
+			goto done;
+		}
+		if (!workers)
+			workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (workers > scan.probe_total)
+			workers = scan.probe_total;
+		pthread_t *t = calloc(workers, sizeof (pthread_t));
+		uint32_t started = 0;
+		for (; t && started < workers; started++)
+			if (pthread_create(&t[started], NULL, scan_worker, &scan))
+				break;
+		if (!started)
+			scan_worker(&scan);
+		for (uint32_t i = 0; i < started; i++)
+			pthread_join(t[i], NULL);
+		free(t);
+	}
+
+	if (index && index_save(&scan, index))
+		fprintf(stderr, "Could not update the index %s: %s\n", index, strerror(errno));
+
+	/*
+	 * report on every image, in the order they were found
+	 */
+	if (!json)
+		printf("path,format,width,height,capacity,margin\n");
+	size_t images = 0;
+	size_t failed = 0;
+	for (size_t i = 0; i < scan.total; i++)
+	{
+		const scan_entry_t *entry = &scan.entries[i];
+		const scan_record_t *r = &entry->record;
+		if (entry->error)
+		{
+			failed++;
+			fprintf(stderr, "Could not size up %s: %s\n", entry->path, strerror(entry->error));
+			continue;
+		}
+		if (!*r->format)
+			continue;
+		images++;
+		if (json)
+		{
+			printf("{ \"path\": ");
+			job_print_json_string(stdout, entry->path);
+			printf(", \"format\": \"%s\", \"width\": %" PRIu64 ", \"height\": %" PRIu64 ", \"capacity\": %" PRIu64 ", \"margin\": %" PRIu64 " }\n",
+					r->format, r->width, r->height, r->capacity, r->margin);
+		}
+		else
+		{
+			print_csv_field(entry->path);
+			printf(",%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", r->format, r->width, r->height, r->capacity, r->margin);
+		}
+	}
+	fprintf(stderr, "%zu images in %zu files (%zu sized up, %zu from the index", images, scan.total, scan.probe_total, scan.total - scan.probe_total);
+	if (failed)
+		fprintf(stderr, "; %zu couldn't be read", failed);
+	fprintf(stderr, ")\n");
+	errno = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+done:
+	plugins_unload(&scan.plugins);
+	for (size_t i = 0; i < scan.total; i++)
+	{
+		free(scan.entries[i].path);
+	}
+	free(scan.entries);
+	free(scan.probes);
+	free(scan.seen);
+	if (scan.map)
+		munmap(scan.map, scan.map_length);
+	free(fallback);
+	return errno;
+}
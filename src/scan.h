@@ -0,0 +1,60 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hide.h"
+
+/*
+ * what hide --scan finds is kept in an index, so that the next scan only
+ * has to size up the files which have changed since
+ *
+ * the index is the magic and its version, then a record for each file
+ * (images and otherwise), sorted by device and then inode; a record is
+ * only used if the file's size and modification time still match. It's
+ * a cache, local to this machine, so everything is in its byte order
+ */
+
+#define HIDE_SCAN_MAGIC   "hide-idx"
+#define HIDE_SCAN_VERSION 1
+#define HIDE_SCAN_INDEX   "hide.index" /* in $XDG_CACHE_HOME, or ~/.cache */
+
+typedef struct
+{
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	int64_t mtime;      /* seconds */
+	uint64_t mtime_ns;  /* and nanoseconds */
+	uint64_t capacity;
+	uint64_t margin;    /* if the capacity was only estimated */
+	uint64_t width;
+	uint64_t height;
+	char format[8];     /* empty if the file isn't an image */
+}
+scan_record_t;
+
+extern int scan(char **paths, int count, char *index, bool json, image_options_t options, uint32_t workers);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "hide.h"
+#include "scratch.h"
+
+/*
+ * kept just before each block: the size of its mapping (0 when it's on
+ * the heap), how much of it may be resident at once, and the length of
+ * its rows (if it has rows)
+ */
+typedef struct
+{
+	uint64_t mapped;
+	uint64_t band;
+	uint64_t row;
+	uint64_t reserved;          /* keeps heap blocks 16-byte aligned */
+}
+scratch_t;
+
+static void *spill(uint64_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	char *path = NULL;
+	if (asprintf(&path, "%s/hide-scratch-XXXXXX", dir && *dir ? dir : "/tmp") < 0)
+		return NULL;
+	int fd = mkstemp(path);
+	if (fd >= 0)
+		unlink(path);
+	free(path);
+	if (fd < 0)
+		return NULL;
+	void *map = MAP_FAILED;
+	if (!ftruncate(fd, size))
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+extern void *scratch_alloc(uint64_t size, uint64_t budget)
+{
+	if (budget && size > budget / 2)
+	{
+		/* the header is at the end of a page of its own, so the block is page aligned */
+		uint64_t page = sysconf(_SC_PAGESIZE);
+		int e = errno;
+		uint8_t *map = spill(size + page);
+		if (map)
+		{
+			madvise(map, size + page, MADV_SEQUENTIAL);
+			scratch_t *s = (scratch_t *)(map + page) - 1;
+			s->mapped = size + page;
+			s->band = budget / 4 > page ? budget / 4 : page;
+			s->row = 0;
+			return map + page;
+		}
+		/* no worse off than without a budget, if it can't be spilled */
+		errno = e;
+	}
+	scratch_t *s = calloc(1, sizeof (scratch_t) + size);
+	return s ? s + 1 : NULL;
+}
+
+extern void scratch_free(void *block)
+{
+	if (!block)
+		return;
+	scratch_t *s = (scratch_t *)block - 1;
+	if (s->mapped)
+		munmap((uint8_t *)block - sysconf(_SC_PAGESIZE), s->mapped);
+	else
+		free(s);
+	return;
+}
+
+/*
+ * the pages are dropped from memory, but as the mapping is of a file
+ * they're kept (and read back if they're needed again), unlike memory
+ * from the heap, which is left alone
+ */
+extern void scratch_done(void *block, uint64_t offset, uint64_t length)
+{
+	scratch_t *s = (scratch_t *)block - 1;
+	if (!s->mapped)
+		return;
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t start = offset & ~(page - 1);
+	uint64_t end = (offset + length + page - 1) & ~(page - 1);
+	if (end > s->mapped - page)
+		end = s->mapped - page;
+	if (end > start)
+		madvise((uint8_t *)block + start, end - start, MADV_DONTNEED);
+	return;
+}
+
+/*
+ * the block is kept before the first row, for it to be freed (and its
+ * bands released) by
+ */
+extern uint8_t **scratch_rows(uint64_t height, uint64_t length, uint64_t budget)
+{
+	uint8_t **rows = calloc(height + 1, sizeof (uint8_t *));
+	if (!rows)
+		return NULL;
+	uint8_t *block = scratch_alloc(height * length, budget);
+	if (!block)
+	{
+		free(rows);
+		errno = ENOMEM;
+		return NULL;
+	}
+	((scratch_t *)block - 1)->row = length;
+	rows[0] = block;
+	for (uint64_t y = 0; y < height; y++)
+		rows[y + 1] = block + y * length;
+	return rows + 1;
+}
+
+extern void scratch_rows_free(uint8_t **rows)
+{
+	if (!rows)
+		return;
+	scratch_free(rows[-1]);
+	free(rows - 1);
+	return;
+}
+
+/*
+ * once the last row of a band is done with, the whole band is
+ */
+extern void scratch_rows_done(uint8_t **rows, uint64_t y)
+{
+	scratch_t *s = (scratch_t *)rows[-1] - 1;
+	if (!s->mapped || !s->row)
+		return;
+	uint64_t band = s->band / s->row ? s->band / s->row : 1;
+	if ((y + 1) % band == 0)
+		scratch_done(rows[-1], (y + 1 - band) * s->row, band * s->row);
+	return;
+}
@@ -0,0 +1,54 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _HIDE_SCRATCH_H_
+#define _HIDE_SCRATCH_H_
+
+#include <stdint.h>
+
+#include "hide.h"
+
+/*
+ * memory for the largest parts of an image (its rows, or its JPEG
+ * coefficients) which may well be larger than the memory there is:
+ * within the budget it comes from the heap as ever, beyond it from a
+ * file-backed mapping in $TMPDIR (unlinked as soon as it's made), which
+ * the kernel writes out and reads back as needed instead of pushing
+ * everything else into swap; a budget of 0 is no limit
+ *
+ * anything over half the budget is spilled, and is worked through in
+ * bands of a quarter of it, each released once done with
+ */
+#define SCRATCH_BUDGET(image_info) ((image_info)->data ? (image_info)->data->options.max_memory : 0)
+
+extern void *scratch_alloc(uint64_t size, uint64_t budget);
+extern void scratch_free(void *block);
+extern void scratch_done(void *block, uint64_t offset, uint64_t length);
+
+/*
+ * an image's rows, all in one block (each row length bytes); image
+ * buffers are always allocated this way, as hide releases each band of
+ * rows as it goes too
+ */
+extern uint8_t **scratch_rows(uint64_t height, uint64_t length, uint64_t budget);
+extern void scratch_rows_free(uint8_t **rows);
+extern void scratch_rows_done(uint8_t **rows, uint64_t y);
+
+#endif
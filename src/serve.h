@@ -0,0 +1,55 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+/*
+ * requests to hide -l are made over a SOCK_SEQPACKET Unix domain socket,
+ * each in a single message, and each answered with a single message;
+ * a client may make as many requests over one connection as it likes
+ *
+ * a request is the action, then its flags, then the files it needs as
+ * NUL terminated paths (image, document and output to hide; image and
+ * recovered file to find; only the image for its capacity); an empty
+ * path takes the next of the file descriptors sent with the request
+ * (SCM_RIGHTS) instead, which may be a file or shared memory (memfd,
+ * shm_open); the document and recovered file may be pipes too, but not
+ * the images
+ *
+ * the response is the error (0 for success) as a 32-bit integer, then
+ * the capacity and its margin (only for capacity requests) as 64-bit
+ * integers, all in network byte order; then, if the request failed,
+ * what went wrong, NUL terminated
+ */
+
+#define HIDE_SERVE_HIDE     'h'
+#define HIDE_SERVE_FIND     'f'
+#define HIDE_SERVE_CAPACITY 'c'
+
+#define HIDE_SERVE_FILL     0x01 /*!< Fill the image to capacity */
+#define HIDE_SERVE_ESTIMATE 0x02 /*!< Estimate the capacity */
+
+#define HIDE_SERVE_FILES    3    /*!< Most files (so descriptors) in a request */
+#define HIDE_SERVE_MAX      4096 /*!< Longest request or response */
+
+#define HIDE_SERVE_HEADER   (sizeof (uint32_t) + 2 * sizeof (uint64_t))
+
+#endif
@@ -0,0 +1,575 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <locale.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+/* submodule includes */
+
+#include "common.h"
+
+/* project includes */
+
+#include "hide.h"
+#include "job.h"
+#include "shard.h"
+
+#define SHARD_COPY 0x100000 /* bytes copied at a time when joining */
+
+typedef struct
+{
+	uint32_t index;
+	uint32_t count;
+	uint64_t set;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t total;
+}
+shard_t;
+
+typedef struct
+{
+	plugins_t plugins;
+	job_t *jobs;
+	shard_t *shards;          /* one for each job */
+	size_t total;
+	size_t next;              /* next job to be claimed by a worker */
+	bool fill;
+	image_options_t options;
+	const payload_t *document; /* being split */
+	int output;                /* being joined */
+}
+shards_t;
+
+static void shard_encode(const shard_t *shard, uint8_t *header)
+{
+	uint32_t index = htonl(shard->index);
+	uint32_t count = htonl(shard->count);
+	uint64_t fields[4] = { htonll(shard->set), htonll(shard->offset), htonll(shard->length), htonll(shard->total) };
+	memcpy(header, HIDE_SHARD_MAGIC, 4);
+	memcpy(header + 4, &index, sizeof index);
+	memcpy(header + 4 + sizeof index, &count, sizeof count);
+	memcpy(header + 4 + sizeof index + sizeof count, fields, sizeof fields);
+	return;
+}
+
+static bool shard_decode(const uint8_t *header, shard_t *shard)
+{
+	if (memcmp(header, HIDE_SHARD_MAGIC, 4))
+		return false;
+	uint32_t index;
+	uint32_t count;
+	uint64_t fields[4];
+	memcpy(&index, header + 4, sizeof index);
+	memcpy(&count, header + 4 + sizeof index, sizeof count);
+	memcpy(fields, header + 4 + sizeof index + sizeof count, sizeof fields);
+	shard->index = ntohl(index);
+	shard->count = ntohl(count);
+	shard->set = ntohll(fields[0]);
+	shard->offset = ntohll(fields[1]);
+	shard->length = ntohll(fields[2]);
+	shard->total = ntohll(fields[3]);
+	return shard->index < shard->count && shard->offset <= shard->total && shard->length <= shard->total - shard->offset;
+}
+
+static int write_fully(int fd, const uint8_t *data, uint64_t length)
+{
+	for (uint64_t done = 0; done < length; )
+	{
+		ssize_t w = write(fd, data + done, length - done);
+		if (w < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		done += w;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * workers claim jobs in turn until there are none left, as in a batch;
+ * each job has a single thread unless told otherwise
+ */
+static void run_workers(void *(*worker)(void *), shards_t *shards, uint32_t workers)
+{
+	shards->next = 0;
+	if (!workers)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > shards->total)
+		workers = shards->total;
+
+	pthread_t *t = calloc(workers ? workers : 1, sizeof (pthread_t));
+	uint32_t started = 0;
+	for (; t && started < workers; started++)
+		if (pthread_create(&t[started], NULL, worker, shards))
+			break;
+	if (!started)
+		worker(shards);
+	for (uint32_t i = 0; i < started; i++)
+		pthread_join(t[i], NULL);
+	free(t);
+	return;
+}
+
+static void *size_worker(void *arg)
+{
+	shards_t *shards = arg;
+
+	for (size_t i; (i = __sync_fetch_and_add(&shards->next, 1)) < shards->total; )
+		job_run_loaded(&shards->plugins, &shards->jobs[i], false, shards->options);
+	return NULL;
+}
+
+/*
+ * each piece is given to its job as anonymous memory: its header and
+ * then its share of the document
+ */
+static void *split_worker(void *arg)
+{
+	shards_t *shards = arg;
+
+	for (size_t i; (i = __sync_fetch_and_add(&shards->next, 1)) < shards->total; )
+	{
+		job_t *job = &shards->jobs[i];
+		const shard_t *shard = &shards->shards[i];
+		uint8_t header[HIDE_SHARD_HEADER];
+		shard_encode(shard, header);
+
+		int fd = memory_open(NULL, 0, &job->files.data_file);
+		if (fd < 0
+				|| (errno = write_fully(fd, header, sizeof header))
+				|| (errno = write_fully(fd, shards->document->data + shard->offset, shard->length))
+				|| lseek(fd, 0, SEEK_SET) < 0)
+			job->error = job_fail(&job->why, "Could not ready piece %" PRIu32 " for %s", shard->index, job->files.image_in);
+		else
+			job_run_loaded(&shards->plugins, job, shards->fill, shards->options);
+		if (fd >= 0)
+			close(fd);
+		free(job->files.data_file);
+		job->files.data_file = NULL;
+	}
+	return NULL;
+}
+
+/*
+ * pieces are found into anonymous memory and then copied to their place
+ * in the recovered file, so they can be found in any order
+ */
+static void *join_worker(void *arg)
+{
+	shards_t *shards = arg;
+	uint8_t *buffer = malloc(SHARD_COPY);
+
+	for (size_t i; (i = __sync_fetch_and_add(&shards->next, 1)) < shards->total; )
+	{
+		job_t *job = &shards->jobs[i];
+		shard_t *shard = &shards->shards[i];
+		uint8_t header[HIDE_SHARD_HEADER];
+
+		int fd = memory_open(NULL, 0, &job->files.data_file);
+		if (fd < 0 || !buffer)
+			job->error = job_fail(&job->why, "Out of memory");
+		else
+		{
+			job_run_loaded(&shards->plugins, job, shards->fill, shards->options);
+			struct stat s;
+			if (!job->error && (fstat(fd, &s) < 0 || pread(fd, header, sizeof header, 0) != sizeof header || !shard_decode(header, shard) || shard->length > (uint64_t)s.st_size - sizeof header))
+			{
+				errno = EINVAL;
+				job->error = job_fail(&job->why, "No piece of a split document found");
+			}
+			else if (!job->error)
+				for (uint64_t done = 0; done < shard->length; )
+				{
+					size_t l = shard->length - done < SHARD_COPY ? shard->length - done : SHARD_COPY;
+					ssize_t r = pread(fd, buffer, l, sizeof header + done);
+					if (r <= 0 || pwrite(shards->output, buffer, r, shard->offset + done) != r)
+					{
+						if (!r)
+							errno = EIO;
+						job->error = job_fail(&job->why, "Could not write piece %" PRIu32 " to the recovered file", shard->index);
+						break;
+					}
+					done += r;
+				}
+		}
+		if (fd >= 0)
+			close(fd);
+		free(job->files.data_file);
+		job->files.data_file = NULL;
+	}
+	free(buffer);
+	return NULL;
+}
+
+static void report(const shards_t *shards, size_t *failed)
+{
+	for (size_t i = 0; i < shards->total; i++)
+	{
+		const job_t *job = &shards->jobs[i];
+		if (!job->error)
+			continue;
+		(*failed)++;
+		if (job->error == EFTYPE || job->error == EINVAL)
+			printf("failed\t%s\t%s\n", job->files.image_in, job->why ? job->why : "Failed");
+		else
+			printf("failed\t%s\t%s: %s\n", job->files.image_in, job->why ? job->why : "Failed", strerror(job->error));
+	}
+	return;
+}
+
+static void shards_free(shards_t *shards)
+{
+	for (size_t i = 0; i < shards->total; i++)
+	{
+		free(shards->jobs[i].files.image_out);
+		free(shards->jobs[i].why);
+	}
+	free(shards->jobs);
+	free(shards->shards);
+	shards->jobs = NULL;
+	shards->shards = NULL;
+	shards->total = 0;
+	return;
+}
+
+typedef struct
+{
+	char *image;
+	uint64_t room; /* the image's capacity, less a piece's header */
+}
+carrier_t;
+
+/*
+ * no plugin hides more than a byte in each pixel, so a capacity greater
+ * than that can't be right, and the piece given to the image would be
+ * lost; such an image isn't used
+ */
+static bool credible(const job_t *job)
+{
+	return job->width && job->height && job->capacity <= job->width * job->height;
+}
+
+static int by_room(const void *a, const void *b)
+{
+	const carrier_t *x = a;
+	const carrier_t *y = b;
+	return x->room < y->room ? 1 : x->room > y->room ? -1 : 0;
+}
+
+/*
+ * as few images as will hold the document: the largest first, with the
+ * last of them swapped for the smallest which can still make up the
+ * difference; returns how many were needed
+ */
+static size_t choose_carriers(carrier_t *carriers, size_t count, uint64_t size)
+{
+	if (!count)
+		return 0;
+	qsort(carriers, count, sizeof (carrier_t), by_room);
+
+	uint64_t room = 0;
+	size_t chosen = 0;
+	while (chosen < count && room < size)
+		room += carriers[chosen++].room;
+	if (room < size)
+		return 0;
+	if (!chosen)
+		chosen = 1; /* even an empty document needs somewhere to go */
+
+	uint64_t rest = room - carriers[chosen - 1].room;
+	for (size_t j = count - 1; j >= chosen; j--)
+		if (rest + carriers[j].room >= size)
+		{
+			carrier_t c = carriers[chosen - 1];
+			carriers[chosen - 1] = carriers[j];
+			carriers[j] = c;
+			break;
+		}
+	return chosen;
+}
+
+static uint64_t random_set(void)
+{
+	uint64_t set = 0;
+	int f = open("/dev/urandom", O_RDONLY);
+	if (f < 0 || read(f, &set, sizeof set) != sizeof set)
+		set = (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid() ^ (uint64_t)(uintptr_t)&set;
+	if (f >= 0)
+		close(f);
+	return set;
+}
+
+extern int shard_split(char *document, char *directory, char **images, int count, bool fill, image_options_t options, uint32_t workers)
+{
+	shards_t shards = { { NULL, NULL, 0 }, NULL, NULL, 0, 0, fill, options, NULL, -1 };
+	payload_t payload = { NULL, 0, false };
+	carrier_t *carriers = NULL;
+	char *why = NULL;
+
+	struct stat s;
+	if (stat(directory, &s) < 0 || !S_ISDIR(s.st_mode))
+	{
+		fprintf(stderr, "Could not find directory %s\n", directory);
+		return errno = ENOTDIR;
+	}
+	if (load_payload(document, &payload, &why))
+	{
+		int e = errno;
+		fprintf(stderr, "%s\n", why ? why : "Could not read document");
+		free(why);
+		return errno = e;
+	}
+	shards.document = &payload;
+	if (!plugins_load(DIR_LIBRARY, &shards.plugins))
+	{
+		fprintf(stderr, "Could not find any hide image libraries!\n");
+		errno = ENOENT;
+		goto done;
+	}
+	if (!shards.options.threads)
+		shards.options.threads = 1;
+	setlocale(LC_NUMERIC, "");
+
+	/*
+	 * size up every image (in full, as the pieces have to fit exactly)
+	 * and then decide which are to be used
+	 */
+	if (!(shards.jobs = calloc(count, sizeof (job_t))) || !(carriers = calloc(count, sizeof (carrier_t))))
+		goto done;
+	shards.total = count;
+	for (int i = 0; i < count; i++)
+		shards.jobs[i].files.image_in = images[i];
+	shards.options.estimate = false;
+	run_workers(size_worker, &shards, workers);
+	shards.options.estimate = options.estimate;
+
+	size_t usable = 0;
+	for (int i = 0; i < count; i++)
+		if (shards.jobs[i].error)
+			fprintf(stderr, "Skipping %s: %s\n", images[i], shards.jobs[i].why ? shards.jobs[i].why : strerror(shards.jobs[i].error));
+		else if (!credible(&shards.jobs[i]))
+			fprintf(stderr, "Skipping %s: its capacity (%'" PRIu64 " bytes) is more than it could hold\n", images[i], shards.jobs[i].capacity);
+		else if (shards.jobs[i].capacity > HIDE_SHARD_HEADER)
+		{
+			carriers[usable].image = images[i];
+			carriers[usable++].room = shards.jobs[i].capacity - HIDE_SHARD_HEADER;
+		}
+	shards_free(&shards);
+
+	size_t chosen = choose_carriers(carriers, usable, payload.size);
+	if (!chosen)
+	{
+		uint64_t room = 0;
+		for (size_t i = 0; i < usable; i++)
+			room += carriers[i].room;
+		fprintf(stderr, "Too much data to hide: %'" PRIu64 " bytes, but there's only room for %'" PRIu64 " bytes in %zu images\n", payload.size, room, usable);
+		errno = ENOSPC;
+		goto done;
+	}
+
+	/*
+	 * each piece is in proportion to its image, so the images are all as
+	 * full as each other, and take about as long as each other to hide in
+	 */
+	if (!(shards.jobs = calloc(chosen, sizeof (job_t))) || !(shards.shards = calloc(chosen, sizeof (shard_t))))
+		goto done;
+	shards.total = chosen;
+	uint64_t room = 0;
+	for (size_t i = 0; i < chosen; i++)
+		room += carriers[i].room;
+	uint64_t given = 0;
+	for (size_t i = 0; i < chosen; i++)
+	{
+		shards.shards[i].length = room ? (uint64_t)((long double)payload.size * carriers[i].room / room) : 0;
+		if (shards.shards[i].length > carriers[i].room)
+			shards.shards[i].length = carriers[i].room;
+		given += shards.shards[i].length;
+	}
+	for (size_t i = 0; i < chosen && given < payload.size; i++)
+	{
+		uint64_t more = carriers[i].room - shards.shards[i].length;
+		if (more > payload.size - given)
+			more = payload.size - given;
+		shards.shards[i].length += more;
+		given += more;
+	}
+	uint64_t set = random_set();
+	uint64_t offset = 0;
+	for (size_t i = 0; i < chosen; offset += shards.shards[i++].length)
+	{
+		shards.shards[i].index = i;
+		shards.shards[i].count = chosen;
+		shards.shards[i].set = set;
+		shards.shards[i].offset = offset;
+		shards.shards[i].total = payload.size;
+
+		job_t *job = &shards.jobs[i];
+		job->files.image_in = carriers[i].image;
+		char *name = strrchr(carriers[i].image, '/');
+		asprintf(&job->files.image_out, "%s/%s", directory, name ? name + 1 : carriers[i].image);
+		for (size_t j = 0; j < i; j++)
+			if (job->files.image_out && !strcmp(job->files.image_out, shards.jobs[j].files.image_out))
+			{
+				fprintf(stderr, "Both %s and %s would be written to %s\n", shards.jobs[j].files.image_in, job->files.image_in, job->files.image_out);
+				errno = EEXIST;
+				goto done;
+			}
+	}
+
+	run_workers(split_worker, &shards, workers);
+
+	size_t failed = 0;
+	report(&shards, &failed);
+	for (size_t i = 0; i < shards.total; i++)
+		if (!shards.jobs[i].error)
+			printf("ok\t%s\t%s\t%'" PRIu64 " bytes\n", shards.jobs[i].files.image_in, shards.jobs[i].files.image_out, shards.shards[i].length);
+	if (failed)
+		fprintf(stderr, "%zu of %zu pieces failed\n", failed, shards.total);
+	errno = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+done:
+	plugins_unload(&shards.plugins);
+	shards_free(&shards);
+	free(carriers);
+	unload_payload(&payload);
+	return errno;
+}
+
+extern int shard_join(char *file, char **images, int count, bool fill, image_options_t options, uint32_t workers)
+{
+	shards_t shards = { { NULL, NULL, 0 }, NULL, NULL, 0, 0, fill, options, NULL, -1 };
+
+	if (!strcmp(file, HIDE_STREAM))
+	{
+		fprintf(stderr, "The pieces are found in any order, so can't be joined into a stream\n");
+		return errno = ESPIPE;
+	}
+	if (!plugins_load(DIR_LIBRARY, &shards.plugins))
+	{
+		fprintf(stderr, "Could not find any hide image libraries!\n");
+		return errno = ENOENT;
+	}
+	if ((shards.output = open(file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)) < 0)
+	{
+		int e = errno;
+		fprintf(stderr, "Could not open %s\n", file);
+		plugins_unload(&shards.plugins);
+		return errno = e;
+	}
+	if (!shards.options.threads)
+		shards.options.threads = 1;
+
+	if (!(shards.jobs = calloc(count, sizeof (job_t))) || !(shards.shards = calloc(count, sizeof (shard_t))))
+		goto done;
+	shards.total = count;
+	for (int i = 0; i < count; i++)
+		shards.jobs[i].files.image_in = images[i];
+
+	run_workers(join_worker, &shards, workers);
+
+	size_t failed = 0;
+	report(&shards, &failed);
+	if (failed)
+	{
+		fprintf(stderr, "%zu of %zu pieces failed\n", failed, shards.total);
+		errno = EXIT_FAILURE;
+		goto done;
+	}
+
+	/*
+	 * every piece must be of the same document, and between them they
+	 * must cover all of it
+	 */
+	const shard_t *first = &shards.shards[0];
+	const shard_t **order = calloc(count, sizeof (shard_t *));
+	if (!order)
+		goto done;
+	errno = EINVAL;
+	for (int i = 0; i < count; i++)
+	{
+		const shard_t *shard = &shards.shards[i];
+		if (shard->set != first->set || shard->count != first->count || shard->total != first->total)
+		{
+			fprintf(stderr, "%s and %s hold pieces of different documents\n", images[0], images[i]);
+			goto check;
+		}
+		if (shard->count != (uint32_t)count)
+		{
+			fprintf(stderr, "The document was split into %" PRIu32 " pieces, but %d images were given\n", shard->count, count);
+			goto check;
+		}
+		if (order[shard->index])
+		{
+			fprintf(stderr, "Piece %" PRIu32 " is in more than one image\n", shard->index);
+			goto check;
+		}
+		order[shard->index] = shard;
+	}
+	uint64_t offset = 0;
+	for (int i = 0; i < count; offset += order[i++]->length)
+		if (order[i]->offset != offset)
+		{
+			fprintf(stderr, "Piece %d doesn't follow on from the one before\n", i);
+			goto check;
+		}
+	if (offset != first->total)
+	{
+		fprintf(stderr, "The pieces don't make up the whole document\n");
+		goto check;
+	}
+	errno = ftruncate(shards.output, first->total) ? errno : EXIT_SUCCESS;
+	if (errno)
+		fprintf(stderr, "Could not write %s\n", file);
+	else
+	{
+		setlocale(LC_NUMERIC, "");
+		printf("ok\t%s\t%'" PRIu64 " bytes from %d pieces\n", file, first->total, count);
+	}
+check:
+	free(order);
+
+done:
+	{
+		int e = errno;
+		if (close(shards.output) < 0 && !e)
+			e = errno;
+		if (e)
+			unlink(file);
+		errno = e;
+	}
+	plugins_unload(&shards.plugins);
+	shards_free(&shards);
+	return errno;
+}
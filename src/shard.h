@@ -0,0 +1,48 @@
+/*
+ * hide ~ A tool for hiding data inside images
+ * Copyright © 2014-2015, albinoloverats ~ Software Development
+ * email: hide@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hide.h"
+
+/*
+ * a document too large for any one image is split into pieces, each of
+ * which is hidden in an image of its own just as any document would be;
+ * every piece begins with a header, so that they can be found in any
+ * order and put back together
+ *
+ * the header is the magic, then the piece's index (from 0) and how many
+ * pieces there are, as 32-bit integers, then the set (random, the same
+ * for every piece of the document), the piece's offset in the document,
+ * its length, and the length of the whole document, as 64-bit integers,
+ * all in network byte order
+ */
+
+#define HIDE_SHARD_MAGIC  "hid1"
+#define HIDE_SHARD_HEADER (4 + 2 * sizeof (uint32_t) + 4 * sizeof (uint64_t))
+
+extern int shard_split(char *document, char *directory, char **images, int count, bool fill, image_options_t options, uint32_t workers);
+extern int shard_join(char *file, char **images, int count, bool fill, image_options_t options, uint32_t workers);
+
+#endif
@@ -31,6 +31,8 @@
 #include <tiffio.h>
 
 #include "hide.h"
+#include "preview.h"
+#include "scratch.h"
 
 #ifndef COMPRESSION_LZMA
     #define COMPRESSION_LZMA 34925
@@ -60,11 +62,15 @@ static int read_tiff(image_info_t *image_info, void (*progress_update)(uint64_t,
 	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &image_info->height);
 	TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &image_info->bpp);
 
-	image_info->buffer = malloc(sizeof (uint8_t *) * image_info->height);
+	if (!(image_info->buffer = scratch_rows(image_info->height, image_info->width * image_info->bpp, SCRATCH_BUDGET(image_info))))
+	{
+		TIFFClose(tif);
+		return errno;
+	}
 	for (uint64_t y = 0; y < image_info->height; y++)
 	{
-		image_info->buffer[y] = malloc(image_info->width * image_info->bpp);
 		TIFFReadScanline(tif, image_info->buffer[y], y, 0);
+		scratch_rows_done(image_info->buffer, y);
 		if (progress_update)
 			progress_update(y, image_info->height);
 	}
@@ -98,28 +104,79 @@ static int write_tiff(image_info_t image_info, void (*progress_update)(uint64_t,
 	for (uint64_t y = 0; y < image_info.height; y++)
 	{
 		TIFFWriteScanline(tif, image_info.buffer[y], y, 0);
-		free(image_info.buffer[y]);
+		scratch_rows_done(image_info.buffer, y);
 		if (progress_update)
 			progress_update(y, image_info.height);
 	}
-	free(image_info.buffer);
+	scratch_rows_free(image_info.buffer);
 
 	TIFFClose(tif);
 
 	return errno;
 }
 
+/*
+ * the capacity only depends on the width and height, so there's no need
+ * to read any further than the header
+ */
 static uint64_t info_tiff(image_info_t *image_info)
 {
-	read_tiff(image_info, NULL);
+	TIFF *tif = TIFFOpen(image_info->file, "r");
+	if (!tif)
+		return 0;
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &image_info->width);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &image_info->height);
+	TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &image_info->bpp);
+	TIFFClose(tif);
 	return HIDE_CAPACITY;
 }
 
+static int preview_tiff(image_info_t *image_info, uint8_t scale)
+{
+	errno = EXIT_SUCCESS;
+
+	TIFF *tif = TIFFOpen(image_info->file, "r");
+	if (!tif)
+		return errno;
+
+	preview_t preview = { NULL, 0, 0, 0, 0, NULL };
+	uint8_t *row = NULL;
+
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint16_t samples = 0;
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+	TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+	if (samples < 3)
+	{
+		errno = ENOTSUP;
+		goto done;
+	}
+
+	if (!(row = malloc(TIFFScanlineSize(tif))) || !preview_start(&preview, image_info, width, height, scale))
+		goto done;
+	for (uint32_t y = 0; y < height; y++)
+	{
+		if (TIFFReadScanline(tif, row, y, 0) < 0)
+		{
+			errno = EIO;
+			break;
+		}
+		preview_row(&preview, y, row, samples, false);
+	}
+
+done:
+	preview_finish(&preview);
+	free(row);
+	TIFFClose(tif);
+
+	return errno;
+}
+
 static void free_tiff(image_info_t image_info)
 {
-	for (uint64_t y = 0; y < image_info.height; y++)
-		free(image_info.buffer[y]);
-	free(image_info.buffer);
+	scratch_rows_free(image_info.buffer);
 }
 
 extern image_type_t *init(void)
@@ -131,5 +188,6 @@ extern image_type_t *init(void)
 	tiff.write = write_tiff;
 	tiff.info = info_tiff;
 	tiff.free = free_tiff;
+	tiff.preview = preview_tiff;
 	return &tiff;
 }
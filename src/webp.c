@@ -32,6 +32,7 @@
 #include <webp/decode.h>
 
 #include "hide.h"
+#include "scratch.h"
 
 static bool is_webp(char *file_name)
 {
@@ -76,12 +77,17 @@ static int read_webp(image_info_t *image_info, void (*progress_update)(uint64_t,
 	uint8_t *img = webpdecode(raw, l, &feat.width, &feat.height);
 	free(raw);
 
-	image_info->buffer = malloc(sizeof (uint8_t *) * image_info->height);
 	l = image_info->width * image_info->bpp;
+	/* libwebp can only decode it whole, but it needn't stay that way */
+	if (!(image_info->buffer = scratch_rows(image_info->height, l, SCRATCH_BUDGET(image_info))))
+	{
+		free(img);
+		return errno;
+	}
 	for (uint64_t y = 0; y < image_info->height; y++)
 	{
-		image_info->buffer[y] = malloc(l);
 		memcpy(image_info->buffer[y], img + y * l, l);
+		scratch_rows_done(image_info->buffer, y);
 		if (progress_update)
 			progress_update(y, image_info->height);
 	}
@@ -104,11 +110,11 @@ static int write_webp(image_info_t image_info, void (*progress_update)(uint64_t,
 	for (uint64_t y = 0; y < image_info.height; y++)
 	{
 		memcpy(img + y * l, image_info.buffer[y], l);
-		free(image_info.buffer[y]);
+		scratch_rows_done(image_info.buffer, y);
 		if (progress_update)
 			progress_update(y, image_info.height);
 	}
-	free(image_info.buffer);
+	scratch_rows_free(image_info.buffer);
 
 	size_t (*webpencode)(const uint8_t *, int, int, int, uint8_t **) = image_info.bpp == 4 ? WebPEncodeLosslessRGBA : WebPEncodeLosslessRGB;
 	l = webpencode(img, image_info.width, image_info.height, l, &raw);
@@ -121,17 +127,85 @@ static int write_webp(image_info_t image_info, void (*progress_update)(uint64_t,
 	return errno;
 }
 
+/*
+ * the capacity only depends on the width and height, so there's no need
+ * to decode any more than the header
+ */
 static uint64_t info_webp(image_info_t *image_info)
 {
-	read_webp(image_info, NULL);
+	FILE *fp = fopen(image_info->file, "rb");
+	if (!fp)
+		return 0;
+
+	uint8_t header[1024];
+	size_t l = fread(header, 1, sizeof header, fp);
+	fclose(fp);
+
+	WebPBitstreamFeatures feat;
+	if (WebPGetFeatures(header, l, &feat) != VP8_STATUS_OK)
+		return 0;
+	image_info->width = feat.width;
+	image_info->height = feat.height;
+	image_info->bpp = feat.has_alpha ? 4 : 3;
 	return HIDE_CAPACITY;
 }
 
+static int preview_webp(image_info_t *image_info, uint8_t scale)
+{
+	errno = EXIT_SUCCESS;
+
+	FILE *fp = fopen(image_info->file, "rb");
+	if (!fp)
+		return errno;
+
+	fseek(fp, 0, SEEK_END);
+	uint64_t l = ftell(fp);
+	uint8_t *raw = malloc(l);
+	fseek(fp, 0, SEEK_SET);
+	if (raw)
+		fread(raw, 1, l, fp);
+	fclose(fp);
+	if (!raw)
+		return errno;
+
+	WebPDecoderConfig config;
+	WebPInitDecoderConfig(&config);
+	if (WebPGetFeatures(raw, l, &config.input) != VP8_STATUS_OK)
+	{
+		errno = EFTYPE;
+		goto done;
+	}
+	/* libwebp decodes straight to the smaller size */
+	config.options.use_scaling = 1;
+	config.options.scaled_width = (config.input.width + scale - 1) / scale;
+	config.options.scaled_height = (config.input.height + scale - 1) / scale;
+	config.output.colorspace = MODE_RGB;
+	if (WebPDecode(raw, l, &config) != VP8_STATUS_OK)
+	{
+		errno = EFTYPE;
+		goto done;
+	}
+
+	image_info->bpp = 3;
+	image_info->width = config.output.width;
+	image_info->height = 0;
+	if ((image_info->buffer = scratch_rows(config.output.height, image_info->width * image_info->bpp, 0)))
+		for (; image_info->height < (uint64_t)config.output.height; image_info->height++)
+		{
+			uint64_t y = image_info->height;
+			memcpy(image_info->buffer[y], config.output.u.RGBA.rgba + y * config.output.u.RGBA.stride, image_info->width * image_info->bpp);
+		}
+	WebPFreeDecBuffer(&config.output);
+
+done:
+	free(raw);
+
+	return errno;
+}
+
 static void free_webp(image_info_t image_info)
 {
-	for (uint64_t y = 0; y < image_info.height; y++)
-		free(image_info.buffer[y]);
-	free(image_info.buffer);
+	scratch_rows_free(image_info.buffer);
 }
 
 extern image_type_t *init(void)
@@ -143,5 +217,6 @@ extern image_type_t *init(void)
 	webp.write = write_webp;
 	webp.info = info_webp;
 	webp.free = free_webp;
+	webp.preview = preview_webp;
 	return &webp;
 }
@@ -16,13 +16,15 @@ function needed
 test $# -ne 1 -a $# -ne 2 && usage
 test -f $HOME/.encryptrc || needed
 
-tmp=$(mktemp)
+# the encrypted data goes straight from one to the other, never to disk
+tmp=$(mktemp -u)
+mkfifo -m 600 $tmp || exit -1
 image=$1
 
 if test $# -eq 2
 then
 	file=$2
-	encrypt --nogui --raw $file $tmp
+	encrypt --nogui --raw $file $tmp &
 
 	out=$(basename $image)
 	ext=${out##*.}
@@ -30,8 +32,9 @@ then
 
 	./hide -f $image $tmp $out-steg.$ext
 else
-	./hide -f $image $tmp
+	./hide -f $image $tmp &
 	decrypt --nogui --raw $tmp .
 fi
 
+wait
 unlink $tmp